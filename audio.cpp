@@ -0,0 +1,608 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef PLANG_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#include "audio.h"
+
+// A decoded sample, as interleaved stereo frames at PLANG_AUDIO_RATE
+struct sample {
+    char *name;
+    int16_t *frames;
+    uint32_t length;
+};
+
+typedef struct sample sample;
+
+struct voice {
+    sample *smp;
+    uint32_t pos;
+    uint64_t started;
+};
+
+typedef struct voice voice;
+
+// Loaded samples. Entries never move once loaded, and nsamples is only
+// bumped once the new entry is complete, so more can be loaded while the
+// mixer is running.
+static sample *samples[PLANG_MAX_SAMPLES];
+static uint32_t nsamples = 0;
+
+static voice voices[PLANG_VOICES];
+
+// Single producer (the VM), single consumer (the mixer) ring of sample IDs.
+// head is only written by the mixer and tail only by the VM.
+static uint32_t ring[PLANG_AUDIO_RING];
+static uint32_t ringHead = 0;
+static uint32_t ringTail = 0;
+static uint32_t ringDropped = 0;
+
+// Posted whenever a command is queued, so an idle mixer can sleep on it.
+static sem_t wakeup;
+
+static audio_sink *sink = NULL;
+static pthread_t mixer;
+static bool running = false;
+
+// Frames mixed since the sink was opened
+static uint64_t mixed = 0;
+
+static uint16_t le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// Read one channel of one frame of PCM data as a 16 bit value
+static int16_t pcmValue(const uint8_t *p, uint32_t format, uint32_t bits) {
+    if (format == 3 && bits == 32) {
+        float f;
+        uint32_t u = le32(p);
+        memcpy(&f, &u, sizeof(f));
+        if (f > 1.0f) f = 1.0f;
+        if (f < -1.0f) f = -1.0f;
+        return (int16_t)(f * 32767.0f);
+    }
+    switch (bits) {
+        case 8: return (int16_t)((p[0] - 128) << 8);
+        case 16: return (int16_t)le16(p);
+        case 24: return (int16_t)((p[1]) | (p[2] << 8));
+        case 32: return (int16_t)(le32(p) >> 16);
+    }
+    return 0;
+}
+
+// Parse a RIFF WAVE file and convert it to the mixer format.
+static bool decodeWav(sample *smp, const uint8_t *data, size_t len) {
+    if (len < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4)) {
+        return false;
+    }
+
+    uint32_t format = 0;
+    uint32_t channels = 0;
+    uint32_t rate = 0;
+    uint32_t bits = 0;
+    const uint8_t *pcm = NULL;
+    uint32_t pcmlen = 0;
+
+    size_t pos = 12;
+    while (pos + 8 <= len) {
+        uint32_t clen = le32(data + pos + 4);
+        const uint8_t *chunk = data + pos + 8;
+        if (clen > len - pos - 8) {
+            clen = len - pos - 8;
+        }
+        if (!memcmp(data + pos, "fmt ", 4) && clen >= 16) {
+            format = le16(chunk);
+            channels = le16(chunk + 2);
+            rate = le32(chunk + 4);
+            bits = le16(chunk + 14);
+            // WAVE_FORMAT_EXTENSIBLE keeps the real format in the sub-format GUID
+            if (format == 0xFFFE && clen >= 26) {
+                format = le16(chunk + 24);
+            }
+        } else if (!memcmp(data + pos, "data", 4)) {
+            pcm = chunk;
+            pcmlen = clen;
+        }
+        pos += 8 + clen + (clen & 1);
+    }
+
+    if (pcm == NULL || channels == 0 || rate == 0 || (format != 1 && format != 3)) {
+        return false;
+    }
+    if (bits != 8 && bits != 16 && bits != 24 && bits != 32) {
+        return false;
+    }
+
+    uint32_t stride = channels * (bits / 8);
+    uint32_t inframes = pcmlen / stride;
+    uint32_t outframes = (uint64_t)inframes * PLANG_AUDIO_RATE / rate;
+
+    smp->frames = (int16_t *)malloc(sizeof(int16_t) * PLANG_AUDIO_CHANNELS * (outframes ? outframes : 1));
+    if (smp->frames == NULL) {
+        return false;
+    }
+    smp->length = outframes;
+
+    // Linear interpolation between input frames, in 16.16 fixed point
+    uint64_t step = ((uint64_t)rate << 16) / PLANG_AUDIO_RATE;
+    uint64_t at = 0;
+    for (uint32_t i = 0; i < outframes; i++, at += step) {
+        uint32_t f0 = at >> 16;
+        uint32_t f1 = f0 + 1 < inframes ? f0 + 1 : f0;
+        int32_t frac = at & 0xFFFF;
+        for (uint32_t c = 0; c < PLANG_AUDIO_CHANNELS; c++) {
+            uint32_t ch = c < channels ? c : channels - 1;
+            int32_t a = pcmValue(pcm + f0 * stride + ch * (bits / 8), format, bits);
+            int32_t b = pcmValue(pcm + f1 * stride + ch * (bits / 8), format, bits);
+            smp->frames[i * PLANG_AUDIO_CHANNELS + c] = a + (((b - a) * frac) >> 16);
+        }
+    }
+    return true;
+}
+
+// Make a loaded sample visible to the mixer
+static uint32_t publish(sample *smp) {
+    samples[nsamples] = smp;
+    __atomic_store_n(&nsamples, nsamples + 1, __ATOMIC_RELEASE);
+    return nsamples - 1;
+}
+
+uint32_t audio_load(const char *filename) {
+    for (uint32_t id = 0; id < nsamples; id++) {
+        if (!strcmp(samples[id]->name, filename)) {
+            return id;
+        }
+    }
+    if (nsamples == PLANG_MAX_SAMPLES) {
+        fprintf(stderr, "Too many samples loading %s\n", filename);
+        return PLANG_MAX_SAMPLES;
+    }
+
+    sample *smp = (sample *)malloc(sizeof(sample));
+    if (smp == NULL) {
+        return PLANG_MAX_SAMPLES;
+    }
+    smp->name = strdup(filename);
+    smp->frames = NULL;
+    smp->length = 0;
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Unable to open sample %s\n", filename);
+        return publish(smp);
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = (uint8_t *)malloc(len > 0 ? len : 1);
+    if (data == NULL || fread(data, 1, len, f) != (size_t)len || !decodeWav(smp, data, len)) {
+        fprintf(stderr, "Unable to decode sample %s\n", filename);
+        smp->length = 0;
+    }
+    free(data);
+    fclose(f);
+    return publish(smp);
+}
+
+void audio_play(uint32_t id) {
+    if (!running) {
+        return;
+    }
+    uint32_t tail = ringTail;
+    uint32_t head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+    if (tail - head == PLANG_AUDIO_RING) {
+        ringDropped++;
+        return;
+    }
+    ring[tail & (PLANG_AUDIO_RING - 1)] = id;
+    __atomic_store_n(&ringTail, tail + 1, __ATOMIC_RELEASE);
+    sem_post(&wakeup);
+}
+
+uint32_t audio_dropped() {
+    return ringDropped;
+}
+
+// Pull everything off the command ring and give each one a voice
+static void takeCommands() {
+    uint32_t head = ringHead;
+    uint32_t tail = __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        uint32_t id = ring[head & (PLANG_AUDIO_RING - 1)];
+        head++;
+        if (id >= __atomic_load_n(&nsamples, __ATOMIC_ACQUIRE) || samples[id]->length == 0) {
+            continue;
+        }
+
+        voice *v = &voices[0];
+        for (int i = 0; i < PLANG_VOICES; i++) {
+            if (voices[i].smp == NULL) {
+                v = &voices[i];
+                break;
+            }
+            if (voices[i].started < v->started) {
+                v = &voices[i];
+            }
+        }
+        v->smp = samples[id];
+        v->pos = 0;
+        v->started = mixed;
+    }
+    __atomic_store_n(&ringHead, head, __ATOMIC_RELEASE);
+}
+
+static bool voicesActive() {
+    for (int i = 0; i < PLANG_VOICES; i++) {
+        if (voices[i].smp != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void mixPeriod(int16_t *out) {
+    int32_t acc[PLANG_AUDIO_PERIOD * PLANG_AUDIO_CHANNELS];
+    memset(acc, 0, sizeof(acc));
+
+    for (int i = 0; i < PLANG_VOICES; i++) {
+        voice *v = &voices[i];
+        if (v->smp == NULL) {
+            continue;
+        }
+        uint32_t n = v->smp->length - v->pos;
+        if (n > PLANG_AUDIO_PERIOD) {
+            n = PLANG_AUDIO_PERIOD;
+        }
+        const int16_t *src = v->smp->frames + v->pos * PLANG_AUDIO_CHANNELS;
+        for (uint32_t j = 0; j < n * PLANG_AUDIO_CHANNELS; j++) {
+            acc[j] += src[j];
+        }
+        v->pos += n;
+        if (v->pos >= v->smp->length) {
+            v->smp = NULL;
+        }
+    }
+
+    for (uint32_t j = 0; j < PLANG_AUDIO_PERIOD * PLANG_AUDIO_CHANNELS; j++) {
+        int32_t s = acc[j];
+        if (s > 32767) s = 32767;
+        if (s < -32768) s = -32768;
+        out[j] = s;
+    }
+}
+
+static uint64_t monotonicNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *mixerThread(void *arg) {
+    int16_t out[PLANG_AUDIO_PERIOD * PLANG_AUDIO_CHANNELS];
+    uint64_t period = 1000000000ULL * PLANG_AUDIO_PERIOD / PLANG_AUDIO_RATE;
+    uint64_t next = monotonicNanos();
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        takeCommands();
+
+        // With nothing to play there's no point waking every period. Sleep
+        // until the VM queues something, then let the sink know how long
+        // it has been quiet for.
+        if (!voicesActive()) {
+            uint64_t slept = monotonicNanos();
+            sem_wait(&wakeup);
+            uint64_t now = monotonicNanos();
+            if (sink->resume) {
+                sink->resume(sink, (now - slept) * PLANG_AUDIO_RATE / 1000000000ULL);
+            }
+            next = now;
+            continue;
+        }
+
+        // Use up any outstanding posts that the commands above satisfied
+        while (sem_trywait(&wakeup) == 0);
+
+        mixPeriod(out);
+        sink->write(sink, out, PLANG_AUDIO_PERIOD);
+        mixed += PLANG_AUDIO_PERIOD;
+
+        if (sink->paced) {
+            next += period;
+            struct timespec ts;
+            ts.tv_sec = next / 1000000000ULL;
+            ts.tv_nsec = next % 1000000000ULL;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Null sink: throws everything away, but still runs in real time so voices
+// finish when they would on a real device.
+
+static bool nullOpen(audio_sink *s, const char *arg) {
+    return true;
+}
+
+static void nullWrite(audio_sink *s, const int16_t *frames, uint32_t count) {
+}
+
+static void nullClose(audio_sink *s) {
+}
+
+static audio_sink nullSink = { "null", true, nullOpen, nullWrite, NULL, nullClose, NULL };
+
+// WAV sink: records the mixed output to a file, including the silences
+// between sounds, so a headless run can be listened to or compared later.
+
+struct wavout {
+    FILE *f;
+    uint32_t frames;
+};
+
+static bool wavOpen(audio_sink *s, const char *arg) {
+    wavout *w = (wavout *)malloc(sizeof(wavout));
+    if (w == NULL || arg == NULL) {
+        free(w);
+        return false;
+    }
+    w->f = fopen(arg, "wb");
+    if (!w->f) {
+        free(w);
+        return false;
+    }
+    w->frames = 0;
+
+    // Header is filled in properly on close when the length is known
+    uint8_t header[44];
+    memset(header, 0, sizeof(header));
+    fwrite(header, 1, sizeof(header), w->f);
+    s->priv = w;
+    return true;
+}
+
+static void wavWrite(audio_sink *s, const int16_t *frames, uint32_t count) {
+    wavout *w = (wavout *)s->priv;
+    uint8_t buf[PLANG_AUDIO_PERIOD * PLANG_AUDIO_CHANNELS * 2];
+    uint32_t n = count * PLANG_AUDIO_CHANNELS;
+    for (uint32_t i = 0; i < n; i++) {
+        put16(buf + i * 2, frames[i]);
+    }
+    fwrite(buf, 2, n, w->f);
+    w->frames += count;
+}
+
+static void wavResume(audio_sink *s, uint64_t idle) {
+    int16_t silence[PLANG_AUDIO_PERIOD * PLANG_AUDIO_CHANNELS];
+    memset(silence, 0, sizeof(silence));
+    while (idle > 0) {
+        uint32_t n = idle > PLANG_AUDIO_PERIOD ? PLANG_AUDIO_PERIOD : idle;
+        wavWrite(s, silence, n);
+        idle -= n;
+    }
+}
+
+static void wavClose(audio_sink *s) {
+    wavout *w = (wavout *)s->priv;
+    uint32_t bytes = w->frames * PLANG_AUDIO_CHANNELS * 2;
+    uint8_t header[44];
+
+    memcpy(header, "RIFF", 4);
+    put32(header + 4, 36 + bytes);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put32(header + 16, 16);
+    put16(header + 20, 1);
+    put16(header + 22, PLANG_AUDIO_CHANNELS);
+    put32(header + 24, PLANG_AUDIO_RATE);
+    put32(header + 28, PLANG_AUDIO_RATE * PLANG_AUDIO_CHANNELS * 2);
+    put16(header + 32, PLANG_AUDIO_CHANNELS * 2);
+    put16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put32(header + 40, bytes);
+
+    fseek(w->f, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), w->f);
+    fclose(w->f);
+    free(w);
+}
+
+static audio_sink wavSink = { "wav", true, wavOpen, wavWrite, wavResume, wavClose, NULL };
+
+// aplay sink: the mixed output streamed as raw PCM to an aplay process, for
+// builds without ALSA of their own. aplay blocks on the device, and we
+// block on it through a small socket buffer, so no pacing needed. A socket
+// rather than a pipe lets a write to an aplay that has gone fail rather
+// than raise SIGPIPE.
+
+struct aplayout {
+    int fd;
+    pid_t pid;
+};
+
+typedef struct aplayout aplayout;
+
+extern char **environ;
+
+static bool aplayOpen(audio_sink *s, const char *arg) {
+    char rate[16];
+    char device[256];
+    snprintf(rate, sizeof(rate), "%u", PLANG_AUDIO_RATE);
+    snprintf(device, sizeof(device), "-D%s", arg ? arg : "default");
+    char channels[] = { '0' + PLANG_AUDIO_CHANNELS, 0 };
+    char *const argv[] = { (char *)"aplay", (char *)"-q", (char *)"-t", (char *)"raw", (char *)"-f",
+        (char *)"S16_LE", (char *)"-r", rate, (char *)"-c", channels, (char *)"--buffer-time=50000", device, NULL };
+
+    aplayout *a = (aplayout *)malloc(sizeof(aplayout));
+    int fds[2];
+    if (a == NULL || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        free(a);
+        return false;
+    }
+    int small = PLANG_AUDIO_PERIOD * PLANG_AUDIO_CHANNELS * 2 * 4;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDIN_FILENO);
+    int err = posix_spawnp(&a->pid, "aplay", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (err != 0) {
+        close(fds[0]);
+        free(a);
+        return false;
+    }
+    a->fd = fds[0];
+    s->priv = a;
+    return true;
+}
+
+static void aplayWrite(audio_sink *s, const int16_t *frames, uint32_t count) {
+    aplayout *a = (aplayout *)s->priv;
+    const char *p = (const char *)frames;
+    size_t left = count * PLANG_AUDIO_CHANNELS * 2;
+    while (left > 0 && a->fd >= 0) {
+        ssize_t n = send(a->fd, p, left, MSG_NOSIGNAL);
+        if (n < 0) {
+            // aplay has gone; carry on without it
+            close(a->fd);
+            a->fd = -1;
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+}
+
+static void aplayClose(audio_sink *s) {
+    aplayout *a = (aplayout *)s->priv;
+    if (a->fd >= 0) {
+        close(a->fd);
+    }
+    // It finishes what it has been given before it goes
+    waitpid(a->pid, NULL, 0);
+    free(a);
+}
+
+static audio_sink aplaySink = { "aplay", false, aplayOpen, aplayWrite, NULL, aplayClose, NULL };
+
+#ifdef PLANG_ALSA
+// ALSA sink: the device blocks us, so no pacing needed.
+
+static bool alsaOpen(audio_sink *s, const char *arg) {
+    snd_pcm_t *pcm;
+    if (snd_pcm_open(&pcm, arg ? arg : "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+        return false;
+    }
+    // Keep the buffer to a few periods so what we mix is heard promptly
+    if (snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+            PLANG_AUDIO_CHANNELS, PLANG_AUDIO_RATE, 1,
+            4 * 1000000ULL * PLANG_AUDIO_PERIOD / PLANG_AUDIO_RATE) < 0) {
+        snd_pcm_close(pcm);
+        return false;
+    }
+    s->priv = pcm;
+    return true;
+}
+
+static void alsaWrite(audio_sink *s, const int16_t *frames, uint32_t count) {
+    snd_pcm_t *pcm = (snd_pcm_t *)s->priv;
+    snd_pcm_sframes_t n = snd_pcm_writei(pcm, frames, count);
+    if (n < 0) {
+        snd_pcm_recover(pcm, n, 1);
+    }
+}
+
+static void alsaResume(audio_sink *s, uint64_t idle) {
+    // We will have underrun while idle; get the device ready to go again
+    snd_pcm_prepare((snd_pcm_t *)s->priv);
+}
+
+static void alsaClose(audio_sink *s) {
+    snd_pcm_t *pcm = (snd_pcm_t *)s->priv;
+    snd_pcm_drain(pcm);
+    snd_pcm_close(pcm);
+}
+
+static audio_sink alsaSink = { "alsa", false, alsaOpen, alsaWrite, alsaResume, alsaClose, NULL };
+#endif
+
+bool audio_open(const char *spec) {
+    const char *arg = strchr(spec, ':');
+    size_t len = arg ? (size_t)(arg - spec) : strlen(spec);
+    if (arg) {
+        arg++;
+    }
+
+    audio_sink *sinks[] = {
+        &nullSink,
+        &wavSink,
+        &aplaySink,
+#ifdef PLANG_ALSA
+        &alsaSink,
+#endif
+    };
+
+    for (size_t i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++) {
+        if (strlen(sinks[i]->name) == len && !strncmp(sinks[i]->name, spec, len)) {
+            if (!sinks[i]->open(sinks[i], arg)) {
+                return false;
+            }
+            sink = sinks[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool audio_start() {
+    if (sink == NULL) {
+        return false;
+    }
+    memset(voices, 0, sizeof(voices));
+    sem_init(&wakeup, 0, 0);
+    running = true;
+    if (pthread_create(&mixer, NULL, mixerThread, NULL) != 0) {
+        running = false;
+        return false;
+    }
+    return true;
+}
+
+void audio_close() {
+    if (running) {
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        sem_post(&wakeup);
+        pthread_join(mixer, NULL);
+    }
+    if (sink != NULL) {
+        sink->close(sink);
+        sink = NULL;
+    }
+}
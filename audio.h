@@ -0,0 +1,77 @@
+#ifndef _AUDIO_H
+#define _AUDIO_H
+
+#include <stdint.h>
+
+// Format everything is converted to and mixed at
+#ifndef PLANG_AUDIO_RATE
+#define PLANG_AUDIO_RATE 44100
+#endif
+#define PLANG_AUDIO_CHANNELS 2
+
+// Frames mixed per pass. Smaller periods give lower trigger latency at the
+// cost of more wakeups while sound is playing.
+#ifndef PLANG_AUDIO_PERIOD
+#define PLANG_AUDIO_PERIOD 64
+#endif
+
+// Maximum number of samples that can sound at once. When they are all busy
+// a new PLAY takes over the voice that has been playing longest.
+#ifndef PLANG_VOICES
+#define PLANG_VOICES 16
+#endif
+
+// Size of the PLAY command ring between the VM and the mixer. Must be a
+// power of two.
+#ifndef PLANG_AUDIO_RING
+#define PLANG_AUDIO_RING 256
+#endif
+
+// Maximum number of distinct samples that can be loaded
+#ifndef PLANG_MAX_SAMPLES
+#define PLANG_MAX_SAMPLES 1024
+#endif
+
+struct audio_sink;
+
+// Where mixed audio ends up. write() is handed PLANG_AUDIO_PERIOD frames
+// at a time. Sinks that don't block on a device of their own set paced so
+// the mixer keeps them running in real time.
+struct audio_sink {
+    const char *name;
+    bool paced;
+    bool (*open)(struct audio_sink *s, const char *arg);
+    void (*write)(struct audio_sink *s, const int16_t *frames, uint32_t count);
+    // Called when the mixer wakes from being idle for the given number of
+    // frames.
+    void (*resume)(struct audio_sink *s, uint64_t idle);
+    void (*close)(struct audio_sink *s);
+    void *priv;
+};
+
+typedef struct audio_sink audio_sink;
+
+// Pick and open a sink by specification: "null", "wav:<file>",
+// "aplay[:<device>]" or, when built with ALSA, "alsa[:<device>]".
+bool audio_open(const char *spec);
+
+// Decode a WAV file into memory and return its sample ID. A file that can't
+// be loaded still gets an ID; it just plays silence. Loading a file that is
+// already loaded returns the ID it already has. Safe to call while the
+// mixer is running, but only from one thread at a time.
+uint32_t audio_load(const char *filename);
+
+// Start the mixer thread.
+bool audio_start();
+
+// Queue a sample to be played. Safe to call from the VM thread while the
+// mixer is running; never blocks.
+void audio_play(uint32_t id);
+
+// Stop the mixer and close the sink.
+void audio_close();
+
+// Number of PLAY commands dropped because the ring was full
+uint32_t audio_dropped();
+
+#endif
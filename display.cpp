@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <ncurses.h>
+
+#include "display.h"
+
+uint32_t displayValue[PLANG_DISPLAYS];
+uint32_t displayDirty = 0;
+uint32_t displayPins = 0;
+bool displayPinsDirty = false;
+
+static display_backend *backend = NULL;
+static uint32_t frame = 1000 / PLANG_FPS;
+static uint32_t nextFrame = 0;
+
+// Keyboard for backends that don't own the terminal: plain reads from
+// stdin, with a tty switched out of line mode so keys arrive as pressed.
+static bool stdinOpen = true;
+static bool termSaved = false;
+static struct termios savedTerm;
+
+static void rawStdin() {
+    if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &savedTerm) == 0) {
+        struct termios t = savedTerm;
+        t.c_lflag &= ~(ICANON | ECHO);
+        t.c_cc[VMIN] = 1;
+        t.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &t);
+        termSaved = true;
+    }
+}
+
+static void restoreStdin() {
+    if (termSaved) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &savedTerm);
+        termSaved = false;
+    }
+}
+
+static int stdinKey(display_backend *d) {
+    struct pollfd pfd;
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    if (!stdinOpen || poll(&pfd, 1, 0) <= 0) {
+        return -1;
+    }
+    unsigned char c;
+    if (read(STDIN_FILENO, &c, 1) != 1) {
+        // End of input; stop anyone sleeping on it
+        stdinOpen = false;
+        return -1;
+    }
+    return c;
+}
+
+// Curses backend: the original screen layout, with the display on the top
+// line and the inputs underneath.
+
+static bool cursesOpen(display_backend *d, const char *arg) {
+    initscr();
+    raw();
+    cbreak();
+    noecho();
+    timeout(0);
+    return true;
+}
+
+static void cursesShow(display_backend *d, uint32_t now, uint32_t id, uint32_t value) {
+    mvprintw(id * 2, 0, "Display: %04d\n", value);
+}
+
+static void cursesInputs(display_backend *d, uint32_t now, uint32_t pins) {
+    mvprintw(1, 0, "Inputs: ");
+    for (int i = 0; i < PLANG_SHOWN_PINS; i++) {
+        mvprintw(1, 10 + i, "%d", (pins >> i) & 1);
+    }
+}
+
+static void cursesFlush(display_backend *d) {
+    refresh();
+}
+
+static int cursesKey(display_backend *d) {
+    int c = getch();
+    return c == ERR ? -1 : c;
+}
+
+static void cursesClose(display_backend *d) {
+    endwin();
+}
+
+static display_backend cursesBackend = {
+    "curses", cursesOpen, cursesShow, cursesInputs, cursesFlush, cursesKey, cursesClose, NULL
+};
+
+// Null backend: shows nothing at all.
+
+static bool nullOpen(display_backend *d, const char *arg) {
+    rawStdin();
+    return true;
+}
+
+static void nullShow(display_backend *d, uint32_t now, uint32_t id, uint32_t value) {
+}
+
+static void nullInputs(display_backend *d, uint32_t now, uint32_t pins) {
+}
+
+static void nullFlush(display_backend *d) {
+}
+
+static void nullClose(display_backend *d) {
+    restoreStdin();
+}
+
+static display_backend nullBackend = {
+    "null", nullOpen, nullShow, nullInputs, nullFlush, stdinKey, nullClose, NULL
+};
+
+// Log backend: a timestamped line per change, written through a large
+// buffer so logging costs next to nothing until it is closed.
+
+#define LOG_BUFFER 65536
+
+static bool logOpen(display_backend *d, const char *arg) {
+    FILE *f = arg ? fopen(arg, "w") : NULL;
+    if (f == NULL) {
+        return false;
+    }
+    setvbuf(f, NULL, _IOFBF, LOG_BUFFER);
+    d->priv = f;
+    rawStdin();
+    return true;
+}
+
+static void logShow(display_backend *d, uint32_t now, uint32_t id, uint32_t value) {
+    fprintf((FILE *)d->priv, "%u display %u %u\n", now, id, value);
+}
+
+static void logInputs(display_backend *d, uint32_t now, uint32_t pins) {
+    fprintf((FILE *)d->priv, "%u inputs ", now);
+    for (int i = 0; i < PLANG_SHOWN_PINS; i++) {
+        fputc('0' + ((pins >> i) & 1), (FILE *)d->priv);
+    }
+    fputc('\n', (FILE *)d->priv);
+}
+
+static void logFlush(display_backend *d) {
+}
+
+static void logClose(display_backend *d) {
+    fclose((FILE *)d->priv);
+    restoreStdin();
+}
+
+static display_backend logBackend = {
+    "log", logOpen, logShow, logInputs, logFlush, stdinKey, logClose, NULL
+};
+
+bool display_open(const char *spec, uint32_t fps) {
+    const char *arg = strchr(spec, ':');
+    size_t len = arg ? (size_t)(arg - spec) : strlen(spec);
+    if (arg) {
+        arg++;
+    }
+
+    display_backend *backends[] = { &cursesBackend, &nullBackend, &logBackend };
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strlen(backends[i]->name) == len && !strncmp(backends[i]->name, spec, len)) {
+            if (!backends[i]->open(backends[i], arg)) {
+                return false;
+            }
+            backend = backends[i];
+            frame = fps > 0 ? 1000 / fps : 0;
+            // Draw everything on the first frame
+            displayDirty = (1ULL << PLANG_DISPLAYS) - 1;
+            displayPinsDirty = true;
+            nextFrame = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool display_update(uint32_t now, uint32_t *due) {
+    if (displayDirty == 0 && !displayPinsDirty) {
+        return true;
+    }
+    if ((int32_t)(now - nextFrame) < 0) {
+        *due = nextFrame;
+        return false;
+    }
+
+    for (uint32_t id = 0; id < PLANG_DISPLAYS; id++) {
+        if (displayDirty & (1 << id)) {
+            backend->show(backend, now, id, displayValue[id]);
+        }
+    }
+    if (displayPinsDirty) {
+        backend->inputs(backend, now, displayPins);
+    }
+    backend->flush(backend);
+
+    displayDirty = 0;
+    displayPinsDirty = false;
+    nextFrame = now + frame;
+    return true;
+}
+
+int display_key() {
+    if (backend == NULL) {
+        return -1;
+    }
+    return backend->key(backend);
+}
+
+int display_keyfd() {
+    return stdinOpen ? STDIN_FILENO : -1;
+}
+
+void display_close() {
+    if (backend != NULL) {
+        backend->close(backend);
+        backend = NULL;
+    }
+}
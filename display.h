@@ -0,0 +1,79 @@
+#ifndef _DISPLAY_H
+#define _DISPLAY_H
+
+#include <stdint.h>
+
+// Number of separate displays a script can drive
+#ifndef PLANG_DISPLAYS
+#define PLANG_DISPLAYS 1
+#endif
+
+// Default number of times a second changes are pushed out to the backend
+#ifndef PLANG_FPS
+#define PLANG_FPS 30
+#endif
+
+// Number of input pins shown by backends that show them
+#define PLANG_SHOWN_PINS 10
+
+struct display_backend;
+
+// Something that shows display values. Backends only ever see values that
+// changed since the last frame, at most once per frame.
+struct display_backend {
+    const char *name;
+    bool (*open)(struct display_backend *d, const char *arg);
+    void (*show)(struct display_backend *d, uint32_t now, uint32_t id, uint32_t value);
+    void (*inputs)(struct display_backend *d, uint32_t now, uint32_t pins);
+    void (*flush)(struct display_backend *d);
+    // Next key press, or -1 if there isn't one waiting
+    int (*key)(struct display_backend *d);
+    void (*close)(struct display_backend *d);
+    void *priv;
+};
+
+typedef struct display_backend display_backend;
+
+// State shared with the inline setters below. Only the display module
+// should touch these directly.
+extern uint32_t displayValue[PLANG_DISPLAYS];
+extern uint32_t displayDirty;
+extern uint32_t displayPins;
+extern bool displayPinsDirty;
+
+// Pick and open a backend by specification: "curses", "null" or
+// "log:<file>".
+bool display_open(const char *spec, uint32_t fps);
+
+// Record a new value for a display. Cheap enough to call on every DISPLAY:
+// nothing is drawn until the next frame, and only if the value changed.
+static inline void display_set(uint32_t id, uint32_t value) {
+    if (id < PLANG_DISPLAYS && displayValue[id] != value) {
+        displayValue[id] = value;
+        displayDirty |= 1 << id;
+    }
+}
+
+// Record the levels of the shown input pins, one bit per pin.
+static inline void display_inputs(uint32_t pins) {
+    if (pins != displayPins) {
+        displayPins = pins;
+        displayPinsDirty = true;
+    }
+}
+
+// Push out anything that changed if a frame is due. Returns false if there
+// is still something waiting, in which case *due is set to the time in
+// milliseconds that it will go out.
+bool display_update(uint32_t now, uint32_t *due);
+
+// Next key press from whatever is acting as the keyboard, or -1
+int display_key();
+
+// File descriptor that key presses arrive on, to sleep on, or -1 if there
+// is no keyboard any more.
+int display_keyfd();
+
+void display_close();
+
+#endif
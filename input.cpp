@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/input.h>
+
+#include "input.h"
+
+// Every source's descriptor is registered with one epoll instance, whose
+// own descriptor is what the main loop sleeps on. It is level triggered,
+// so a source that still has input after its read turns up again, behind
+// any others that are waiting.
+static int epfd = -1;
+static input_source *sources[PLANG_INPUTS];
+static uint32_t nsources = 0;
+
+// Changes decoded from one read. The shortest record, a line like "0 1",
+// is four bytes.
+static plang_input batch[PLANG_INPUT_BATCH / 4 + 1];
+
+// Open a file, FIFO or device to read from without blocking. A FIFO is
+// opened for writing as well, so it doesn't read as ended whenever the
+// last producer closes it.
+static int openStream(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return -1;
+    }
+    return open(path, (S_ISFIFO(st.st_mode) ? O_RDWR : O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+}
+
+// Text records, one change per line: "<pin> <level>". Blank lines and
+// lines starting with # are skipped. Pins the VM doesn't have are left
+// for it to ignore.
+static bool textDecode(const char *rec, uint32_t len, plang_input *change) {
+    const char *p = rec;
+    const char *end = rec + len;
+    uint32_t pin = 0;
+    uint32_t digits = 0;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    while (p < end && *p >= '0' && *p <= '9' && digits < 9) {
+        pin = pin * 10 + (*p++ - '0');
+        digits++;
+    }
+    if (digits == 0 || p == end || (*p != ' ' && *p != '\t')) {
+        return false;
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p == end || (*p != '0' && *p != '1')) {
+        return false;
+    }
+    change->pin = pin;
+    change->level = *p++ - '0';
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p == end;
+}
+
+// A named pipe, made if it doesn't exist yet, that any number of producers
+// can write lines to.
+static bool fifoOpen(input_source *src, const char *arg) {
+    if (arg == NULL) {
+        return false;
+    }
+    if (mkfifo(arg, 0600) == 0) {
+        src->path = strdup(arg);
+    } else if (errno != EEXIST) {
+        return false;
+    }
+    src->fd = openStream(arg);
+    return src->fd >= 0;
+}
+
+// A Unix datagram socket bound to path. Each datagram holds whole lines,
+// so a producer can send a burst of changes in one go.
+static bool unixOpen(input_source *src, const char *arg) {
+    struct sockaddr_un addr;
+    if (arg == NULL || strlen(arg) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    // Left behind by an earlier run; anything else in the way stays put
+    struct stat st;
+    if (lstat(arg, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(arg);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, arg);
+    src->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (src->fd < 0) {
+        return false;
+    }
+    if (bind(src->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        return false;
+    }
+    src->path = strdup(arg);
+    src->packets = true;
+    return true;
+}
+
+// A descriptor inherited from whoever started us, such as a pipe from a
+// producer: plang -i fd:3 3< <(producer)
+static bool fdOpen(input_source *src, const char *arg) {
+    if (arg == NULL) {
+        return false;
+    }
+    char *end;
+    long fd = strtol(arg, &end, 10);
+    if (*end != 0 || fd < 0) {
+        return false;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return false;
+    }
+    src->fd = fd;
+    return true;
+}
+
+// Key events in the kernel's input_event format, from an event device or
+// anything else producing them. The pin is the key code, and like a button
+// on a pulled-up input it reads 0 while the key is held down. Repeats,
+// and every other kind of event, are skipped.
+static bool evdevOpen(input_source *src, const char *arg) {
+    if (arg == NULL) {
+        return false;
+    }
+    src->fd = openStream(arg);
+    return src->fd >= 0;
+}
+
+static bool evdevDecode(const char *rec, uint32_t len, plang_input *change) {
+    struct input_event ev;
+    memcpy(&ev, rec, sizeof(ev));
+    if (ev.type != EV_KEY || ev.value > 1) {
+        return false;
+    }
+    change->pin = ev.code;
+    change->level = ev.value ? 0 : 1;
+    return true;
+}
+
+static const input_backend fifoBackend = { "fifo", fifoOpen, 0, textDecode };
+static const input_backend unixBackend = { "unix", unixOpen, 0, textDecode };
+static const input_backend fdBackend = { "fd", fdOpen, 0, textDecode };
+static const input_backend evdevBackend = { "evdev", evdevOpen, sizeof(struct input_event), evdevDecode };
+
+static void sourceClose(input_source *src) {
+    if (src->fd >= 0) {
+        if (epfd >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+        close(src->fd);
+    }
+    if (src->path) {
+        unlink(src->path);
+        free(src->path);
+    }
+    free(src->buf);
+    free(src);
+}
+
+bool input_open(const char *spec) {
+    const char *arg = strchr(spec, ':');
+    size_t len = arg ? (size_t)(arg - spec) : strlen(spec);
+    if (arg) {
+        arg++;
+    }
+
+    const input_backend *backends[] = { &fifoBackend, &unixBackend, &fdBackend, &evdevBackend };
+
+    if (nsources == PLANG_INPUTS) {
+        return false;
+    }
+    if (epfd < 0) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strlen(backends[i]->name) == len && !strncmp(backends[i]->name, spec, len)) {
+            input_source *src = (input_source *)calloc(1, sizeof(input_source));
+            if (src == NULL) {
+                return false;
+            }
+            src->backend = backends[i];
+            src->fd = -1;
+            src->buf = (char *)malloc(PLANG_INPUT_BATCH);
+            if (src->buf == NULL || !backends[i]->open(src, arg)) {
+                sourceClose(src);
+                return false;
+            }
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = src;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+                sourceClose(src);
+                return false;
+            }
+            sources[nsources++] = src;
+            return true;
+        }
+    }
+    return false;
+}
+
+int input_fd() {
+    return nsources > 0 ? epfd : -1;
+}
+
+// A source that has ended, or failed, is dropped from the set
+static void sourceDrop(input_source *src) {
+    for (uint32_t i = 0; i < nsources; i++) {
+        if (sources[i] == src) {
+            sources[i] = sources[--nsources];
+            break;
+        }
+    }
+    sourceClose(src);
+}
+
+uint32_t input_read(const plang_input **changes) {
+    struct epoll_event ev;
+    *changes = batch;
+    if (nsources == 0 || epoll_wait(epfd, &ev, 1, 0) != 1) {
+        return 0;
+    }
+
+    input_source *src = (input_source *)ev.data.ptr;
+    ssize_t got = read(src->fd, src->buf + src->held, PLANG_INPUT_BATCH - src->held);
+    if (got <= 0) {
+        if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+            sourceDrop(src);
+        }
+        return 0;
+    }
+
+    uint32_t n = 0;
+    uint32_t size = src->backend->record;
+    const char *p = src->buf;
+    const char *end = src->buf + src->held + got;
+    while (p < end) {
+        const char *next;
+        uint32_t len;
+        if (size > 0) {
+            if ((uint32_t)(end - p) < size) {
+                break;
+            }
+            len = size;
+            next = p + size;
+        } else {
+            const char *nl = (const char *)memchr(p, '\n', end - p);
+            if (nl == NULL && !src->packets) {
+                break;
+            }
+            len = (nl ? nl : end) - p;
+            next = nl ? nl + 1 : end;
+        }
+        if (src->backend->decode(p, len, &batch[n])) {
+            n++;
+        }
+        p = next;
+    }
+
+    // Keep the start of a split record for next time. A line that fills
+    // the whole buffer can't be anything we understand, so it goes.
+    src->held = end - p;
+    if (src->held == PLANG_INPUT_BATCH) {
+        src->held = 0;
+    }
+    memmove(src->buf, p, src->held);
+    return n;
+}
+
+void input_close() {
+    while (nsources > 0) {
+        sourceClose(sources[--nsources]);
+    }
+    if (epfd >= 0) {
+        close(epfd);
+        epfd = -1;
+    }
+}
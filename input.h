@@ -0,0 +1,65 @@
+#ifndef _PLANG_INPUT_H
+#define _PLANG_INPUT_H
+
+#include <stdint.h>
+
+#include "plang.h"
+
+// Most input sources that can be open at once
+#ifndef PLANG_INPUTS
+#define PLANG_INPUTS 8
+#endif
+
+// Most bytes taken from a source in one read. Everything decoded from one
+// read is handed over as one batch.
+#ifndef PLANG_INPUT_BATCH
+#define PLANG_INPUT_BATCH 65536
+#endif
+
+struct input_source;
+
+// A kind of place pin changes come from, besides the keyboard. open() sets
+// up the source's descriptor from what follows the name in its
+// specification. Records are either lines of text or all record bytes
+// long; decode() is given one at a time and returns false for anything
+// that isn't a pin change.
+struct input_backend {
+    const char *name;
+    bool (*open)(struct input_source *src, const char *arg);
+    uint32_t record;
+    bool (*decode)(const char *rec, uint32_t len, plang_input *change);
+};
+
+typedef struct input_backend input_backend;
+
+// One open source. A read from a stream can end part way through a
+// record, in which case the start of it is held back for the next.
+// Sources that deliver whole messages never split a record.
+struct input_source {
+    const input_backend *backend;
+    int fd;
+    bool packets;
+    // Created by open() and removed again on close, or NULL
+    char *path;
+    uint32_t held;
+    char *buf;
+};
+
+typedef struct input_source input_source;
+
+// Open a source by specification and add it to those being watched:
+// "fifo:<path>", "unix:<path>", "fd:<n>" or "evdev:<path>".
+bool input_open(const char *spec);
+
+// File descriptor that becomes readable when some source has input, to
+// sleep on, or -1 if there are no sources.
+int input_fd();
+
+// Read from one source that has input waiting, with a single read, and
+// set *changes to what it held, in order. Returns how many there are, 0
+// if nothing was waiting. Sources take turns when several are busy.
+uint32_t input_read(const plang_input **changes);
+
+void input_close();
+
+#endif
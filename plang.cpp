@@ -2,9 +2,28 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <unistd.h>
-#include <sys/time.h>
-#include <ncurses.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <signal.h>
+
+#include "plang.h"
+#ifndef PLANG_LIBRARY
+#include "audio.h"
+#include "display.h"
+#include "input.h"
+#endif
 
 const uint32_t    L           = 0x0000;
 const uint32_t    V           = 0x0001;
@@ -24,6 +43,135 @@ const uint32_t    DEC         = 0x0080;
 const uint32_t    INC         = 0x0090;
 const uint32_t    IF          = 0x00A0;
 const uint32_t    PLAY        = 0x00B0;
+const uint32_t    ARITH       = 0x00C0;
+const uint32_t    LOAD        = 0x00D0;
+const uint32_t    STORE       = 0x00E0;
+const uint32_t    ON          = 0x00F0;
+
+// Compiled instruction set.  plang_compile() lowers every parse-level op
+// into one of these, with a separate handler for each operand mode so that
+// plang_exec() never has to test L/V at run time.
+#define PLANG_IF_XOPS(X, OPER) \
+    X(IF_##OPER##_LL) X(IF_##OPER##_LV) X(IF_##OPER##_VL) X(IF_##OPER##_VV)
+
+// Conditional branches: an IF whose alternate is a GOTO, fused by the
+// optimizer. Jumps to target when the condition is true.
+#define PLANG_BR_XOPS(X, OPER) \
+    X(BR_##OPER##_LL) X(BR_##OPER##_LV) X(BR_##OPER##_VL) X(BR_##OPER##_VV)
+
+// Three address arithmetic: target is the slot the result of a OPER b
+// goes to, rather than a jump target. The compiler works out arithmetic on
+// two literals itself, so LL is only there to keep the modes in step with
+// the IF family.
+#define PLANG_ARITH_XOPS(X, OPER) \
+    X(OPER##_LL) X(OPER##_LV) X(OPER##_VL) X(OPER##_VV)
+
+// The IF and BR families must list the operators in OPERATOR order, and the
+// arithmetic family in ARITHOP order. Indexed instructions find the array
+// or table they work on through target, which is an index into the
+// constant pool, and so do the ON instructions their jump table. The last
+// three are superinstructions for common countdown sequences: DEC x /
+// DISPLAY x, DEC x / IF x gt n goto, and all three together.
+#define PLANG_XOPS(X) \
+    X(HALT) X(NOP) X(MODE_L) X(MODE_V) X(CALL) X(GOTO) X(RETURN) \
+    X(SET_L) X(SET_V) X(DISPLAY_L) X(DISPLAY_V) X(DELAY_L) X(DELAY_V) \
+    X(DEC) X(INC) X(PLAY) \
+    PLANG_IF_XOPS(X, READS) PLANG_IF_XOPS(X, EQ) PLANG_IF_XOPS(X, GE) \
+    PLANG_IF_XOPS(X, GT) PLANG_IF_XOPS(X, LE) PLANG_IF_XOPS(X, LT) \
+    PLANG_IF_XOPS(X, SGE) PLANG_IF_XOPS(X, SGT) PLANG_IF_XOPS(X, SLE) \
+    PLANG_IF_XOPS(X, SLT) \
+    PLANG_BR_XOPS(X, READS) PLANG_BR_XOPS(X, EQ) PLANG_BR_XOPS(X, GE) \
+    PLANG_BR_XOPS(X, GT) PLANG_BR_XOPS(X, LE) PLANG_BR_XOPS(X, LT) \
+    PLANG_BR_XOPS(X, SGE) PLANG_BR_XOPS(X, SGT) PLANG_BR_XOPS(X, SLE) \
+    PLANG_BR_XOPS(X, SLT) \
+    PLANG_ARITH_XOPS(X, ADD) PLANG_ARITH_XOPS(X, SUB) PLANG_ARITH_XOPS(X, MUL) \
+    PLANG_ARITH_XOPS(X, DIV) PLANG_ARITH_XOPS(X, MOD) PLANG_ARITH_XOPS(X, AND) \
+    PLANG_ARITH_XOPS(X, OR) PLANG_ARITH_XOPS(X, SDIV) PLANG_ARITH_XOPS(X, SMOD) \
+    X(LOAD) X(LOAD_TABLE) X(STORE_L) X(STORE_V) X(PLAY_TABLE) \
+    X(ON_GOTO) X(ON_CALL) X(ON_GOTO_HASH) X(ON_CALL_HASH) \
+    X(DEC_DISPLAY) X(DEC_BR_GT_VL) X(DEC_DISPLAY_BR_GT_VL)
+
+#define PLANG_XOP_ENUM(name) X_##name,
+typedef enum {
+    PLANG_XOPS(PLANG_XOP_ENUM)
+    X_COUNT
+} XOP;
+
+#define PLANG_XOP_NAME(name) #name,
+static const char *const xopNames[X_COUNT] = {
+    PLANG_XOPS(PLANG_XOP_NAME)
+};
+
+static inline bool isIf(uint32_t xop) {
+    return xop >= X_IF_READS_LL && xop <= X_IF_SLT_VV;
+}
+
+static inline bool isBranch(uint32_t xop) {
+    return xop >= X_BR_READS_LL && xop <= X_BR_SLT_VV;
+}
+
+static inline bool isArith(uint32_t xop) {
+    return xop >= X_ADD_LL && xop <= X_SMOD_VV;
+}
+
+static inline bool isIndexed(uint32_t xop) {
+    return xop >= X_LOAD && xop <= X_PLAY_TABLE;
+}
+
+// ON ... GOTO and ON ... CALL, looking the value up in a dense table or a
+// hashed one
+static inline bool isSwitch(uint32_t xop) {
+    return xop >= X_ON_GOTO && xop <= X_ON_CALL_HASH;
+}
+
+// Instructions that use their target field
+static inline bool hasTarget(uint32_t xop) {
+    return xop == X_CALL || xop == X_GOTO || isIf(xop) || isBranch(xop) ||
+        xop == X_DEC_BR_GT_VL || xop == X_DEC_DISPLAY_BR_GT_VL;
+}
+
+// Maximum CALL nesting of a single context. Each context carries a stack
+// of this many return addresses, so override it (-DPLANG_STACK_DEPTH=n)
+// to trade depth for memory on small targets.
+#ifndef PLANG_STACK_DEPTH
+#define PLANG_STACK_DEPTH 16
+#endif
+
+// Default number of instructions a handler may run before it has to give
+// way to the next one, if it doesn't reach a DELAY or RETURN first.
+#ifndef PLANG_BUDGET
+#define PLANG_BUDGET 1000
+#endif
+
+// Most that --budget takes. Anything near 2^32 would in effect turn
+// preemption off.
+#define PLANG_MAX_BUDGET 1000000000
+
+// Most instances and threads a --batch run takes
+#define PLANG_MAX_INSTANCES 1000000
+#define PLANG_MAX_THREADS 1024
+
+// Number of input pins the event system can watch. Pin levels are kept
+// packed 64 to a word.
+#ifndef PLANG_MAX_PINS
+#define PLANG_MAX_PINS 256
+#endif
+#define PLANG_PIN_WORDS ((PLANG_MAX_PINS + 63) / 64)
+
+// Scheduling passes a replay lets a busy handler spin for before it starts
+// moving the virtual clock on by a millisecond a pass.
+#ifndef PLANG_SPIN_PASSES
+#define PLANG_SPIN_PASSES 1000
+#endif
+
+// Size of the blocks a program's arena grabs from the system at a time.
+// Anything bigger than this gets a block of its own.
+#ifndef PLANG_ARENA_BLOCK
+#define PLANG_ARENA_BLOCK 65536
+#endif
+
+// Program counter value of a context that isn't running anything.
+const uint32_t    PC_IDLE     = 0xFFFFFFFF;
 
 const uint32_t    FALLING     = 0;
 const uint32_t    RISING      = 1;
@@ -35,186 +183,603 @@ typedef enum {
     GE,
     GT,
     LE,
-    LT
+    LT,
+    // Comparisons of signed values. EQ and READS don't need one.
+    SGE,
+    SGT,
+    SLE,
+    SLT
 } OPERATOR;
 
-struct variable;
+typedef enum {
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    MOD,
+    AND,
+    OR,
+    // Division of signed values. The rest work the same either way.
+    SDIV,
+    SMOD
+} ARITHOP;
 
 struct op {
-    char *label;
+    uint32_t label;
     uint32_t opcode;
     struct op *next;
     struct op *alternate;
+    // Arithmetic working out the operands of an expression, chained by
+    // next, to run before this op
+    struct op *pre;
     uint32_t ival1;
     uint32_t ival2;
     uint32_t ival3;
-    char *cval1;
-    char *cval2;
-    char *cval3;
-    struct variable *vval1;
-    struct variable *vval2;
-    struct variable *vval3;
+    uint32_t vval1;
+    uint32_t vval2;
+    uint32_t vval3;
     uint32_t line;
+    uint32_t col;
+    uint32_t pc;
+    // The cases of an ON
+    struct jumptable *cases;
 };
 
 typedef struct op op;
 
+// One case of an ON: a value and the label it goes to
+struct jumpcase {
+    uint32_t value;
+    uint32_t label;
+    uint32_t col;
+};
+
+typedef struct jumpcase jumpcase;
+
+// The cases of an ON, and how its table in the constant pool is laid out.
+// A dense table is indexed by the value less lo; a hashed one has size
+// entries, a power of two, and is probed from caseHash() of the value.
+struct jumptable {
+    uint32_t count;
+    jumpcase *cases;
+    // Where values without a case go, or NOSYM to fall through
+    uint32_t deflt;
+    uint32_t defcol;
+    bool hash;
+    uint32_t lo;
+    uint32_t size;
+};
+
+typedef struct jumptable jumptable;
+
+union operand {
+    uint32_t lit;
+    uint32_t slot;
+};
+
+// One compiled instruction.  Jump targets are indexes into the code array.
+// For the IF family the target is where to go when the condition is false;
+// when it is true execution falls through into the conditional command.
+// Arithmetic has no jump, and keeps the slot it writes in target instead.
+// Indexed instructions keep where their array or table is described in the
+// constant pool there, and ON instructions where their jump table is.
+struct insn {
+    uint16_t op;
+    // Set on the arithmetic in front of a statement. A handler never yields
+    // straight after one, so no other context can get at the statement's
+    // temporaries before it has finished with them.
+    uint8_t prelude;
+    uint32_t line;
+    operand a;
+    operand b;
+    uint32_t target;
+};
+
+typedef struct insn insn;
+
+// Execution state of one thread of script code (an event handler or init).
+struct context {
+    uint32_t pc;
+    uint32_t wake;
+    bool delaying;
+    uint32_t sp;
+    uint32_t stack[PLANG_STACK_DEPTH];
+};
+
+typedef struct context context;
+
 struct event {
     uint32_t type;
     uint32_t source;
-    char *label;
-    op *entry;
-    op *current;
-    uint32_t last;
+    uint32_t label;
+    uint32_t pc;
+    // Position in the event list, indexing each instance's handlers
+    uint32_t index;
     struct event *next;
     uint32_t line;
+    uint32_t col;
 };
 
 typedef struct event event;
 
-struct variable {
-    char *name;
-    uint32_t value;
-    struct variable *next;
+struct arenablock {
+    struct arenablock *next;
+    size_t size;
+};
+
+typedef struct arenablock arenablock;
+
+// Bump allocator that everything belonging to a program comes out of.
+// Nothing is freed on its own: the whole arena goes at once when the
+// program is unloaded.
+struct arena {
+    arenablock *blocks;
+    char *next;
+    size_t left;
+    size_t used;
+    size_t reserved;
+};
+
+typedef struct arena arena;
+
+// A run of characters in the script source. Not NUL terminated.
+struct strview {
+    const char *p;
+    uint32_t len;
+};
+
+typedef struct strview strview;
+
+// An interned name in a symbol table. The name points into the script
+// source. For labels ptr is the op carrying the label.
+struct symbol {
+    const char *name;
+    uint32_t len;
+    uint32_t hash;
+    void *ptr;
+};
+
+typedef struct symbol symbol;
+
+// Open addressed, case-insensitive hash table of symbols. IDs are handed
+// out densely in order of first appearance and index the entries array;
+// for variables the ID is also the slot in the value array. The hash
+// index holds ID + 1, with 0 marking an empty bucket.
+struct symtab {
+    uint32_t *index;
+    uint32_t size;
+    symbol *entries;
+    uint32_t count;
+    struct arena *mem;
+};
+
+typedef struct symtab symtab;
+
+// An array or table. An array is a run of variables named name[0] to
+// name[len - 1], so its elements are contiguous in the variable area; a
+// table is a run of constants. Described to indexed instructions by an
+// entry in the constant pool: len, then for an array the slot of the
+// first element and for a table the values themselves.
+struct arrayinfo {
+    uint32_t len;
+    // Slot of the first element, or constant pool index of the first value
+    uint32_t base;
+    uint32_t desc;
+    bool table;
+    // A table of sample IDs, for PLAY
+    bool samples;
+    bool sgn;
+};
+
+typedef struct arrayinfo arrayinfo;
+
+// ID of a symbol that isn't in the table
+const uint32_t    NOSYM       = 0xFFFFFFFF;
+
+// Slot value of a variable reference that didn't resolve.
+const uint32_t    NOVAR       = NOSYM;
+
+// Until the program is compiled and the number of variables is known, the
+// slot of expression temporary n is TEMP | n.
+const uint32_t    TEMP        = 0x80000000;
+
+// Handlers linked to each pin, one list for rising and one for falling
+// edges (CHANGE handlers are in both). The handlers for pin p are
+// list[start[p]] to list[start[p + 1] - 1].
+struct pinindex {
+    uint32_t start[PLANG_MAX_PINS + 1];
+    event **list;
+};
+
+typedef struct pinindex pinindex;
+
+// A loaded program: the mapped source and everything parsed and compiled
+// from it. Apart from the source mapping it all lives in mem, so that
+// unloading is one call however big the script was.
+struct script {
+    arena mem;
+    const char *src;
+    size_t srclen;
+    // Length of the mapping src is in, or 0 if it was copied into mem
+    size_t maplen;
+    uint32_t lines;
+
+    op *ops;
+    op *opsTail;
+    event *events;
+    event *eventsTail;
+    uint32_t nevents;
+
+    symtab variables;
+    symtab labels;
+    symtab samples;
+    // Arrays and tables, by name. Only needed while parsing.
+    symtab arrays;
+
+    // Initial values of all variables, indexed by slot, followed by the
+    // temporaries expressions are worked out in
+    uint32_t *slots;
+    uint32_t slotcap;
+    uint32_t ntemps;
+    // Which variables were declared signed, indexed by slot. Only needed
+    // while parsing.
+    bool *signedVars;
+
+    insn *code;
+    uint32_t codelen;
+
+    // Constant pool, for the indexed instructions
+    uint32_t *consts;
+    uint32_t nconsts;
+    uint32_t constcap;
+
+    // Entry point of each label, indexed by label ID
+    uint32_t *labelPc;
+
+    // Audio engine ID of each sample, indexed by the program's sample ID
+    uint32_t *audioIds;
+
+    pinindex rising;
+    pinindex falling;
+    // Pins that have at least one handler linked to them
+    uint64_t watched[PLANG_PIN_WORDS];
 };
 
-typedef struct variable variable;
+typedef struct script script;
 
-struct stack {
-    op *opcode;
-    struct stack *next;
+// Input edges waiting for an event's handler to be free: a bounded
+// single producer, single consumer ring. The producer is whatever finds
+// the edges, the scheduler itself or a thread calling plang_post(); the
+// consumer is the scheduler. Entries pack the time an edge happened, on
+// the instance's clock, over its level. tail only moves forward from the
+// producer side. head moves forward from the consumer side, and from the
+// producer's when a full queue drops its oldest edge, so both ends move
+// it with a compare and swap.
+struct edgequeue {
+    uint64_t *ring;
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
+    // Edges that didn't fit under PLANG_COUNT and still have to be run
+    uint32_t owed;
+    // Kept by the producer
+    uint64_t edges;
+    uint64_t overflows;
+    uint32_t deepest;
+    // Kept by the consumer: how long edges waited, in milliseconds
+    uint64_t waited;
+    uint32_t waitMax;
 };
 
-// Stub!
-int ins[10] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+typedef struct edgequeue edgequeue;
 
-int digitalRead(int pin) {
-    if (pin < 10) {
-        return ins[pin];
+// Run-time state of one event's handler
+struct handler {
+    context ctx;
+    // Started by an edge and yet to run its first instruction
+    bool fresh;
+    // Level of the pin when the handler last saw it
+    uint32_t last;
+    // Edges that came while it was busy, if the instance queues them
+    edgequeue queue;
+};
+
+typedef struct handler handler;
+
+// One running instance of a program. Once loaded a script is only ever
+// read, so any number of instances can share its code and tables; all
+// that changes as a program runs lives here.
+struct vm {
+    script *prog;
+    // Values of all variables, indexed by slot
+    uint32_t *vars;
+    // Indexed by event index
+    handler *handlers;
+
+    // Stub! One bit per pin, and the levels as of the last scheduling pass
+    uint64_t ins[PLANG_PIN_WORDS];
+    uint64_t prevPins[PLANG_PIN_WORDS];
+
+    // Contexts waiting on a DELAY, kept as a binary min-heap on wake time
+    // so the scheduler always knows how long it can sleep for.
+    context **delays;
+    uint32_t ndelays;
+    uint32_t delaycap;
+
+    // When replaying a trace, time comes from vclock rather than the real clock
+    bool virtualTime;
+    uint32_t vclock;
+
+    // Pins, audio and display, and the pointer passed back to them
+    plang_host host;
+    void *hostctx;
+    // Whether the command line's run loops drive the screen for this
+    // instance (those in a batch don't)
+    bool devices;
+    uint32_t budget;
+    // Timestamped log of every DISPLAY and PLAY, and the input recorder
+    FILE *actionLog;
+    FILE *recording;
+
+    // Instructions executed so far
+    uint64_t ops;
+
+    // Where to count and time what runs, or NULL
+    struct profile *prof;
+    // Flight recorder, or NULL
+    struct tracering *ring;
+    // Time of the current scheduling pass, for stamping trace records
+    uint32_t now;
+
+    // Edges each event's queue holds, 0 if busy handlers just miss them,
+    // and what to do with one that doesn't fit
+    uint32_t queueDepth;
+    uint32_t queuePolicy;
+    // Set once another thread feeds the input through plang_post(), after
+    // which the scheduler leaves finding edges to it. posted is that
+    // thread's own copy of the levels.
+    bool posting;
+    uint64_t posted[PLANG_PIN_WORDS];
+};
+
+typedef struct vm vm;
+
+// Input levels can be written by plang_post() on another thread, so they
+// are read atomically; on anything plang runs on that's a plain load.
+uint32_t digitalRead(vm *m, uint32_t pin) {
+    if (pin < PLANG_MAX_PINS) {
+        return (__atomic_load_n(&m->ins[pin >> 6], __ATOMIC_RELAXED) >> (pin & 63)) & 1;
     }
 
     return 0;
 }
 
-void pinMode(int pin, int mode) {
+// Take a snapshot of every input in one go.
+void sampleInputs(vm *m, uint64_t *snap) {
+    if (m->host.read_pins && !m->posting) {
+        m->host.read_pins(m->hostctx, m->ins, PLANG_PIN_WORDS);
+    }
+    for (uint32_t w = 0; w < PLANG_PIN_WORDS; w++) {
+        snap[w] = __atomic_load_n(&m->ins[w], __ATOMIC_ACQUIRE);
+    }
 }
 
-struct timeval bootTime;
+// Monotonic time, in nanoseconds, that the program started
+uint64_t bootTime;
 
-void trim(char *str) {
-    // Right trim
-    while ((strlen(str) > 0) && ((str[strlen(str)-1] == ' ') || (str[strlen(str)-1] == '\t') || (str[strlen(str)-1] == '\r') || (str[strlen(str)-1] == '\n'))) {
-        str[strlen(str)-1] = 0;
+uint64_t monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t millis(vm *m) {
+    if (m->virtualTime) {
+        return m->vclock;
     }
+    return (monotonic() - bootTime) / 1000000ULL;
+}
 
-    // Left shift
-    while ((strlen(str) > 0) && ((str[0] == ' ') || (str[0] == '\t') || (str[0] == '\r') || (str[0] == '\n'))) {
-        for (char *p = str; *p; p++) {
-            *p = *(p+1);
-        }
+// Write the pins in word w that changed to the recording, in the same
+// format that plang_replay() reads.
+void recordPins(vm *m, uint32_t w, uint64_t changed, uint64_t levels, uint32_t now) {
+    while (changed) {
+        uint32_t bit = __builtin_ctzll(changed);
+        fprintf(m->recording, "%u %u %u\n", now, w * 64 + bit, (uint32_t)((levels >> bit) & 1));
+        changed &= changed - 1;
     }
 }
 
-uint32_t millis() {
-    struct timeval currentTime;
-    gettimeofday(&currentTime, NULL);
 
-    uint64_t then = bootTime.tv_sec * 1000 + bootTime.tv_usec / 1000;
-    uint64_t now = currentTime.tv_sec * 1000 + currentTime.tv_usec / 1000;
-    now = now - then;
+void logDisplay(vm *m, uint32_t id, uint32_t value) {
+    fprintf(m->actionLog, "%u display %u %u\n", millis(m), id, value);
+}
+
+void logPlay(vm *m, uint32_t id) {
+    symbol *sample = &m->prog->samples.entries[id];
+    fprintf(m->actionLog, "%u play %.*s\n", millis(m), sample->len, sample->name);
+}
 
-    return now;
+static inline void vmDisplay(vm *m, uint32_t value) {
+    if (m->host.display) m->host.display(m->hostctx, 0, value);
+    if (m->actionLog) logDisplay(m, 0, value);
 }
 
+static inline void vmPlay(vm *m, uint32_t id) {
+    if (m->host.play) {
+        symbol *sample = &m->prog->samples.entries[id];
+        m->host.play(m->hostctx, id, sample->name, sample->len);
+    }
+    if (m->actionLog) logPlay(m, id);
+}
 
-typedef struct stack stack;
+static inline void vmMode(vm *m, uint32_t pin, uint32_t mode) {
+    if (m->host.pin_mode) m->host.pin_mode(m->hostctx, pin, mode);
+}
 
-op *program = NULL;
-variable *variables = NULL;
-event *events = NULL;
+// Instructions per handler per scheduling pass that new instances start with.
+// 1 gives the old lockstep behaviour of one instruction per event per pass.
+uint32_t budget = PLANG_BUDGET;
 
-stack *callstack = NULL;
+// Edge queueing that new instances start with: entries per event, 0 for
+// none, and the overflow policy
+uint32_t queueDepth = 0;
+uint32_t queuePolicy = PLANG_COALESCE;
 
 void plang_init() {
 }
 
+static inline size_t alignUp(size_t n) {
+    return (n + 15) & ~(size_t)15;
+}
+
+// Carve size bytes, zeroed, out of an arena.
+void *arenaAlloc(arena *a, size_t size) {
+    size = alignUp(size);
+    if (size > a->left) {
+        size_t bsize = alignUp(sizeof(arenablock)) + size;
+        if (bsize < PLANG_ARENA_BLOCK) {
+            bsize = PLANG_ARENA_BLOCK;
+        }
+        arenablock *b = (arenablock *)malloc(bsize);
+        if (b == NULL) {
+            return NULL;
+        }
+        b->next = a->blocks;
+        b->size = bsize;
+        a->blocks = b;
+        a->next = (char *)b + alignUp(sizeof(arenablock));
+        a->left = bsize - alignUp(sizeof(arenablock));
+        a->reserved += bsize;
+    }
+    void *p = a->next;
+    a->next += size;
+    a->left -= size;
+    a->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+void arenaFree(arena *a) {
+    arenablock *b = a->blocks;
+    while (b) {
+        arenablock *next = b->next;
+        free(b);
+        b = next;
+    }
+    memset(a, 0, sizeof(arena));
+}
+
 void syntaxerror(const char *c, uint32_t lineno) {
     printf("%s at line %d\n", c, lineno);
 }
 
-static inline bool isNumber(const char *c) {
-    return (c[0] >= '0' && c[0] <= '9');
+void syntaxerrorAt(const char *c, uint32_t lineno, uint32_t col) {
+    printf("%s at line %d column %d\n", c, lineno, col);
 }
 
-void push(op *oc) {
-    stack *s = (stack *)malloc(sizeof(stack));
-    s->opcode = oc;
-    s->next = NULL;
-    if (callstack == NULL) {
-        callstack = s;
-    } else {
-        stack *scan = callstack;
-        while (scan->next) {
-            scan = scan->next;
-        }
-        scan->next = s;
-    }
+// The line being parsed, split into tokens that point into the source
+struct srcline {
+    const char *start;
+    uint32_t lineno;
+    strview *tok;
+    uint32_t ntok;
+    uint32_t cap;
+};
+
+typedef struct srcline srcline;
+
+srcline cur = { NULL, 0, NULL, 0, 0 };
+
+static inline uint32_t column(strview t) {
+    return t.p - cur.start + 1;
 }
 
-op *pop() {
-    if (callstack == NULL) {
-        return NULL;
-    }
+// Report a problem with a particular token on the current line
+void parseerror(const char *c, strview at) {
+    syntaxerrorAt(c, cur.lineno, column(at));
+}
+
+static inline bool isNumber(strview t) {
+    return t.len > 0 && t.p[0] >= '0' && t.p[0] <= '9';
+}
 
-    if (callstack->next == NULL) {
-        op *opcode = callstack->opcode;
-        free(callstack);
-        callstack = NULL;
-        return opcode;
+// Digits, and nothing else but an optional minus sign in front
+static inline bool isInteger(strview t) {
+    uint32_t i = t.len > 1 && t.p[0] == '-' ? 1 : 0;
+    if (i == t.len) {
+        return false;
+    }
+    for (; i < t.len; i++) {
+        if (t.p[i] < '0' || t.p[i] > '9') {
+            return false;
+        }
     }
+    return true;
+}
 
-    stack *scan = callstack;;
-    stack *last = NULL;
-    while (scan->next) {
-        last = scan;
-        scan = scan->next;
+// The decimal number at the start of a token, like atoi()
+static uint32_t svNumber(strview t) {
+    uint32_t i = 0;
+    bool neg = false;
+    uint32_t n = 0;
+    if (i < t.len && (t.p[i] == '-' || t.p[i] == '+')) {
+        neg = t.p[i] == '-';
+        i++;
     }
-    op *opcode = scan->opcode;
-    free(scan);
-    if (last = NULL) {
-        last->next = NULL;
+    for (; i < t.len && t.p[i] >= '0' && t.p[i] <= '9'; i++) {
+        n = n * 10 + (t.p[i] - '0');
     }
-    return opcode;
+    return neg ? -n : n;
 }
 
-void addEvent(uint32_t type, uint32_t source, const char *label, uint32_t line) {
-    event *e = (event *)malloc(sizeof(event));
+// Case-insensitive compare of a token with a keyword
+static inline bool svIs(strview t, const char *word) {
+    return strlen(word) == t.len && !strncasecmp(t.p, word, t.len);
+}
+
+// Everything on the line from token i to the end, internal spacing and all
+static strview svRest(strview *tok, uint32_t ntok, uint32_t i) {
+    strview r;
+    r.p = tok[i].p;
+    r.len = tok[ntok - 1].p + tok[ntok - 1].len - tok[i].p;
+    return r;
+}
+
+// Start a context running at pc with an empty call stack.
+static inline void ctxStart(context *ctx, uint32_t pc) {
+    ctx->pc = pc;
+    ctx->delaying = false;
+    ctx->sp = 0;
+}
+
+bool addEvent(script *s, uint32_t type, uint32_t source, uint32_t label, uint32_t line, uint32_t col) {
+    event *e = (event *)arenaAlloc(&s->mem, sizeof(event));
+    if (e == NULL) {
+        return false;
+    }
     e->source = source;
     e->type = type;
-    e->label = strdup(label);
+    e->label = label;
     e->next = NULL;
-    e->current = NULL;
+    e->pc = PC_IDLE;
+    e->index = s->nevents++;
     e->line = line;
-    e->last = digitalRead(e->source);
-    if (events == NULL) {
-        events = e;
+    e->col = col;
+    if (s->events == NULL) {
+        s->events = e;
     } else {
-        event *scan = events;
-        while (scan->next) {
-            scan = scan->next;
-        }
-        scan->next = e;
+        s->eventsTail->next = e;
     }
+    s->eventsTail = e;
+    return true;
 }
 
-void addOpcode(op *oc) {
-    if (program == NULL) {
-        program = oc;
+void addOpcode(script *s, op *oc) {
+    if (s->ops == NULL) {
+        s->ops = oc;
     } else {
-        op *scan = program;
-        while (scan->next) {
-            scan = scan->next;
-        }
+        op *scan = s->opsTail;
         scan->next = oc;
         // If this happens to have an alternate route set then make that alternate have the
         // next command point to this one as well.  That way IF commands will continue properly.
@@ -223,632 +788,5145 @@ void addOpcode(op *oc) {
             scan->alternate->next = oc;
         }
     }
+    s->opsTail = oc;
 }
 
-variable *findVariable(char *name) {
-    variable *scan = variables;
-    while (scan) {
-        if (!strcasecmp(scan->name, name)) {
-            return scan;
+static uint32_t symhash(const char *name, uint32_t len) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= (uint8_t)tolower(name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Double the size of a table. The old arrays stay in the arena, which
+// costs at most as much again as the final table.
+static bool symgrow(symtab *t) {
+    uint32_t size = t->size ? t->size * 2 : 64;
+    uint32_t *index = (uint32_t *)arenaAlloc(t->mem, sizeof(uint32_t) * size);
+    symbol *entries = (symbol *)arenaAlloc(t->mem, sizeof(symbol) * (size / 2));
+    if (index == NULL || entries == NULL) {
+        return false;
+    }
+    if (t->count > 0) {
+        memcpy(entries, t->entries, sizeof(symbol) * t->count);
+    }
+    for (uint32_t id = 0; id < t->count; id++) {
+        uint32_t pos = entries[id].hash & (size - 1);
+        while (index[pos] != 0) {
+            pos = (pos + 1) & (size - 1);
         }
-        scan = scan->next;
+        index[pos] = id + 1;
     }
-    return NULL;
+    t->index = index;
+    t->entries = entries;
+    t->size = size;
+    return true;
+}
+
+// Find a symbol by name, optionally adding it if it isn't there yet.
+// Returns its ID or NOSYM. The name is not copied, so must outlive the
+// table.
+uint32_t symLookup(symtab *t, const char *name, uint32_t len, bool create) {
+    uint32_t h = symhash(name, len);
+    if (t->size > 0) {
+        uint32_t pos = h & (t->size - 1);
+        while (t->index[pos] != 0) {
+            symbol *sym = &t->entries[t->index[pos] - 1];
+            if (sym->hash == h && sym->len == len && !strncasecmp(sym->name, name, len)) {
+                return t->index[pos] - 1;
+            }
+            pos = (pos + 1) & (t->size - 1);
+        }
+    }
+    if (!create) {
+        return NOSYM;
+    }
+
+    // Keep the load factor under a half so probe runs stay short
+    if ((t->count + 1) * 2 > t->size) {
+        if (!symgrow(t)) {
+            return NOSYM;
+        }
+    }
+    uint32_t pos = h & (t->size - 1);
+    while (t->index[pos] != 0) {
+        pos = (pos + 1) & (t->size - 1);
+    }
+    uint32_t id = t->count++;
+    t->index[pos] = id + 1;
+    t->entries[id].name = name;
+    t->entries[id].len = len;
+    t->entries[id].hash = h;
+    t->entries[id].ptr = NULL;
+    return id;
+}
+
+uint32_t findVariable(script *s, strview name) {
+    return symLookup(&s->variables, name.p, name.len, false);
+}
+
+// Parse an operand that can be either a number or a variable. Returns
+// false, having reported it, if it names a variable that doesn't exist.
+static bool getOperand(script *s, strview t, uint32_t *ival, uint32_t *vval, bool *isvar) {
+    if (isNumber(t)) {
+        *ival = svNumber(t);
+        *isvar = false;
+        return true;
+    }
+    *vval = findVariable(s, t);
+    *isvar = true;
+    if (*vval == NOVAR) {
+        parseerror("Unknown variable", t);
+        return false;
+    }
+    return true;
+}
+
+// Arithmetic is on 32 bit words and wraps round, like unsigned arithmetic
+// in C. Signed values are the same words read as two's complement, so only
+// division and comparisons need to know about them. Dividing by zero gives
+// zero, as does the remainder, and the one signed division that overflows,
+// the most negative number by -1, wraps round to itself.
+static inline uint32_t divide(uint32_t a, uint32_t b) {
+    return b ? a / b : 0;
+}
+
+static inline uint32_t modulo(uint32_t a, uint32_t b) {
+    return b ? a % b : 0;
+}
+
+static inline uint32_t sdivide(uint32_t a, uint32_t b) {
+    if (b == 0) return 0;
+    if (b == 0xFFFFFFFF) return -a;
+    return (uint32_t)((int32_t)a / (int32_t)b);
+}
+
+static inline uint32_t smodulo(uint32_t a, uint32_t b) {
+    if (b == 0 || b == 0xFFFFFFFF) return 0;
+    return (uint32_t)((int32_t)a % (int32_t)b);
+}
+
+// Work out a OPER b now, for constant folding.
+static uint32_t arith(uint32_t oper, uint32_t a, uint32_t b) {
+    switch (oper) {
+        case ADD: return a + b;
+        case SUB: return a - b;
+        case MUL: return a * b;
+        case DIV: return divide(a, b);
+        case MOD: return modulo(a, b);
+        case AND: return a & b;
+        case OR: return a | b;
+        case SDIV: return sdivide(a, b);
+        case SMOD: return smodulo(a, b);
+    }
+    return 0;
+}
+
+// Jump tables for ON, in the constant pool. A dense one is the lowest
+// value, the number of entries, the default and then a pc for each value
+// in turn. A hashed one is the size less one, the keys, the default and
+// then the pcs that go with the keys, with PC_IDLE in the empty entries.
+// A default of PC_IDLE means carry on with the next instruction.
+static inline uint32_t caseHash(uint32_t value) {
+    value *= 0x9E3779B1u;
+    return value ^ (value >> 16);
+}
+
+static inline uint32_t jumpDense(const uint32_t *t, uint32_t value) {
+    uint32_t i = value - t[0];
+    return i < t[1] ? t[3 + i] : t[2];
 }
 
-void freeop(op *c) {
-    if (c->label != NULL) free(c->label);
-    if (c->cval1 != NULL) free(c->cval1);
-    if (c->cval2 != NULL) free(c->cval2);
-    if (c->cval3 != NULL) free(c->cval3);
-    if (c->alternate != NULL) freeop(c->alternate);
-    free(c);
+static inline uint32_t jumpHash(const uint32_t *t, uint32_t value) {
+    uint32_t mask = t[0];
+    const uint32_t *keys = t + 1;
+    const uint32_t *pcs = t + 3 + mask;
+    uint32_t h = caseHash(value) & mask;
+    for (uint32_t n = 0; n <= mask && pcs[h] != PC_IDLE; n++, h = (h + 1) & mask) {
+        if (keys[h] == value) {
+            return pcs[h];
+        }
+    }
+    return pcs[-1];
+}
+
+// Every pc in the jump table of an ON instruction, the default first
+static uint32_t *jumpPcs(uint32_t *consts, insn *i, uint32_t *count) {
+    uint32_t *t = consts + i->target;
+    if (i->op == X_ON_GOTO_HASH || i->op == X_ON_CALL_HASH) {
+        *count = t[0] + 2;
+        return t + 2 + t[0];
+    }
+    *count = t[1] + 1;
+    return t + 2;
 }
 
-op *createOpcode(char *label, char *code, char *params, uint32_t line) {
-    op *newop = (op *)malloc(sizeof(op));
+static op *newOp(script *s, uint32_t label, uint32_t line, uint32_t col) {
+    op *newop = (op *)arenaAlloc(&s->mem, sizeof(op));
+    if (newop == NULL) {
+        syntaxerrorAt("Out of memory", line, col);
+        return NULL;
+    }
     newop->opcode = NOP;
     newop->next = NULL;
     newop->alternate = NULL;
+    newop->pre = NULL;
     newop->ival1 = 0;
     newop->ival2 = 0;
     newop->ival3 = 0;
-    newop->cval1 = NULL;
-    newop->cval2 = NULL;
-    newop->cval3 = NULL;
-    newop->vval1 = NULL;
-    newop->vval2 = NULL;
-    newop->vval3 = NULL;
-    if (label != NULL) {
-        newop->label = strdup(label);
-    } else {
-        newop->label = NULL;
-    }
+    newop->vval1 = NOVAR;
+    newop->vval2 = NOVAR;
+    newop->vval3 = NOVAR;
+    newop->pc = 0;
+    newop->cases = NULL;
+    newop->label = label;
     newop->line = line;
+    newop->col = col;
+    return newop;
+}
 
-    if (!strcasecmp(code, "NOP")) {
-        return newop;
-    }
+// Expressions. Infix expressions in SET, IF, DISPLAY and DELAY, and the ADD
+// to OR commands, compile to three address arithmetic over variables,
+// literals and hidden temporary slots. Parts that only involve literals are
+// worked out here and the last operation of a SET writes straight to the
+// variable, so something like "set x x + 1" is a single instruction. An
+// element of an array or table with a literal index is just a variable or
+// a literal; any other index takes one indexed instruction.
+//
+// Temporaries belong to the expression that uses them, not to a handler.
+// Handlers running the same code would share them, so a statement and the
+// arithmetic in front of it always run in one turn.
 
-    if (!strcasecmp(code, "MODE")) {
-        char *pin = strtok(params, " \t");
-        char *mode = strtok(NULL, " \t");
-        char *extra = strtok(NULL, " \t");
+// Pending operations that read an array element or a table entry, rather
+// than doing arithmetic
+const uint32_t    INDEX       = 0x0100;
+const uint32_t    INDEX_TABLE = 0x0101;
 
-        newop->opcode = MODE;
+// Levels of binary operator precedence. Parsing at this level reads a
+// single operand.
+const int         EXPR_PRIMARY = 4;
 
-        if (pin == NULL || mode == NULL) {
-            syntaxerror("Bad pin mode", line);
-            freeop(newop);
-            return NULL;
-        }
+// A literal, or a variable or temporary, and whether it is signed.
+struct exprval {
+    bool isvar;
+    bool sgn;
+    uint32_t n;
+};
 
-        // Is it a number?
-        if (isNumber(pin)) {
-            newop->opcode |= L;
-            newop->ival1 = atoi(pin);
-        } else {
-            newop->opcode |= V;
-            newop->vval1 = findVariable(pin);
-            if (newop->vval1 == NULL) {
-                syntaxerror("No such variable", line);
-                freeop(newop);
-                return NULL;
-            }
-        }
+typedef struct exprval exprval;
 
-        if (!strcasecmp(mode, "IN")) {
-            newop->ival2 = 1;
-        } else if (!strcasecmp(mode, "OUT")) {
-            newop->ival2 = 0;
-        } else {
-            syntaxerror("Bad mode", line);
-            freeop(newop);
-            return NULL;
-        }
-        if (extra != NULL) {
-            if (!strcasecmp(extra, "PULLUP")) {
-                newop->ival3 = 1;
-            }
-        }
-        return newop;
-    }
+// A part of an expression. Until it is used, the last operation parsed is
+// left pending, so that it can go straight to wherever its result is
+// wanted. For an indexed read left is the constant pool entry and right
+// the index.
+struct expr {
+    exprval v;
+    bool pending;
+    uint32_t oper;
+    exprval left;
+    exprval right;
+};
 
-    if (!strcasecmp(code, "IF")) {
-        char *left = strtok(params, " \t");
-        char *oper = strtok(NULL, " \t");
-        char *right = strtok(NULL, " \t");
-        char *altop = strtok(NULL, " \t");
-        char *altparm = strtok(NULL, "\0");
+typedef struct expr expr;
 
-        newop->opcode = IF;
+// Where a SET or arithmetic command puts its result: a variable, or an
+// array element picked at run time.
+struct lvalue {
+    bool indexed;
+    uint32_t slot;
+    // For an indexed element, the array's constant pool entry and the slot
+    // holding the index
+    uint32_t desc;
+    uint32_t index;
+};
 
-        if (altop == NULL) {
-            syntaxerror("Syntax error", line);
-            freeop(newop);
-            return NULL;
-        }
+typedef struct lvalue lvalue;
 
-        if (isNumber(left) && isNumber(right)) {
-            newop->ival1 = atoi(left);
-            newop->ival3 = atoi(right);
-            newop->opcode |= LL;
-        } else if (isNumber(left) && !isNumber(right)) {
-            newop->ival1 = atoi(left);
-            newop->vval3 = findVariable(right);
-            if (newop->vval3 == NULL) {
-                syntaxerror("Unknown variable", line);
-                freeop(newop);
-                return NULL;
-            }
-            newop->opcode |= LV;
-        } else if (!isNumber(left) && !isNumber(right)) {
-            newop->vval1 = findVariable(left);
-            if (newop->vval1 == NULL) {
-                syntaxerror("Unknown variable", line);
-                freeop(newop);
-                return NULL;
-            }
-            newop->vval3 = findVariable(right);
-            if (newop->vval3 == NULL) {
-                syntaxerror("Unknown variable", line);
-                freeop(newop);
-                return NULL;
-            }
-            newop->opcode |= VV;
-        } else if (!isNumber(left) && isNumber(right)) {
-            newop->vval1 = findVariable(left);
-            if (newop->vval1 == NULL) {
-                syntaxerror("Unknown variable", line);
-                freeop(newop);
-                return NULL;
-            }
-            newop->ival3 = atoi(right);
-            newop->opcode |= VL;
-        } else {
-            syntaxerror("Bad operands to if", line);
-            freeop(newop);
-            return NULL;
-        }
+struct exprparser {
+    script *s;
+    // Where the arithmetic goes
+    op *owner;
+    const char *p;
+    const char *end;
+    // Temporaries in use, and the most ever in use at once
+    uint32_t temps;
+    uint32_t maxtemps;
+};
 
+typedef struct exprparser exprparser;
 
-        // Operators
-        if (!strcasecmp(oper, "GE")) newop->ival2 = (uint32_t)GE;
-        else if (!strcasecmp(oper, "GT")) newop->ival2 = (uint32_t)GT;
-        else if (!strcasecmp(oper, "LE")) newop->ival2 = (uint32_t)LE;
-        else if (!strcasecmp(oper, "LT")) newop->ival2 = (uint32_t)LT;
-        else if (!strcasecmp(oper, "EQ")) newop->ival2 = (uint32_t)EQ;
-        else if (!strcasecmp(oper, "READS")) newop->ival2 = (uint32_t)READS;
-        else {
-            syntaxerror("Bad operator", line);
-            freeop(newop);
-            return NULL;
-        }
+static void exprInit(exprparser *x, script *s, op *owner, const char *p, const char *end) {
+    x->s = s;
+    x->owner = owner;
+    x->p = p;
+    x->end = end;
+    x->temps = 0;
+    x->maxtemps = 0;
+}
 
+static inline bool isExprSpace(char c) {
+    return (uint8_t)c <= ' ';
+}
 
-            
+static inline bool isExprSymbol(char c) {
+    return strchr("+-*/%&|()[]", c) != NULL;
+}
 
+static void exprSkip(exprparser *x) {
+    while (x->p < x->end && isExprSpace(*x->p)) {
+        x->p++;
+    }
+}
 
+static void exprError(exprparser *x, const char *msg) {
+    strview at = { x->p, 0 };
+    parseerror(msg, at);
+}
 
-        op *altcmd = createOpcode(NULL, altop, altparm, line);
-        if (altcmd == NULL) {
-            freeop(newop);
-            return NULL;
-        }
-        newop->alternate = altcmd;
-        return newop;
+// Make o work out a pending operation into dest.
+static void pendingOp(op *o, expr *e, uint32_t dest) {
+    if (e->oper == INDEX || e->oper == INDEX_TABLE) {
+        o->opcode = LOAD;
+        o->ival1 = e->left.n;
+        o->ival3 = e->oper == INDEX_TABLE;
+        o->vval1 = dest;
+        o->vval2 = e->right.n;
+        return;
+    }
+    o->opcode = ARITH | (e->left.isvar ? VL : 0) | (e->right.isvar ? LV : 0);
+    o->ival2 = e->oper;
+    if (e->left.isvar) o->vval1 = e->left.n; else o->ival1 = e->left.n;
+    if (e->right.isvar) o->vval3 = e->right.n; else o->ival3 = e->right.n;
+    o->vval2 = dest;
+}
+
+// Give a pending operation a temporary to go to, working it out in the
+// owner's prelude.
+static bool exprValue(exprparser *x, expr *e) {
+    if (!e->pending) {
+        return true;
+    }
+    op *a = newOp(x->s, NOSYM, cur.lineno, x->owner->col);
+    if (a == NULL) {
+        return false;
+    }
+    uint32_t t = TEMP | (x->s->ntemps + x->temps++);
+    if (x->temps > x->maxtemps) {
+        x->maxtemps = x->temps;
+    }
+    pendingOp(a, e, t);
+
+    op **tail = &x->owner->pre;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = a;
+
+    e->pending = false;
+    e->v.isvar = true;
+    e->v.n = t;
+    return true;
+}
+
+static inline void exprRelease(exprparser *x, exprval v) {
+    if (v.isvar && (v.n & TEMP)) {
+        x->temps--;
+    }
+}
+
+// Combine two parts. The left one must already have somewhere to go; any
+// temporaries either of them was in are free again once the result has
+// been written.
+static bool exprBinary(exprparser *x, uint32_t oper, expr *l, expr *r) {
+    if (!exprValue(x, r)) {
+        return false;
+    }
+    bool sgn = l->v.sgn || r->v.sgn;
+    if (sgn && oper == DIV) oper = SDIV;
+    if (sgn && oper == MOD) oper = SMOD;
+
+    if (!l->v.isvar && !r->v.isvar) {
+        l->v.n = arith(oper, l->v.n, r->v.n);
+        l->v.sgn = sgn;
+        return true;
+    }
+    exprRelease(x, r->v);
+    exprRelease(x, l->v);
+    l->left = l->v;
+    l->right = r->v;
+    l->oper = oper;
+    l->pending = true;
+    l->v.sgn = sgn;
+    return true;
+}
+
+static bool exprParse(exprparser *x, expr *e, int level);
+
+// The name at the cursor, and the variable it is or NOVAR. Names may
+// contain the operator characters, so a whole word that is a variable is
+// taken as one before trying the part up to the operator.
+static strview exprName(exprparser *x, uint32_t *var) {
+    strview name = { x->p, 0 };
+    while (x->p + name.len < x->end && !isExprSpace(x->p[name.len])) {
+        name.len++;
+    }
+    *var = findVariable(x->s, name);
+    if (*var == NOVAR) {
+        name.len = 0;
+        while (x->p + name.len < x->end && !isExprSpace(x->p[name.len]) && !isExprSymbol(x->p[name.len])) {
+            name.len++;
+        }
+        *var = name.len ? findVariable(x->s, name) : NOVAR;
+    }
+    return name;
+}
+
+// The array or table called name, with the cursor on the [ after it, and
+// the index in the brackets. A literal index is checked here.
+static bool exprIndex(exprparser *x, strview name, arrayinfo **arr, expr *index) {
+    uint32_t id = symLookup(&x->s->arrays, name.p, name.len, false);
+    if (id == NOSYM) {
+        parseerror("Unknown array", name);
+        return false;
+    }
+    *arr = (arrayinfo *)x->s->arrays.entries[id].ptr;
+    x->p++;
+    if (!exprParse(x, index, 0) || !exprValue(x, index)) {
+        return false;
+    }
+    exprSkip(x);
+    if (x->p == x->end || *x->p != ']') {
+        exprError(x, "Missing ]");
+        return false;
+    }
+    x->p++;
+    if (!index->v.isvar && index->v.n >= (*arr)->len) {
+        parseerror("Index out of range", name);
+        return false;
+    }
+    return true;
+}
+
+// A number, a variable, an element of an array or table or a bracketed
+// expression, with any minus signs in front of it.
+static bool exprPrimary(exprparser *x, expr *e) {
+    exprSkip(x);
+    e->pending = false;
+    e->v.isvar = false;
+    e->v.sgn = false;
+    if (x->p == x->end) {
+        exprError(x, "Syntax error");
+        return false;
+    }
+
+    if (*x->p == '-') {
+        x->p++;
+        expr zero;
+        zero.pending = false;
+        zero.v.isvar = false;
+        zero.v.sgn = false;
+        zero.v.n = 0;
+        if (!exprPrimary(x, e) || !exprBinary(x, SUB, &zero, e)) {
+            return false;
+        }
+        *e = zero;
+        return true;
+    }
+
+    if (*x->p == '(') {
+        x->p++;
+        if (!exprParse(x, e, 0)) {
+            return false;
+        }
+        exprSkip(x);
+        if (x->p == x->end || *x->p != ')') {
+            exprError(x, "Missing )");
+            return false;
+        }
+        x->p++;
+        return true;
+    }
+
+    if (*x->p >= '0' && *x->p <= '9') {
+        uint32_t n = 0;
+        while (x->p < x->end && *x->p >= '0' && *x->p <= '9') {
+            n = n * 10 + (*x->p++ - '0');
+        }
+        e->v.n = n;
+        return true;
+    }
+
+    uint32_t v;
+    strview name = exprName(x, &v);
+    if (v == NOVAR && name.len > 0 && x->p + name.len < x->end && x->p[name.len] == '[') {
+        arrayinfo *arr;
+        expr index;
+        x->p += name.len;
+        if (!exprIndex(x, name, &arr, &index)) {
+            return false;
+        }
+        if (arr->samples) {
+            parseerror("Not a table of numbers", name);
+            return false;
+        }
+        e->v.sgn = arr->sgn;
+        if (!index.v.isvar) {
+            e->v.isvar = !arr->table;
+            e->v.n = arr->table ? x->s->consts[arr->base + index.v.n] : arr->base + index.v.n;
+            return true;
+        }
+        exprRelease(x, index.v);
+        e->pending = true;
+        e->oper = arr->table ? INDEX_TABLE : INDEX;
+        e->left.isvar = false;
+        e->left.sgn = false;
+        e->left.n = arr->desc;
+        e->right = index.v;
+        return true;
+    }
+    if (v == NOVAR) {
+        parseerror(name.len ? "Unknown variable" : "Syntax error", name);
+        return false;
+    }
+    x->p += name.len;
+    e->v.isvar = true;
+    e->v.n = v;
+    e->v.sgn = x->s->signedVars[v];
+    return true;
+}
+
+// Precedence climbing over the binary operators, loosest first
+static bool exprOperator(char c, int level, uint32_t *oper) {
+    switch (level) {
+        case 0: if (c == '|') { *oper = OR; return true; } break;
+        case 1: if (c == '&') { *oper = AND; return true; } break;
+        case 2:
+            if (c == '+') { *oper = ADD; return true; }
+            if (c == '-') { *oper = SUB; return true; }
+            break;
+        case 3:
+            if (c == '*') { *oper = MUL; return true; }
+            if (c == '/') { *oper = DIV; return true; }
+            if (c == '%') { *oper = MOD; return true; }
+            break;
+    }
+    return false;
+}
+
+static bool exprParse(exprparser *x, expr *e, int level) {
+    if (level == EXPR_PRIMARY) {
+        return exprPrimary(x, e);
+    }
+    if (!exprParse(x, e, level + 1)) {
+        return false;
+    }
+    uint32_t oper;
+    while (exprSkip(x), x->p < x->end && exprOperator(*x->p, level, &oper)) {
+        x->p++;
+        expr r;
+        if (!exprValue(x, e) || !exprParse(x, &r, level + 1) || !exprBinary(x, oper, e, &r)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finish off parsing something that started at token *at: move *at on to
+// the token the cursor has reached, or ntok at the end of the line, and
+// keep the temporaries it used. Stopping part way through a token is an
+// error.
+static bool exprFinish(exprparser *x, strview *tok, uint32_t ntok, uint32_t *at) {
+    exprSkip(x);
+    while (*at < ntok && tok[*at].p < x->p) {
+        (*at)++;
+    }
+    if (x->p != x->end && (*at == ntok || tok[*at].p != x->p)) {
+        exprError(x, "Syntax error");
+        return false;
+    }
+    x->s->ntemps += x->maxtemps;
+    return true;
+}
+
+static inline const char *lineEnd(strview *tok, uint32_t ntok) {
+    return tok[ntok - 1].p + tok[ntok - 1].len;
+}
+
+// Parse the expression, or with EXPR_PRIMARY just the operand, starting at
+// token *at, putting the arithmetic for it before owner. Stops at the first
+// token that can't carry it on. If value is set the result is always a
+// literal or a slot, never left pending.
+static bool parseExpression(script *s, op *owner, strview *tok, uint32_t ntok, uint32_t *at, expr *e,
+    bool value, int level) {
+    exprparser x;
+    exprInit(&x, s, owner, tok[*at].p, lineEnd(tok, ntok));
+    if (!exprParse(&x, e, level) || (value && !exprValue(&x, e))) {
+        return false;
+    }
+    return exprFinish(&x, tok, ntok, at);
+}
+
+// Parse what a SET or arithmetic command writes to, starting at token *at.
+static bool parseTarget(script *s, op *owner, strview *tok, uint32_t ntok, uint32_t *at, lvalue *dest) {
+    exprparser x;
+    exprInit(&x, s, owner, tok[*at].p, lineEnd(tok, ntok));
+    uint32_t v;
+    strview name = exprName(&x, &v);
+    dest->indexed = false;
+    dest->slot = v;
+    if (v == NOVAR && name.len > 0 && x.p + name.len < x.end && x.p[name.len] == '[') {
+        arrayinfo *arr;
+        expr index;
+        x.p += name.len;
+        if (!exprIndex(&x, name, &arr, &index)) {
+            return false;
+        }
+        if (arr->table) {
+            parseerror("Tables can't be changed", name);
+            return false;
+        }
+        if (index.v.isvar) {
+            dest->indexed = true;
+            dest->desc = arr->desc;
+            dest->index = index.v.n;
+        } else {
+            dest->slot = arr->base + index.v.n;
+        }
+    } else if (v == NOVAR) {
+        parseerror("Unknown variable", name);
+        return false;
+    } else {
+        x.p += name.len;
+    }
+    return exprFinish(&x, tok, ntok, at);
+}
+
+// Make op store the result of an expression in dest: as a SET, by doing
+// the last operation straight into dest if it is still pending, or for an
+// element picked at run time as a STORE.
+static bool assignOp(script *s, op *newop, lvalue *dest, expr *e) {
+    if (!dest->indexed) {
+        if (e->pending) {
+            pendingOp(newop, e, dest->slot);
+            return true;
+        }
+        newop->opcode = SET | (e->v.isvar ? V : L);
+        newop->vval1 = dest->slot;
+        if (e->v.isvar) newop->vval2 = e->v.n; else newop->ival2 = e->v.n;
+        return true;
+    }
+    if (e->pending) {
+        exprparser x;
+        exprInit(&x, s, newop, NULL, NULL);
+        if (!exprValue(&x, e)) {
+            return false;
+        }
+        s->ntemps += x.maxtemps;
+    }
+    newop->opcode = STORE | (e->v.isvar ? V : L);
+    newop->ival1 = dest->desc;
+    newop->vval1 = dest->index;
+    if (e->v.isvar) newop->vval2 = e->v.n; else newop->ival2 = e->v.n;
+    return true;
+}
+
+static bool arithCommand(strview code, uint32_t *oper) {
+    static const char *const names[] = { "ADD", "SUB", "MUL", "DIV", "MOD", "AND", "OR" };
+    for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (svIs(code, names[i])) {
+            *oper = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reserve n words of the constant pool. Returns the first, or NOSYM if out
+// of memory.
+static uint32_t constAlloc(script *s, uint32_t n) {
+    if (s->nconsts + n > s->constcap) {
+        uint32_t cap = s->constcap ? s->constcap * 2 : 64;
+        while (cap < s->nconsts + n) {
+            cap *= 2;
+        }
+        uint32_t *consts = (uint32_t *)arenaAlloc(&s->mem, sizeof(uint32_t) * cap);
+        if (consts == NULL) {
+            return NOSYM;
+        }
+        if (s->nconsts > 0) {
+            memcpy(consts, s->consts, sizeof(uint32_t) * s->nconsts);
+        }
+        s->consts = consts;
+        s->constcap = cap;
+    }
+    uint32_t at = s->nconsts;
+    s->nconsts += n;
+    return at;
+}
+
+static strview svTrim(const char *p, const char *end) {
+    while (p < end && isExprSpace(*p)) p++;
+    while (end > p && isExprSpace(end[-1])) end--;
+    strview t = { p, (uint32_t)(end - p) };
+    return t;
+}
+
+// The cases of an ON: labels separated by commas, for the values 0, 1, 2
+// and so on. A case can give its value as value:label, and the ones after
+// it carry on counting from there; an empty case skips a value. The last
+// case can be followed by ELSE and a label for any other value.
+static jumptable *parseCases(script *s, const char *p, const char *end) {
+    uint32_t max = 1;
+    for (const char *q = p; q < end; q++) {
+        if (*q == ',') max++;
+    }
+    jumptable *t = (jumptable *)arenaAlloc(&s->mem, sizeof(jumptable));
+    jumpcase *cases = (jumpcase *)arenaAlloc(&s->mem, sizeof(jumpcase) * max);
+    if (t == NULL || cases == NULL) {
+        syntaxerrorAt("Out of memory", cur.lineno, column(svTrim(p, end)));
+        return NULL;
+    }
+    t->count = 0;
+    t->cases = cases;
+    t->deflt = NOSYM;
+    t->defcol = 0;
+
+    uint32_t value = 0;
+    while (1) {
+        const char *comma = (const char *)memchr(p, ',', end - p);
+        strview item = svTrim(p, comma ? comma : end);
+        for (const char *q = item.p; !comma && q + 4 <= item.p + item.len; q++) {
+            if ((q == item.p || isExprSpace(q[-1])) && (q + 4 == item.p + item.len || isExprSpace(q[4])) &&
+                !strncasecmp(q, "ELSE", 4)) {
+                strview def = svTrim(q + 4, item.p + item.len);
+                if (def.len == 0) {
+                    parseerror("Syntax error", item);
+                    return NULL;
+                }
+                t->deflt = symLookup(&s->labels, def.p, def.len, true);
+                t->defcol = column(def);
+                item = svTrim(item.p, q);
+                break;
+            }
+        }
+        if (item.len > 0) {
+            strview name = item;
+            const char *colon = (const char *)memchr(item.p, ':', item.len);
+            if (colon != NULL) {
+                strview v = svTrim(item.p, colon);
+                if (!isInteger(v)) {
+                    parseerror("Bad case", item);
+                    return NULL;
+                }
+                value = svNumber(v);
+                name = svTrim(colon + 1, item.p + item.len);
+            }
+            if (name.len == 0) {
+                parseerror("Syntax error", item);
+                return NULL;
+            }
+            for (uint32_t i = 0; i < t->count; i++) {
+                if (cases[i].value == value) {
+                    parseerror("Duplicate case", item);
+                    return NULL;
+                }
+            }
+            cases[t->count].value = value;
+            cases[t->count].label = symLookup(&s->labels, name.p, name.len, true);
+            cases[t->count].col = column(name);
+            t->count++;
+        }
+        if (comma == NULL) {
+            break;
+        }
+        p = comma + 1;
+        value++;
+    }
+    if (t->count == 0 && t->deflt == NOSYM) {
+        parseerror("Syntax error", svTrim(p, end));
+        return NULL;
+    }
+
+    // Values close enough together to index directly get a dense table,
+    // which costs a slot for each value in between; otherwise a hashed
+    // one at most half full.
+    uint32_t lo = 0, hi = 0;
+    for (uint32_t i = 0; i < t->count; i++) {
+        if (i == 0 || cases[i].value < lo) lo = cases[i].value;
+        if (i == 0 || cases[i].value > hi) hi = cases[i].value;
+    }
+    t->lo = lo;
+    if ((uint64_t)hi - lo < 2 * (uint64_t)t->count + 8) {
+        t->hash = false;
+        t->size = t->count ? hi - lo + 1 : 0;
+    } else {
+        t->hash = true;
+        t->size = 4;
+        while (t->size < 2 * t->count) {
+            t->size *= 2;
+        }
+    }
+    return t;
+}
+
+// Build an op from the tokens of a command. tok[0] is the command itself
+// and the rest are its parameters.
+op *createOpcode(script *s, uint32_t label, strview *tok, uint32_t ntok, uint32_t line) {
+    op *newop = newOp(s, label, line, column(tok[0]));
+    if (newop == NULL) {
+        return NULL;
+    }
+
+    strview code = tok[0];
+    bool isvar;
+
+    if (svIs(code, "NOP")) {
+        return newop;
+    }
+
+    if (svIs(code, "MODE")) {
+        newop->opcode = MODE;
+
+        if (ntok < 3) {
+            parseerror("Bad pin mode", code);
+            return NULL;
+        }
+
+        if (!getOperand(s, tok[1], &newop->ival1, &newop->vval1, &isvar)) {
+            return NULL;
+        }
+        newop->opcode |= isvar ? V : L;
+
+        if (svIs(tok[2], "IN")) {
+            newop->ival2 = 1;
+        } else if (svIs(tok[2], "OUT")) {
+            newop->ival2 = 0;
+        } else {
+            parseerror("Bad mode", tok[2]);
+            return NULL;
+        }
+        if (ntok > 3) {
+            if (svIs(tok[3], "PULLUP")) {
+                newop->ival3 = 1;
+            }
+        }
+        return newop;
+    }
+
+    if (svIs(code, "IF")) {
+        newop->opcode = IF;
+
+        if (ntok < 5) {
+            parseerror("Syntax error", code);
+            return NULL;
+        }
+
+        // Either side can be an expression, so the operator and the
+        // conditional command are wherever the expressions stop
+        expr left, right;
+        uint32_t at = 1;
+        if (!parseExpression(s, newop, tok, ntok, &at, &left, true, 0)) {
+            return NULL;
+        }
+        if (at + 2 >= ntok) {
+            parseerror("Syntax error", code);
+            return NULL;
+        }
+        strview oper = tok[at++];
+        if (!parseExpression(s, newop, tok, ntok, &at, &right, true, 0)) {
+            return NULL;
+        }
+        if (at >= ntok) {
+            parseerror("Syntax error", code);
+            return NULL;
+        }
+        if (left.v.isvar) newop->vval1 = left.v.n; else newop->ival1 = left.v.n;
+        if (right.v.isvar) newop->vval3 = right.v.n; else newop->ival3 = right.v.n;
+        newop->opcode |= (left.v.isvar ? VL : 0) | (right.v.isvar ? LV : 0);
+
+        // Operators
+        if (svIs(oper, "GE")) newop->ival2 = (uint32_t)GE;
+        else if (svIs(oper, "GT")) newop->ival2 = (uint32_t)GT;
+        else if (svIs(oper, "LE")) newop->ival2 = (uint32_t)LE;
+        else if (svIs(oper, "LT")) newop->ival2 = (uint32_t)LT;
+        else if (svIs(oper, "EQ")) newop->ival2 = (uint32_t)EQ;
+        else if (svIs(oper, "READS")) newop->ival2 = (uint32_t)READS;
+        else {
+            parseerror("Bad operator", oper);
+            return NULL;
+        }
+        if ((left.v.sgn || right.v.sgn) && newop->ival2 >= GE && newop->ival2 <= LT) {
+            newop->ival2 += SGE - GE;
+        }
+
+        op *altcmd = createOpcode(s, NOSYM, tok + at, ntok - at, line);
+        if (altcmd == NULL) {
+            return NULL;
+        }
+        newop->alternate = altcmd;
+        return newop;
     }
 
-    if (!strcasecmp(code, "CALL")) {
-        if (params == NULL) {
-            syntaxerror("Syntax error", line);
-            freeop(newop);
+    if (svIs(code, "CALL") || svIs(code, "GOTO")) {
+        if (ntok < 2) {
+            parseerror("Syntax error", code);
             return NULL;
         }
-        // We can't know where the label is yet, so just store the name. We'll convert in the
-        // second pass.
-        newop->cval1 = strdup(params);
-        newop->opcode = CALL;
+        // We can't know where the label is yet, so just note its name. We'll
+        // convert in the second pass.
+        strview target = svRest(tok, ntok, 1);
+        newop->ival1 = symLookup(&s->labels, target.p, target.len, true);
+        newop->col = column(target);
+        newop->opcode = svIs(code, "CALL") ? CALL : GOTO;
         return newop;
     }
 
-    if (!strcasecmp(code, "GOTO")) {
-        if (params == NULL) {
-            syntaxerror("Syntax error", line);
-            freeop(newop);
+    // ON value GOTO cases, or ON value CALL cases: one jump through a
+    // table, however many cases there are
+    if (svIs(code, "ON")) {
+        uint32_t at = 1;
+        expr e;
+        if (ntok < 4 || !parseExpression(s, newop, tok, ntok, &at, &e, true, 0)) {
+            if (ntok < 4) parseerror("Syntax error", code);
+            return NULL;
+        }
+        if (at + 1 >= ntok || !(svIs(tok[at], "GOTO") || svIs(tok[at], "CALL"))) {
+            parseerror("Syntax error", at < ntok ? tok[at] : code);
+            return NULL;
+        }
+        bool call = svIs(tok[at], "CALL");
+        jumptable *t = parseCases(s, tok[at + 1].p, lineEnd(tok, ntok));
+        if (t == NULL) {
+            return NULL;
+        }
+
+        // A literal picks its case now
+        if (!e.v.isvar) {
+            uint32_t label = t->deflt;
+            newop->col = t->defcol;
+            for (uint32_t i = 0; i < t->count; i++) {
+                if (t->cases[i].value == e.v.n) {
+                    label = t->cases[i].label;
+                    newop->col = t->cases[i].col;
+                }
+            }
+            if (label != NOSYM) {
+                newop->opcode = call ? CALL : GOTO;
+                newop->ival1 = label;
+            }
+            return newop;
+        }
+
+        newop->ival1 = constAlloc(s, t->hash ? 2 + 2 * t->size : 3 + t->size);
+        if (newop->ival1 == NOSYM) {
+            parseerror("Out of memory", code);
             return NULL;
         }
-        // We can't know where the label is yet, so just store the name. We'll convert in the
-        // second pass.
-        newop->cval1 = strdup(params);
-        newop->opcode = GOTO;
+        newop->opcode = ON;
+        newop->ival2 = call;
+        newop->vval1 = e.v.n;
+        newop->cases = t;
         return newop;
     }
 
-    if (!strcasecmp(code, "PLAY")) {
-        if (params == NULL) {
-            syntaxerror("Syntax error", line);
-            freeop(newop);
+    if (svIs(code, "PLAY")) {
+        if (ntok < 2) {
+            parseerror("Syntax error", code);
             return NULL;
         }
-        newop->cval1 = strdup(params);
+        // An entry in a table of samples...
+        exprparser x;
+        exprInit(&x, s, newop, tok[1].p, lineEnd(tok, ntok));
+        uint32_t v;
+        strview name = exprName(&x, &v);
+        if (symLookup(&s->arrays, name.p, name.len, false) != NOSYM && x.p + name.len < x.end &&
+            x.p[name.len] == '[') {
+            arrayinfo *arr;
+            expr index;
+            uint32_t at = 1;
+            x.p += name.len;
+            if (!exprIndex(&x, name, &arr, &index) || !exprFinish(&x, tok, ntok, &at)) {
+                return NULL;
+            }
+            if (!arr->samples) {
+                parseerror("Not a table of samples", name);
+                return NULL;
+            }
+            if (index.v.isvar) {
+                newop->opcode = PLAY | V;
+                newop->ival1 = arr->desc;
+                newop->vval1 = index.v.n;
+            } else {
+                newop->opcode = PLAY;
+                newop->ival1 = s->consts[arr->base + index.v.n];
+            }
+            return newop;
+        }
+
+        // ...or a file. Each distinct file becomes a sample ID, loaded once
+        // before we run.
+        strview file = svRest(tok, ntok, 1);
+        newop->ival1 = symLookup(&s->samples, file.p, file.len, true);
         newop->opcode = PLAY;
         return newop;
     }
 
-    if (!strcasecmp(code, "SET")) {
-        char *dest = strtok(params, " \t");
-        char *src = strtok(NULL, " \t");
-        newop->opcode = SET;
-        if (src == NULL) {
-            syntaxerror("Syntax error", line);
-            freeop(newop);
+    if (svIs(code, "SET")) {
+        if (ntok < 3) {
+            parseerror("Syntax error", code);
+            return NULL;
+        }
+        lvalue dest;
+        expr e;
+        uint32_t at = 1;
+        if (!parseTarget(s, newop, tok, ntok, &at, &dest)) {
+            return NULL;
+        }
+        if (at == ntok) {
+            parseerror("Syntax error", code);
+            return NULL;
+        }
+        if (!parseExpression(s, newop, tok, ntok, &at, &e, false, 0) || !assignOp(s, newop, &dest, &e)) {
+            return NULL;
+        }
+        return newop;
+    }
+
+    uint32_t oper;
+    if (arithCommand(code, &oper)) {
+        // ADD x a b sets x to a + b, and ADD x a adds a to x
+        if (ntok < 3) {
+            parseerror("Syntax error", code);
+            return NULL;
+        }
+        lvalue dest;
+        expr left, right;
+        uint32_t at = 1;
+        if (!parseTarget(s, newop, tok, ntok, &at, &dest)) {
+            return NULL;
+        }
+        if (at == ntok) {
+            parseerror("Syntax error", code);
             return NULL;
         }
-        newop->vval1 = findVariable(dest);
-        if (newop->vval1 == NULL) {
-            syntaxerror("Unknown variable", line);
-            freeop(newop);
+        if (!parseExpression(s, newop, tok, ntok, &at, &right, true, EXPR_PRIMARY)) {
             return NULL;
         }
-        if (isNumber(src)) {
-            newop->ival2 = atoi(src);
-            newop->opcode |= L;
+        if (at < ntok) {
+            left = right;
+            if (!parseExpression(s, newop, tok, ntok, &at, &right, true, EXPR_PRIMARY)) {
+                return NULL;
+            }
         } else {
-            newop->vval2 = findVariable(src);
-            newop->opcode |= V;
-            if (newop->vval2 == NULL) {
-                syntaxerror("Unknown variable", line);
-                freeop(newop);
+            // Read the target as the left hand operand
+            uint32_t self = 1;
+            if (!parseExpression(s, newop, tok, ntok, &self, &left, true, EXPR_PRIMARY)) {
                 return NULL;
             }
         }
-        return newop;
+
+        exprparser x;
+        exprInit(&x, s, newop, NULL, NULL);
+        if (!exprBinary(&x, oper, &left, &right) || !assignOp(s, newop, &dest, &left)) {
+            return NULL;
+        }
+        return newop;
+    }
+
+    if (svIs(code, "DISPLAY") || svIs(code, "DELAY")) {
+        newop->opcode = svIs(code, "DISPLAY") ? DISPLAY : DELAY;
+        if (ntok < 2) {
+            parseerror("Syntax error", code);
+            return NULL;
+        }
+        expr e;
+        uint32_t at = 1;
+        if (!parseExpression(s, newop, tok, ntok, &at, &e, true, 0)) {
+            return NULL;
+        }
+        if (e.v.isvar) newop->vval1 = e.v.n; else newop->ival1 = e.v.n;
+        newop->opcode |= e.v.isvar ? V : L;
+        return newop;
+    }
+
+    if (svIs(code, "DEC") || svIs(code, "INC")) {
+        if (ntok < 2) {
+            parseerror("Syntax error", code);
+            return NULL;
+        }
+        uint32_t opcode = svIs(code, "DEC") ? DEC : INC;
+        uint32_t at = 1;
+        lvalue dest;
+        if (!parseTarget(s, newop, tok, ntok, &at, &dest)) {
+            return NULL;
+        }
+        if (!dest.indexed) {
+            newop->opcode = opcode;
+            newop->vval1 = dest.slot;
+            return newop;
+        }
+
+        // An element picked at run time is loaded, stepped and stored back
+        expr e;
+        e.pending = true;
+        e.oper = INDEX;
+        e.left.isvar = false;
+        e.left.n = dest.desc;
+        e.right.isvar = true;
+        e.right.n = dest.index;
+        exprparser x;
+        exprInit(&x, s, newop, NULL, NULL);
+        op *step = newOp(s, NOSYM, line, newop->col);
+        if (step == NULL || !exprValue(&x, &e)) {
+            return NULL;
+        }
+        s->ntemps += x.maxtemps;
+        step->opcode = opcode;
+        step->vval1 = e.v.n;
+        op **tail = &newop->pre;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        *tail = step;
+        return assignOp(s, newop, &dest, &e) ? newop : NULL;
+    }
+
+    if (svIs(code, "RETURN")) {
+        newop->opcode = RETURN;
+        return newop;
+    }
+
+    parseerror("Unknown command", code);
+    return NULL;
+}
+
+// Entry point of a label, or PC_IDLE if there's no such label.
+uint32_t findLabel(script *s, const char *label) {
+    uint32_t id = symLookup(&s->labels, label, strlen(label), false);
+    if (id == NOSYM) {
+        return PC_IDLE;
+    }
+    return s->labelPc[id];
+}
+
+// Scan through looking for labels. Update the alternate pointer to the
+// destination of the label.
+bool plang_pass2(script *s) {
+    op *scan = s->ops;
+    while (scan) {
+        op *what = scan;
+        while ((what->opcode & 0xFFF0) == IF) {
+            what = what->alternate;
+        }
+        if ((what->opcode & 0xFFF0) == GOTO || (what->opcode & 0xFFF0) == CALL) {
+            op *lab = (op *)s->labels.entries[what->ival1].ptr;
+            if (lab == NULL) {
+                syntaxerrorAt("Unknown label", what->line, what->col);
+                return false;
+            }
+            what->alternate = lab;
+        }
+        if ((what->opcode & 0xFFF0) == ON) {
+            jumptable *t = what->cases;
+            for (uint32_t i = 0; i < t->count; i++) {
+                if (s->labels.entries[t->cases[i].label].ptr == NULL) {
+                    syntaxerrorAt("Unknown label", what->line, t->cases[i].col);
+                    return false;
+                }
+            }
+            if (t->deflt != NOSYM && s->labels.entries[t->deflt].ptr == NULL) {
+                syntaxerrorAt("Unknown label", what->line, t->defcol);
+                return false;
+            }
+        }
+        scan = scan->next;
+    }
+
+    event *escan = s->events;
+    while (escan) {
+        if (s->labels.entries[escan->label].ptr == NULL) {
+            syntaxerrorAt("Unknown label", escan->line, escan->col);
+            return false;
+        }
+        escan = escan->next;
+    }
+    return true;
+}
+
+// Number of instructions an op lowers to. An IF is a conditional skip over
+// its alternate command, so it takes one slot plus whatever that needs, and
+// any op with expressions in it has their arithmetic in front.
+static uint32_t opSize(op *oc) {
+    uint32_t n = 0;
+    for (op *p = oc->pre; p; p = p->next) {
+        n++;
+    }
+    if ((oc->opcode & 0xFFF0) == IF) {
+        return n + 1 + opSize(oc->alternate);
+    }
+    return n + 1;
+}
+
+static uint32_t ifBase(uint32_t oper) {
+    switch (oper) {
+        case READS: return X_IF_READS_LL;
+        case EQ: return X_IF_EQ_LL;
+        case GE: return X_IF_GE_LL;
+        case GT: return X_IF_GT_LL;
+        case LE: return X_IF_LE_LL;
+        case LT: return X_IF_LT_LL;
+        case SGE: return X_IF_SGE_LL;
+        case SGT: return X_IF_SGT_LL;
+        case SLE: return X_IF_SLE_LL;
+        case SLT: return X_IF_SLT_LL;
+    }
+    return X_IF_EQ_LL;
+}
+
+static inline op *labelOp(script *s, uint32_t label) {
+    return (op *)s->labels.entries[label].ptr;
+}
+
+// Temporaries go after the variables
+static inline uint32_t slotOf(script *s, uint32_t v) {
+    return v & TEMP ? s->variables.count + (v & ~TEMP) : v;
+}
+
+// Lower a single op (and any alternate hanging off it) into the code array
+// starting at pc.
+static void emitOp(script *s, insn *code, op *oc, uint32_t pc) {
+    uint32_t end = pc + opSize(oc);
+    for (op *p = oc->pre; p; p = p->next) {
+        emitOp(s, code, p, pc);
+        code[pc++].prelude = 1;
+    }
+    insn *i = &code[pc];
+    uint32_t vars = oc->opcode & 0x000F;
+
+    i->prelude = 0;
+    i->line = oc->line;
+    i->a.lit = 0;
+    i->b.lit = 0;
+    i->target = 0;
+
+    switch (oc->opcode & 0xFFF0) {
+        case NOP:
+            i->op = X_NOP;
+            break;
+        case MODE:
+            i->op = vars & V ? X_MODE_V : X_MODE_L;
+            if (vars & V) i->a.slot = oc->vval1; else i->a.lit = oc->ival1;
+            i->b.lit = oc->ival2;
+            if (oc->ival2 == 1 && oc->ival3 == 1) {
+                i->b.lit = 2; // INPUT_PULLUP
+            }
+            break;
+        case CALL:
+            i->op = X_CALL;
+            i->target = oc->alternate->pc;
+            break;
+        case GOTO:
+            i->op = X_GOTO;
+            i->target = oc->alternate->pc;
+            break;
+        case RETURN:
+            i->op = X_RETURN;
+            break;
+        case SET:
+            i->op = vars & V ? X_SET_V : X_SET_L;
+            i->a.slot = oc->vval1;
+            if (vars & V) i->b.slot = slotOf(s, oc->vval2); else i->b.lit = oc->ival2;
+            break;
+        case DISPLAY:
+            i->op = vars & V ? X_DISPLAY_V : X_DISPLAY_L;
+            if (vars & V) i->a.slot = slotOf(s, oc->vval1); else i->a.lit = oc->ival1;
+            break;
+        case DELAY:
+            i->op = vars & V ? X_DELAY_V : X_DELAY_L;
+            if (vars & V) i->a.slot = slotOf(s, oc->vval1); else i->a.lit = oc->ival1;
+            break;
+        case DEC:
+            i->op = X_DEC;
+            i->a.slot = slotOf(s, oc->vval1);
+            break;
+        case INC:
+            i->op = X_INC;
+            i->a.slot = slotOf(s, oc->vval1);
+            break;
+        case PLAY:
+            if (vars & V) {
+                i->op = X_PLAY_TABLE;
+                i->a.slot = slotOf(s, oc->vval1);
+                i->target = oc->ival1;
+            } else {
+                i->op = X_PLAY;
+                i->a.lit = oc->ival1;
+            }
+            break;
+        case ON: {
+            // Labels have their pcs now, so the table can be filled in
+            jumptable *t = oc->cases;
+            uint32_t *k = s->consts + oc->ival1;
+            uint32_t deflt = t->deflt == NOSYM ? PC_IDLE : labelOp(s, t->deflt)->pc;
+            if (t->hash) {
+                uint32_t mask = t->size - 1;
+                uint32_t *keys = k + 1;
+                uint32_t *pcs = k + 3 + mask;
+                k[0] = mask;
+                pcs[-1] = deflt;
+                for (uint32_t n = 0; n < t->size; n++) {
+                    keys[n] = 0;
+                    pcs[n] = PC_IDLE;
+                }
+                for (uint32_t n = 0; n < t->count; n++) {
+                    uint32_t h = caseHash(t->cases[n].value) & mask;
+                    while (pcs[h] != PC_IDLE) {
+                        h = (h + 1) & mask;
+                    }
+                    keys[h] = t->cases[n].value;
+                    pcs[h] = labelOp(s, t->cases[n].label)->pc;
+                }
+            } else {
+                k[0] = t->lo;
+                k[1] = t->size;
+                k[2] = deflt;
+                for (uint32_t n = 0; n < t->size; n++) {
+                    k[3 + n] = deflt;
+                }
+                for (uint32_t n = 0; n < t->count; n++) {
+                    k[3 + t->cases[n].value - t->lo] = labelOp(s, t->cases[n].label)->pc;
+                }
+            }
+            i->op = X_ON_GOTO + oc->ival2 + (t->hash ? 2 : 0);
+            i->a.slot = slotOf(s, oc->vval1);
+            i->target = oc->ival1;
+            break;
+        }
+        case IF:
+            // LL, LV, VL and VV follow each other in the XOP list
+            i->op = ifBase(oc->ival2) + vars;
+            if (vars & VL) i->a.slot = slotOf(s, oc->vval1); else i->a.lit = oc->ival1;
+            if (vars & LV) i->b.slot = slotOf(s, oc->vval3); else i->b.lit = oc->ival3;
+            i->target = end;
+            emitOp(s, code, oc->alternate, pc + 1);
+            break;
+        case ARITH:
+            i->op = X_ADD_LL + oc->ival2 * 4 + vars;
+            if (vars & VL) i->a.slot = slotOf(s, oc->vval1); else i->a.lit = oc->ival1;
+            if (vars & LV) i->b.slot = slotOf(s, oc->vval3); else i->b.lit = oc->ival3;
+            i->target = slotOf(s, oc->vval2);
+            break;
+        case LOAD:
+            i->op = oc->ival3 ? X_LOAD_TABLE : X_LOAD;
+            i->a.slot = slotOf(s, oc->vval1);
+            i->b.slot = slotOf(s, oc->vval2);
+            i->target = oc->ival1;
+            break;
+        case STORE:
+            i->op = vars & V ? X_STORE_V : X_STORE_L;
+            i->a.slot = slotOf(s, oc->vval1);
+            if (vars & V) i->b.slot = slotOf(s, oc->vval2); else i->b.lit = oc->ival2;
+            i->target = oc->ival1;
+            break;
+        default:
+            i->op = X_NOP;
+            break;
+    }
+}
+
+static inline bool eventWants(event *e, uint32_t type) {
+    return e->type == type || e->type == CHANGE;
+}
+
+// Build the pin to handler index for one edge direction.
+static bool buildPinIndex(script *s, pinindex *idx, uint32_t type) {
+    uint32_t total = 0;
+
+    memset(idx->start, 0, sizeof(idx->start));
+    for (event *escan = s->events; escan; escan = escan->next) {
+        if (eventWants(escan, type)) {
+            idx->start[escan->source + 1]++;
+            total++;
+        }
+        s->watched[escan->source >> 6] |= 1ULL << (escan->source & 63);
+    }
+    for (uint32_t p = 0; p < PLANG_MAX_PINS; p++) {
+        idx->start[p + 1] += idx->start[p];
+    }
+
+    idx->list = (event **)arenaAlloc(&s->mem, sizeof(event *) * (total ? total : 1));
+    if (idx->list == NULL) {
+        syntaxerror("Out of memory", 0);
+        return false;
+    }
+
+    // Fill in list order so handlers on the same pin run in script order
+    uint32_t fill[PLANG_MAX_PINS];
+    memcpy(fill, idx->start, sizeof(fill));
+    for (event *escan = s->events; escan; escan = escan->next) {
+        if (eventWants(escan, type)) {
+            idx->list[fill[escan->source]++] = escan;
+        }
+    }
+    return true;
+}
+
+// Lower the linked op list into one contiguous instruction array. Must be
+// run after plang_pass2() so that GOTO and CALL alternates are resolved.
+bool plang_compile(script *s) {
+    uint32_t pc = 0;
+    for (op *scan = s->ops; scan; scan = scan->next) {
+        scan->pc = pc;
+        pc += opSize(scan);
+    }
+
+    // One extra slot for the HALT that catches execution falling off the end
+    s->codelen = pc + 1;
+    s->code = (insn *)arenaAlloc(&s->mem, sizeof(insn) * s->codelen);
+    if (s->code == NULL) {
+        syntaxerror("Out of memory", 0);
+        return false;
+    }
+    insn *code = s->code;
+
+    // Room for the temporaries after the variables, starting at zero
+    uint32_t nslots = s->variables.count + s->ntemps;
+    if (nslots > s->slotcap) {
+        uint32_t *slots = (uint32_t *)arenaAlloc(&s->mem, sizeof(uint32_t) * nslots);
+        if (slots == NULL) {
+            syntaxerror("Out of memory", 0);
+            return false;
+        }
+        if (s->variables.count > 0) {
+            memcpy(slots, s->slots, sizeof(uint32_t) * s->variables.count);
+        }
+        s->slots = slots;
+        s->slotcap = nslots;
+    }
+    for (uint32_t t = s->variables.count; t < nslots; t++) {
+        s->slots[t] = 0;
+    }
+
+    for (op *scan = s->ops; scan; scan = scan->next) {
+        emitOp(s, code, scan, scan->pc);
+    }
+
+    code[pc].op = X_HALT;
+    code[pc].prelude = 0;
+    code[pc].line = 0;
+    code[pc].a.lit = 0;
+    code[pc].b.lit = 0;
+    code[pc].target = 0;
+
+    s->labelPc = (uint32_t *)arenaAlloc(&s->mem, sizeof(uint32_t) * (s->labels.count + 1));
+    if (s->labelPc == NULL) {
+        syntaxerror("Out of memory", 0);
+        return false;
+    }
+    for (uint32_t id = 0; id < s->labels.count; id++) {
+        op *lab = (op *)s->labels.entries[id].ptr;
+        s->labelPc[id] = lab ? lab->pc : PC_IDLE;
+    }
+    for (event *escan = s->events; escan; escan = escan->next) {
+        escan->pc = s->labelPc[escan->label];
+    }
+    return true;
+}
+
+// Optimizer. Rewrites the compiled code in place, between plang_compile()
+// and running it, so that handlers take fewer dispatches to do the same
+// thing. Every rewrite leaves what the script does unchanged; the only
+// difference a script can see is that fused instructions count as one
+// against the budget.
+
+bool optimize = true;
+bool optReport = false;
+
+struct optstats {
+    uint32_t before;
+    uint32_t after;
+    uint32_t folded;
+    uint32_t threaded;
+    uint32_t branches;
+    uint32_t fused;
+    uint32_t dead;
+    uint32_t removed;
+};
+
+typedef struct optstats optstats;
+
+// Work out an IF between two literals, if it can be worked out now.
+// READS looks at a pin, so it never can.
+static bool foldCompare(uint32_t xop, uint32_t left, uint32_t right, bool *result) {
+    switch ((xop - X_IF_READS_LL) >> 2) {
+        case EQ: *result = left == right; return true;
+        case GE: *result = left >= right; return true;
+        case GT: *result = left > right; return true;
+        case LE: *result = left <= right; return true;
+        case LT: *result = left < right; return true;
+        case SGE: *result = (int32_t)left >= (int32_t)right; return true;
+        case SGT: *result = (int32_t)left > (int32_t)right; return true;
+        case SLE: *result = (int32_t)left <= (int32_t)right; return true;
+        case SLT: *result = (int32_t)left < (int32_t)right; return true;
+    }
+    return false;
+}
+
+// Where a jump to t really ends up, skipping NOPs and following chains of
+// GOTOs. The hop limit stops GOTO loops from going round for ever.
+static uint32_t threadJump(insn *code, uint32_t t, uint32_t *hops) {
+    for (uint32_t n = 0; n < 64; n++) {
+        while (code[t].op == X_NOP) {
+            t++;
+        }
+        if (code[t].op != X_GOTO || code[t].target == t) {
+            break;
+        }
+        t = code[t].target;
+        (*hops)++;
+    }
+    return t;
+}
+
+static inline uint32_t nextLive(bool *gone, uint32_t pc) {
+    do {
+        pc++;
+    } while (gone[pc]);
+    return pc;
+}
+
+// Fold any DEC x that is followed by DISPLAY x and/or a branch on x gt n
+// into a single instruction.
+static bool fuseCountdown(insn *code, bool *gone, bool *entry, uint32_t pc) {
+    insn *i = &code[pc];
+    uint32_t q = nextLive(gone, pc);
+    if (code[q].op == X_DISPLAY_V && code[q].a.slot == i->a.slot && !entry[q]) {
+        uint32_t r = nextLive(gone, q);
+        if (code[r].op == X_BR_GT_VL && code[r].a.slot == i->a.slot && !entry[r]) {
+            i->op = X_DEC_DISPLAY_BR_GT_VL;
+            i->b = code[r].b;
+            i->target = code[r].target;
+            gone[r] = true;
+        } else {
+            i->op = X_DEC_DISPLAY;
+        }
+        gone[q] = true;
+        return true;
+    }
+    if (code[q].op == X_BR_GT_VL && code[q].a.slot == i->a.slot && !entry[q]) {
+        i->op = X_DEC_BR_GT_VL;
+        i->b = code[q].b;
+        i->target = code[q].target;
+        gone[q] = true;
+        return true;
+    }
+    return false;
+}
+
+bool plang_optimize(script *s) {
+    insn *code = s->code;
+    uint32_t n = s->codelen;
+    optstats st;
+    memset(&st, 0, sizeof(st));
+    st.before = n;
+
+    bool *gone = (bool *)calloc(n + 1, sizeof(bool));
+    bool *entry = (bool *)calloc(n + 1, sizeof(bool));
+    bool *reached = (bool *)calloc(n + 1, sizeof(bool));
+    // Room for every root and every jump the dead code search might follow,
+    // jump tables included
+    uint32_t worksize = n + 3 + s->nconsts;
+    for (event *e = s->events; e; e = e->next) {
+        worksize++;
+    }
+    uint32_t *work = (uint32_t *)malloc(sizeof(uint32_t) * worksize);
+    if (gone == NULL || entry == NULL || reached == NULL || work == NULL) {
+        free(gone);
+        free(entry);
+        free(reached);
+        free(work);
+        syntaxerror("Out of memory", 0);
+        return false;
+    }
+    // Stops nextLive() from running off the end; the final HALT is never
+    // removed, so nothing gets that far.
+    gone[n] = false;
+
+    // Constant IFs become a NOP, falling into the conditional command, or a
+    // GOTO round it.
+    for (uint32_t pc = 0; pc < n; pc++) {
+        bool result;
+        if (isIf(code[pc].op) && ((code[pc].op - X_IF_READS_LL) & 3) == LL &&
+            foldCompare(code[pc].op, code[pc].a.lit, code[pc].b.lit, &result)) {
+            code[pc].op = result ? X_NOP : X_GOTO;
+            st.folded++;
+        }
+    }
+
+    // Jumps to jumps go straight to the final destination, and a GOTO to a
+    // RETURN or the end is just a RETURN or the end.
+    for (uint32_t pc = 0; pc < n; pc++) {
+        if (isSwitch(code[pc].op)) {
+            uint32_t count;
+            uint32_t *pcs = jumpPcs(s->consts, &code[pc], &count);
+            for (uint32_t j = 0; j < count; j++) {
+                if (pcs[j] != PC_IDLE) pcs[j] = threadJump(code, pcs[j], &st.threaded);
+            }
+        }
+        if (hasTarget(code[pc].op)) {
+            code[pc].target = threadJump(code, code[pc].target, &st.threaded);
+            uint32_t dest = code[code[pc].target].op;
+            if (code[pc].op == X_GOTO && (dest == X_RETURN || dest == X_HALT)) {
+                code[pc].op = dest;
+                code[pc].target = 0;
+                st.threaded++;
+            }
+        }
+    }
+
+    // Anywhere execution can arrive other than by falling through. Nothing
+    // may be fused into an instruction marked here.
+    for (uint32_t id = 0; id < s->labels.count; id++) {
+        if (s->labelPc[id] != PC_IDLE) entry[s->labelPc[id]] = true;
+    }
+    for (event *e = s->events; e; e = e->next) {
+        entry[e->pc] = true;
+    }
+    for (uint32_t pc = 0; pc < n; pc++) {
+        if (hasTarget(code[pc].op)) entry[code[pc].target] = true;
+        if (code[pc].op == X_CALL || code[pc].op == X_ON_CALL || code[pc].op == X_ON_CALL_HASH) {
+            entry[pc + 1] = true;
+        }
+        if (isSwitch(code[pc].op)) {
+            uint32_t count;
+            uint32_t *pcs = jumpPcs(s->consts, &code[pc], &count);
+            for (uint32_t j = 0; j < count; j++) {
+                if (pcs[j] != PC_IDLE) entry[pcs[j]] = true;
+            }
+        }
+    }
+
+    // Superinstructions: IF ... GOTO becomes a single conditional branch,
+    // then countdown sequences built on it.
+    for (uint32_t pc = 0; pc + 1 < n; pc++) {
+        // Only when the IF's alternate is just the GOTO. A nested IF
+        // folded to a GOTO has its outer IF skipping further.
+        if (isIf(code[pc].op) && code[pc + 1].op == X_GOTO && code[pc].target == pc + 2 && !entry[pc + 1]) {
+            code[pc].op = X_BR_READS_LL + (code[pc].op - X_IF_READS_LL);
+            code[pc].target = code[pc + 1].target;
+            gone[pc + 1] = true;
+            st.branches++;
+        }
+    }
+    for (uint32_t pc = 0; pc + 1 < n; pc++) {
+        if (!gone[pc] && code[pc].op == X_DEC && fuseCountdown(code, gone, entry, pc)) {
+            st.fused++;
+        }
+    }
+
+    // Dead code: anything that can't be reached from init, bench or an
+    // event handler.
+    uint32_t nwork = 0;
+    uint32_t roots[2] = { findLabel(s, "init"), findLabel(s, "bench") };
+    for (uint32_t i = 0; i < 2; i++) {
+        if (roots[i] != PC_IDLE) work[nwork++] = roots[i];
+    }
+    for (event *e = s->events; e; e = e->next) {
+        work[nwork++] = e->pc;
+    }
+    while (nwork > 0) {
+        uint32_t pc = work[--nwork];
+        while (pc < n && !reached[pc]) {
+            reached[pc] = true;
+            uint32_t xop = code[pc].op;
+            if (gone[pc]) {
+                pc++;
+                continue;
+            }
+            if (hasTarget(xop) && !reached[code[pc].target]) {
+                work[nwork++] = code[pc].target;
+            }
+            if (isSwitch(xop)) {
+                uint32_t count;
+                uint32_t *pcs = jumpPcs(s->consts, &code[pc], &count);
+                for (uint32_t j = 0; j < count; j++) {
+                    if (pcs[j] != PC_IDLE && !reached[pcs[j]]) work[nwork++] = pcs[j];
+                }
+            }
+            if (xop == X_GOTO || xop == X_RETURN || xop == X_HALT) {
+                break;
+            }
+            pc++;
+        }
+    }
+    reached[n - 1] = true;
+    for (uint32_t pc = 0; pc < n; pc++) {
+        if (!reached[pc] && !gone[pc]) {
+            gone[pc] = true;
+            st.dead++;
+        }
+    }
+
+    // NOPs, and GOTOs to wherever execution would have gone anyway
+    for (uint32_t pc = 0; pc + 1 < n; pc++) {
+        if (gone[pc]) {
+            continue;
+        }
+        if (code[pc].op == X_NOP) {
+            gone[pc] = true;
+            st.removed++;
+        } else if (code[pc].op == X_GOTO) {
+            uint32_t t = code[pc].target;
+            while (gone[t] || code[t].op == X_NOP) {
+                t++;
+            }
+            if (t == nextLive(gone, pc)) {
+                gone[pc] = true;
+                st.removed++;
+            }
+        }
+    }
+
+    // Close up the gaps. An instruction that went maps to whatever now
+    // follows it, which is where falling through it would have ended up.
+    uint32_t *newpc = work;
+    uint32_t k = 0;
+    for (uint32_t pc = 0; pc < n; pc++) {
+        newpc[pc] = k;
+        if (!gone[pc]) {
+            k++;
+        }
+    }
+    for (uint32_t pc = 0; pc < n; pc++) {
+        if (!gone[pc]) {
+            insn i = code[pc];
+            if (hasTarget(i.op)) {
+                i.target = newpc[i.target];
+            }
+            if (isSwitch(i.op)) {
+                uint32_t count;
+                uint32_t *pcs = jumpPcs(s->consts, &i, &count);
+                for (uint32_t j = 0; j < count; j++) {
+                    if (pcs[j] != PC_IDLE) pcs[j] = newpc[pcs[j]];
+                }
+            }
+            code[newpc[pc]] = i;
+        }
+    }
+    for (uint32_t id = 0; id < s->labels.count; id++) {
+        uint32_t pc = s->labelPc[id];
+        if (pc != PC_IDLE) {
+            s->labelPc[id] = reached[pc] ? newpc[pc] : PC_IDLE;
+        }
+    }
+    for (event *e = s->events; e; e = e->next) {
+        e->pc = newpc[e->pc];
+    }
+    s->codelen = k;
+    st.after = k;
+
+    if (optReport) {
+        fprintf(stderr, "Optimizer: %u instructions in, %u out\n", st.before, st.after);
+        fprintf(stderr, "  %u constant IFs folded\n", st.folded);
+        fprintf(stderr, "  %u jumps threaded\n", st.threaded);
+        fprintf(stderr, "  %u IF/GOTO pairs made into branches\n", st.branches);
+        fprintf(stderr, "  %u countdown sequences fused\n", st.fused);
+        fprintf(stderr, "  %u unreachable instructions removed\n", st.dead);
+        fprintf(stderr, "  %u NOPs and redundant GOTOs removed\n", st.removed);
+    }
+
+    free(gone);
+    free(entry);
+    free(reached);
+    free(work);
+    return true;
+}
+
+// Get a compiled program ready to run, however it was loaded.
+bool plang_link(script *s) {
+    // Until plang_load_samples() says otherwise, assume the audio engine
+    // numbers samples the same way we do
+    s->audioIds = (uint32_t *)arenaAlloc(&s->mem, sizeof(uint32_t) * (s->samples.count + 1));
+    if (s->audioIds == NULL) {
+        syntaxerror("Out of memory", 0);
+        return false;
+    }
+    for (uint32_t id = 0; id < s->samples.count; id++) {
+        s->audioIds[id] = id;
+    }
+
+    return buildPinIndex(s, &s->rising, RISING) && buildPinIndex(s, &s->falling, FALLING);
+}
+
+// Add a variable with its initial value. Returns its slot, or NOVAR if out
+// of memory.
+static uint32_t defineVariable(script *s, strview name, uint32_t value, bool sgn) {
+    if (s->variables.count == s->slotcap) {
+        uint32_t cap = s->slotcap ? s->slotcap * 2 : 64;
+        uint32_t *slots = (uint32_t *)arenaAlloc(&s->mem, sizeof(uint32_t) * cap);
+        bool *signedVars = (bool *)arenaAlloc(&s->mem, sizeof(bool) * cap);
+        if (slots == NULL || signedVars == NULL) {
+            return NOVAR;
+        }
+        if (s->slotcap > 0) {
+            memcpy(slots, s->slots, sizeof(uint32_t) * s->slotcap);
+            memcpy(signedVars, s->signedVars, sizeof(bool) * s->slotcap);
+        }
+        s->slots = slots;
+        s->signedVars = signedVars;
+        s->slotcap = cap;
+    }
+    uint32_t var = symLookup(&s->variables, name.p, name.len, true);
+    if (var == NOSYM) {
+        return NOVAR;
+    }
+    s->slots[var] = value;
+    s->signedVars[var] = sgn;
+    return var;
+}
+
+// Name an array or table and give it its constant pool entry, with room
+// for the values if it is a table.
+static arrayinfo *newArray(script *s, strview name, uint32_t len, bool table) {
+    arrayinfo *arr = (arrayinfo *)arenaAlloc(&s->mem, sizeof(arrayinfo));
+    uint32_t id = symLookup(&s->arrays, name.p, name.len, true);
+    uint32_t desc = constAlloc(s, table ? len + 1 : 2);
+    if (arr == NULL || id == NOSYM || desc == NOSYM) {
+        parseerror("Out of memory", name);
+        return NULL;
+    }
+    s->arrays.entries[id].ptr = arr;
+    arr->len = len;
+    arr->desc = desc;
+    arr->table = table;
+    arr->samples = false;
+    arr->sgn = false;
+    arr->base = table ? desc + 1 : s->variables.count;
+    s->consts[desc] = len;
+    if (!table) {
+        s->consts[desc + 1] = arr->base;
+    }
+    return arr;
+}
+
+// DEF [SIGNED] name[size] values... Each element is a variable of its own,
+// called name[0] and so on, and they take consecutive slots.
+static bool defineArray(script *s, strview *tok, uint32_t ntok, bool sgn) {
+    strview def = tok[1];
+    const char *br = (const char *)memchr(def.p, '[', def.len);
+    strview name = { def.p, (uint32_t)(br - def.p) };
+    strview size = { br + 1, (uint32_t)(def.p + def.len - br - 1) };
+    if (name.len == 0 || size.len < 2 || size.p[size.len - 1] != ']' || !isNumber(size) ||
+        svNumber(size) == 0) {
+        parseerror("Bad array size", def);
+        return false;
+    }
+    uint32_t len = svNumber(size);
+
+    // Only the first definition of a name counts
+    if (symLookup(&s->arrays, name.p, name.len, false) != NOSYM) {
+        return true;
+    }
+    if (ntok - 2 > len) {
+        parseerror("Too many values", tok[len + 2]);
+        return false;
+    }
+
+    char **names = (char **)arenaAlloc(&s->mem, sizeof(char *) * len);
+    if (names == NULL) {
+        parseerror("Out of memory", def);
+        return false;
+    }
+    bool clash = findVariable(s, name) != NOVAR;
+    for (uint32_t i = 0; i < len && !clash; i++) {
+        names[i] = (char *)arenaAlloc(&s->mem, name.len + 13);
+        if (names[i] == NULL) {
+            parseerror("Out of memory", def);
+            return false;
+        }
+        snprintf(names[i], name.len + 13, "%.*s[%u]", name.len, name.p, i);
+        strview elem = { names[i], (uint32_t)strlen(names[i]) };
+        clash = findVariable(s, elem) != NOVAR;
+    }
+    if (clash) {
+        parseerror("Name already in use", def);
+        return false;
+    }
+
+    arrayinfo *arr = newArray(s, name, len, false);
+    if (arr == NULL) {
+        return false;
+    }
+    arr->sgn = sgn;
+    for (uint32_t i = 0; i < len; i++) {
+        strview elem = { names[i], (uint32_t)strlen(names[i]) };
+        if (defineVariable(s, elem, i + 2 < ntok ? svNumber(tok[i + 2]) : 0, sgn) == NOVAR) {
+            parseerror("Out of memory", def);
+            return false;
+        }
+    }
+    return true;
+}
+
+// TABLE name values... Either every value is a number, making a table of
+// numbers that is signed if any of them are negative, or none are and it is
+// a table of sample files for PLAY.
+static bool defineTable(script *s, strview *tok, uint32_t ntok) {
+    strview name = tok[1];
+    if (symLookup(&s->arrays, name.p, name.len, false) != NOSYM) {
+        return true;
+    }
+    if (findVariable(s, name) != NOVAR) {
+        parseerror("Name already in use", name);
+        return false;
+    }
+    bool numbers = isInteger(tok[2]);
+    for (uint32_t i = 3; i < ntok; i++) {
+        if (isInteger(tok[i]) != numbers) {
+            parseerror("Bad table", tok[i]);
+            return false;
+        }
+    }
+
+    arrayinfo *arr = newArray(s, name, ntok - 2, true);
+    if (arr == NULL) {
+        return false;
+    }
+    arr->samples = !numbers;
+    for (uint32_t i = 2; i < ntok; i++) {
+        uint32_t value;
+        if (numbers) {
+            value = svNumber(tok[i]);
+            arr->sgn = arr->sgn || tok[i].p[0] == '-';
+        } else {
+            value = symLookup(&s->samples, tok[i].p, tok[i].len, true);
+            if (value == NOSYM) {
+                parseerror("Out of memory", tok[i]);
+                return false;
+            }
+        }
+        s->consts[arr->base + i - 2] = value;
+    }
+    return true;
+}
+
+// Handle one line of source, already split into tokens.
+static bool parseLine(script *s, strview *tok, uint32_t ntok, uint32_t lineno) {
+    uint32_t label = NOSYM;
+
+    if (tok[0].p[0] == '#') {
+        return true;
+    }
+    if (tok[0].p[tok[0].len - 1] == ':') {
+        label = symLookup(&s->labels, tok[0].p, tok[0].len - 1, true);
+        if (label == NOSYM) {
+            parseerror("Out of memory", tok[0]);
+            return false;
+        }
+        tok++;
+        ntok--;
+        // A label on its own labels a NOP
+        if (ntok == 0) {
+            static const char nop[] = "NOP";
+            static strview noptok = { nop, 3 };
+            tok = &noptok;
+            ntok = 1;
+        }
+    }
+
+    strview opcode = tok[0];
+
+    // First the def directive. This isn't really a program instruction
+    // so we don't want to create an opcode for it.
+
+    if (svIs(opcode, "DEF")) {
+        if (ntok < 2) {
+            parseerror("Syntax error", opcode);
+            return false;
+        }
+        // DEF SIGNED name declares a variable that holds negative numbers.
+        // A variable called signed is still allowed.
+        bool sgn = false;
+        if (ntok > 2 && svIs(tok[1], "SIGNED") && !isNumber(tok[2])) {
+            sgn = true;
+            tok++;
+            ntok--;
+        }
+        strview vname = tok[1];
+        if (memchr(vname.p, '[', vname.len) != NULL) {
+            return defineArray(s, tok, ntok, sgn);
+        }
+        uint32_t dv = ntok > 2 ? svNumber(tok[2]) : 0;
+
+        // Only the first definition of a name counts
+        if (findVariable(s, vname) != NOVAR) {
+            return true;
+        }
+        if (symLookup(&s->arrays, vname.p, vname.len, false) != NOSYM) {
+            parseerror("Name already in use", vname);
+            return false;
+        }
+        if (defineVariable(s, vname, dv, sgn) == NOVAR) {
+            parseerror("Out of memory", vname);
+            return false;
+        }
+        return true;
+    }
+
+    // TABLE name values... declares a table of constants, numbers or
+    // sample files.
+
+    if (svIs(opcode, "TABLE")) {
+        if (ntok < 3) {
+            parseerror("Syntax error", opcode);
+            return false;
+        }
+        return defineTable(s, tok, ntok);
+    }
+
+    // Also the LINK command isn't a real command but an instruction
+    // to the language to link a specific function to an event.
+
+    if (svIs(opcode, "LINK")) {
+        if (ntok < 4) {
+            parseerror("Syntax error", opcode);
+            return false;
+        }
+        strview pin = tok[1];
+        strview type = tok[2];
+        strview target = tok[3];
+        uint32_t ntype = 0;
+        uint32_t npin = 0;
+
+        if (svIs(type, "RISING")) {
+            ntype = RISING;
+        } else if (svIs(type, "FALLING")) {
+            ntype = FALLING;
+        } else if (svIs(type, "CHANGE")) {
+            ntype = CHANGE;
+        } else {
+            parseerror("Bad event type", type);
+            return false;
+        }
+
+        if (isNumber(pin)) {
+            npin = svNumber(pin);
+        } else {
+            uint32_t v = findVariable(s, pin);
+            if (v == NOVAR) {
+                parseerror("Unknown variable", pin);
+                return false;
+            }
+            npin = s->slots[v];
+        }
+
+        if (npin >= PLANG_MAX_PINS) {
+            parseerror("Pin out of range", pin);
+            return false;
+        }
+
+        uint32_t label = symLookup(&s->labels, target.p, target.len, true);
+        if (label == NOSYM || !addEvent(s, ntype, npin, label, lineno, column(target))) {
+            parseerror("Out of memory", target);
+            return false;
+        }
+        return true;
+    }
+
+    op *newop = createOpcode(s, label, tok, ntok, lineno);
+    if (newop == NULL) {
+        return false;
+    }
+    // The first definition of a label wins
+    if (label != NOSYM && s->labels.entries[label].ptr == NULL) {
+        s->labels.entries[label].ptr = newop;
+    }
+    addOpcode(s, newop);
+    return true;
+}
+
+// Parse a whole script in one pass. Names in the symbol tables point into
+// the source rather than being copied.
+bool plang_parse(script *s) {
+    const char *p = s->src;
+    const char *end = s->src + s->srclen;
+
+    cur.lineno = 0;
+    while (p < end) {
+        cur.lineno++;
+        cur.start = p;
+        cur.ntok = 0;
+
+        // Split the line on white space
+        while (p < end && *p != '\n') {
+            if ((uint8_t)*p <= ' ') {
+                p++;
+                continue;
+            }
+            if (cur.ntok == cur.cap) {
+                cur.cap = cur.cap ? cur.cap * 2 : 16;
+                cur.tok = (strview *)realloc(cur.tok, sizeof(strview) * cur.cap);
+                if (cur.tok == NULL) {
+                    syntaxerror("Out of memory", cur.lineno);
+                    return false;
+                }
+            }
+            strview *t = &cur.tok[cur.ntok++];
+            t->p = p;
+            while (p < end && (uint8_t)*p > ' ') {
+                p++;
+            }
+            t->len = p - t->p;
+        }
+        if (p < end) {
+            p++;
+        }
+
+        if (cur.ntok > 0 && !parseLine(s, cur.tok, cur.ntok, cur.lineno)) {
+            return false;
+        }
+    }
+    s->lines = cur.lineno;
+    return true;
+}
+
+// Compiled program images. An image is the linked program laid out so that
+// it can be mapped and run as it is: the code is used straight from the
+// mapping and only the variables, which change, are copied out. Everything
+// refers to everything else by offset or index, so an image can be mapped
+// anywhere. Names are offsets into the string table.
+//
+// Images are only readable by a plang built with the same instruction set,
+// so bump PLC_VERSION whenever the XOP list or the insn layout changes.
+
+#define PLC_VERSION 6
+
+static const char plcMagic[4] = { 'P', 'L', 'C', 0x1A };
+
+struct plcsection {
+    uint32_t offset;
+    uint32_t count;
+};
+
+typedef struct plcsection plcsection;
+
+struct plcname {
+    uint32_t offset;
+    uint32_t len;
+};
+
+typedef struct plcname plcname;
+
+struct plcheader {
+    char magic[4];
+    uint32_t version;
+    // Written as 0x01020304, to catch images from the wrong endianness
+    uint32_t byteorder;
+    uint16_t insnsize;
+    uint16_t xops;
+    uint32_t maxpins;
+    uint32_t lines;
+    // Expression temporaries, which follow the variables
+    uint32_t temps;
+    plcsection code;
+    // Constant data referred to by instructions; word sized entries
+    plcsection consts;
+    plcsection variables;
+    plcsection labels;
+    plcsection events;
+    plcsection samples;
+    plcsection strings;
+};
+
+typedef struct plcheader plcheader;
+
+// A variable and its value at load time
+struct plcvar {
+    plcname name;
+    uint32_t value;
+};
+
+typedef struct plcvar plcvar;
+
+struct plclabel {
+    plcname name;
+    uint32_t pc;
+};
+
+typedef struct plclabel plclabel;
+
+struct plcevent {
+    uint32_t type;
+    uint32_t source;
+    uint32_t label;
+    uint32_t pc;
+    uint32_t line;
+    uint32_t col;
+};
+
+typedef struct plcevent plcevent;
+
+static inline bool isImage(script *s) {
+    return s->srclen >= sizeof(plcheader) && !memcmp(s->src, plcMagic, sizeof(plcMagic));
+}
+
+// Put a section at the next 16 byte boundary in the image
+static uint32_t plcPlace(plcsection *sec, uint32_t *size, uint32_t count, uint32_t itemsize) {
+    sec->offset = (*size + 15) & ~15;
+    sec->count = count;
+    *size = sec->offset + count * itemsize;
+    return sec->offset;
+}
+
+static plcname plcString(symbol *sym, uint32_t *strings) {
+    plcname n;
+    n.offset = *strings;
+    n.len = sym->len;
+    *strings += sym->len;
+    return n;
+}
+
+// Write a loaded program out as an image.
+bool plang_write_image(script *s, const char *filename) {
+    plcheader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, plcMagic, sizeof(plcMagic));
+    h.version = PLC_VERSION;
+    h.byteorder = 0x01020304;
+    h.insnsize = sizeof(insn);
+    h.xops = X_COUNT;
+    h.maxpins = PLANG_MAX_PINS;
+    h.lines = s->lines;
+    h.temps = s->ntemps;
+
+    uint32_t nevents = 0;
+    for (event *e = s->events; e; e = e->next) {
+        nevents++;
+    }
+    uint32_t nstrings = 0;
+    for (uint32_t i = 0; i < s->variables.count; i++) nstrings += s->variables.entries[i].len;
+    for (uint32_t i = 0; i < s->labels.count; i++) nstrings += s->labels.entries[i].len;
+    for (uint32_t i = 0; i < s->samples.count; i++) nstrings += s->samples.entries[i].len;
+
+    uint32_t size = sizeof(plcheader);
+    plcPlace(&h.code, &size, s->codelen, sizeof(insn));
+    plcPlace(&h.consts, &size, s->nconsts, sizeof(uint32_t));
+    plcPlace(&h.variables, &size, s->variables.count, sizeof(plcvar));
+    plcPlace(&h.labels, &size, s->labels.count, sizeof(plclabel));
+    plcPlace(&h.events, &size, nevents, sizeof(plcevent));
+    plcPlace(&h.samples, &size, s->samples.count, sizeof(plcname));
+    plcPlace(&h.strings, &size, nstrings, 1);
+
+    char *img = (char *)calloc(1, size);
+    if (img == NULL) {
+        printf("Out of memory\n");
+        return false;
+    }
+    memcpy(img, &h, sizeof(h));
+    memcpy(img + h.code.offset, s->code, sizeof(insn) * s->codelen);
+    if (s->nconsts > 0) {
+        memcpy(img + h.consts.offset, s->consts, sizeof(uint32_t) * s->nconsts);
+    }
+
+    char *strings = img + h.strings.offset;
+    uint32_t str = 0;
+    plcvar *vars = (plcvar *)(img + h.variables.offset);
+    for (uint32_t i = 0; i < s->variables.count; i++) {
+        memcpy(strings + str, s->variables.entries[i].name, s->variables.entries[i].len);
+        vars[i].name = plcString(&s->variables.entries[i], &str);
+        vars[i].value = s->slots[i];
+    }
+    plclabel *labs = (plclabel *)(img + h.labels.offset);
+    for (uint32_t i = 0; i < s->labels.count; i++) {
+        memcpy(strings + str, s->labels.entries[i].name, s->labels.entries[i].len);
+        labs[i].name = plcString(&s->labels.entries[i], &str);
+        labs[i].pc = s->labelPc[i];
+    }
+    plcname *smps = (plcname *)(img + h.samples.offset);
+    for (uint32_t i = 0; i < s->samples.count; i++) {
+        memcpy(strings + str, s->samples.entries[i].name, s->samples.entries[i].len);
+        smps[i] = plcString(&s->samples.entries[i], &str);
+    }
+    plcevent *evs = (plcevent *)(img + h.events.offset);
+    for (event *e = s->events; e; e = e->next, evs++) {
+        evs->type = e->type;
+        evs->source = e->source;
+        evs->label = e->label;
+        evs->pc = e->pc;
+        evs->line = e->line;
+        evs->col = e->col;
+    }
+
+    FILE *f = fopen(filename, "wb");
+    bool ok = f != NULL && fwrite(img, 1, size, f) == size;
+    if (f != NULL && fclose(f) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        printf("Unable to write %s\n", filename);
+    }
+    free(img);
+    return ok;
+}
+
+static bool plcFits(script *s, plcsection *sec, uint32_t itemsize) {
+    return sec->offset <= s->srclen && sec->count <= (s->srclen - sec->offset) / itemsize &&
+        (sec->offset & 3) == 0;
+}
+
+static bool plcNameFits(plcheader *h, plcname n) {
+    return n.offset <= h->strings.count && n.len <= h->strings.count - n.offset;
+}
+
+// Intern every name in an image section into a symbol table, in order, so
+// that IDs in the image and the table agree.
+static bool plcSymbols(script *s, symtab *t, plcsection *sec, uint32_t stride) {
+    plcheader *h = (plcheader *)s->src;
+    const char *strings = s->src + h->strings.offset;
+    for (uint32_t i = 0; i < sec->count; i++) {
+        plcname n = *(plcname *)(s->src + sec->offset + i * stride);
+        if (!plcNameFits(h, n) || symLookup(t, strings + n.offset, n.len, true) != i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check that an instruction can't take the VM outside the program.
+static bool plcCheckInsn(script *s, insn *i) {
+    uint32_t nvars = s->variables.count + s->ntemps;
+    if (i->op >= X_COUNT || i->prelude > 1) {
+        return false;
+    }
+    if (isArith(i->op)) {
+        uint32_t mode = (i->op - X_ADD_LL) & 3;
+        return i->target < nvars && (!(mode & VL) || i->a.slot < nvars) && (!(mode & LV) || i->b.slot < nvars);
+    }
+    if (isIndexed(i->op)) {
+        // The descriptor has to be in the pool, and so does everything it
+        // leads to
+        uint32_t desc = i->target;
+        if (desc >= s->nconsts || s->nconsts - desc < 2) {
+            return false;
+        }
+        uint32_t len = s->consts[desc];
+        uint32_t index = i->op == X_LOAD || i->op == X_LOAD_TABLE ? i->b.slot : i->a.slot;
+        if (index >= nvars || ((i->op == X_LOAD || i->op == X_LOAD_TABLE) && i->a.slot >= nvars) ||
+            (i->op == X_STORE_V && i->b.slot >= nvars)) {
+            return false;
+        }
+        if (i->op == X_LOAD || i->op == X_STORE_L || i->op == X_STORE_V) {
+            uint32_t base = s->consts[desc + 1];
+            return base <= nvars && len <= nvars - base;
+        }
+        if (len > s->nconsts - desc - 1) {
+            return false;
+        }
+        for (uint32_t n = 0; i->op == X_PLAY_TABLE && n < len; n++) {
+            if (s->consts[desc + 1 + n] >= s->samples.count) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (isSwitch(i->op)) {
+        // The whole table has to be in the pool, and every pc in the program
+        uint32_t desc = i->target;
+        if (i->a.slot >= nvars || desc >= s->nconsts || s->nconsts - desc < 3) {
+            return false;
+        }
+        bool hash = i->op == X_ON_GOTO_HASH || i->op == X_ON_CALL_HASH;
+        uint32_t *t = s->consts + desc;
+        if (hash ? (t[0] & (t[0] + 1)) != 0 || t[0] >= (s->nconsts - desc - 2) / 2 :
+            t[1] > s->nconsts - desc - 3) {
+            return false;
+        }
+        uint32_t count;
+        uint32_t *pcs = jumpPcs(s->consts, i, &count);
+        for (uint32_t n = 0; n < count; n++) {
+            if (pcs[n] >= s->codelen && pcs[n] != PC_IDLE) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (i->target >= s->codelen) {
+        return false;
+    }
+    if (isIf(i->op) || isBranch(i->op)) {
+        uint32_t mode = (i->op - X_IF_READS_LL) & 3;
+        return (!(mode & VL) || i->a.slot < nvars) && (!(mode & LV) || i->b.slot < nvars);
+    }
+    switch (i->op) {
+        case X_MODE_V: case X_SET_L: case X_DISPLAY_V: case X_DELAY_V: case X_DEC: case X_INC:
+        case X_DEC_DISPLAY: case X_DEC_BR_GT_VL: case X_DEC_DISPLAY_BR_GT_VL:
+            return i->a.slot < nvars;
+        case X_SET_V:
+            return i->a.slot < nvars && i->b.slot < nvars;
+        case X_PLAY:
+            return i->a.lit < s->samples.count;
+    }
+    return true;
+}
+
+// Set a program up from a mapped image. Nothing is parsed: the code runs
+// from the mapping and the rest is indexes and offsets into it.
+static bool loadImage(script *s) {
+    plcheader *h = (plcheader *)s->src;
+    if (h->version != PLC_VERSION || h->byteorder != 0x01020304 || h->insnsize != sizeof(insn) ||
+        h->xops != X_COUNT || h->maxpins != PLANG_MAX_PINS) {
+        printf("Compiled program is for a different version of plang\n");
+        return false;
+    }
+    if (!plcFits(s, &h->code, sizeof(insn)) || !plcFits(s, &h->consts, sizeof(uint32_t)) ||
+        !plcFits(s, &h->variables, sizeof(plcvar)) || !plcFits(s, &h->labels, sizeof(plclabel)) ||
+        !plcFits(s, &h->events, sizeof(plcevent)) || !plcFits(s, &h->samples, sizeof(plcname)) ||
+        !plcFits(s, &h->strings, 1) || h->code.count == 0) {
+        printf("Compiled program is damaged\n");
+        return false;
+    }
+
+    s->lines = h->lines;
+    s->code = (insn *)(s->src + h->code.offset);
+    s->codelen = h->code.count;
+    s->consts = (uint32_t *)(s->src + h->consts.offset);
+    s->nconsts = h->consts.count;
+
+    if (!plcSymbols(s, &s->variables, &h->variables, sizeof(plcvar)) ||
+        !plcSymbols(s, &s->labels, &h->labels, sizeof(plclabel)) ||
+        !plcSymbols(s, &s->samples, &h->samples, sizeof(plcname))) {
+        printf("Compiled program is damaged\n");
+        return false;
+    }
+
+    // Variables are the only part that changes, so they get copied out
+    // Every temporary is written by some instruction
+    if (h->temps > h->code.count) {
+        printf("Compiled program is damaged\n");
+        return false;
+    }
+    s->ntemps = h->temps;
+    s->slotcap = s->variables.count + s->ntemps;
+    s->slots = (uint32_t *)arenaAlloc(&s->mem, sizeof(uint32_t) * (s->slotcap + 1));
+    s->labelPc = (uint32_t *)arenaAlloc(&s->mem, sizeof(uint32_t) * (s->labels.count + 1));
+    if (s->slots == NULL || s->labelPc == NULL) {
+        printf("Out of memory\n");
+        return false;
+    }
+    plcvar *vars = (plcvar *)(s->src + h->variables.offset);
+    for (uint32_t i = 0; i < h->variables.count; i++) {
+        s->slots[i] = vars[i].value;
+    }
+    for (uint32_t i = h->variables.count; i < s->slotcap; i++) {
+        s->slots[i] = 0;
+    }
+    plclabel *labs = (plclabel *)(s->src + h->labels.offset);
+    for (uint32_t i = 0; i < h->labels.count; i++) {
+        if (labs[i].pc >= s->codelen && labs[i].pc != PC_IDLE) {
+            printf("Compiled program is damaged\n");
+            return false;
+        }
+        s->labelPc[i] = labs[i].pc;
+    }
+
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        if (!plcCheckInsn(s, &s->code[pc])) {
+            printf("Compiled program is damaged at instruction %u\n", pc);
+            return false;
+        }
+    }
+    // Running off the end must stop rather than run off the mapping
+    if (s->code[s->codelen - 1].op != X_HALT) {
+        printf("Compiled program is damaged\n");
+        return false;
+    }
+
+    plcevent *evs = (plcevent *)(s->src + h->events.offset);
+    for (uint32_t i = 0; i < h->events.count; i++) {
+        if (evs[i].source >= PLANG_MAX_PINS || evs[i].pc >= s->codelen || evs[i].type > CHANGE ||
+            evs[i].label >= s->labels.count) {
+            printf("Compiled program is damaged\n");
+            return false;
+        }
+        if (!addEvent(s, evs[i].type, evs[i].source, evs[i].label, evs[i].line, evs[i].col)) {
+            printf("Out of memory\n");
+            return false;
+        }
+        s->eventsTail->pc = evs[i].pc;
+    }
+
+    return plang_link(s);
+}
+
+// Translation to C. Each handler becomes a resumable state machine: one
+// function runs any context, switching on its pc to carry on from wherever
+// it left off, and every DELAY, RETURN and exhausted budget is a point at
+// which it suspends. The generated file links against the runtime in plrt.c,
+// whose scheduler matches the interpreter's, so a translated program does
+// exactly what the interpreted one would, down to where handlers yield.
+
+static const char *emitArg(char *buf, operand o, bool var) {
+    if (var) {
+        sprintf(buf, "v[%u]", o.slot);
+    } else {
+        sprintf(buf, "%uu", o.lit);
+    }
+    return buf;
+}
+
+static void emitString(FILE *f, const char *str, uint32_t len) {
+    fputc('"', f);
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t c = str[i];
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < ' ' || c > '~' || c == '?') {
+            fprintf(f, "\\%03o", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void emitInsn(FILE *f, insn *i, uint32_t pc, uint32_t *consts) {
+    static const char *const compare[] = { "==", "==", ">=", ">", "<=", "<", ">=", ">", "<=", "<" };
+    // Division is a runtime call, to get the interpreter's answers
+    static const char *const arithmetic[] = {
+        "+", "-", "*", "plrt_div", "plrt_mod", "&", "|", "plrt_sdiv", "plrt_smod"
+    };
+    char a[24], b[24];
+
+    if (isIf(i->op) || isBranch(i->op)) {
+        uint32_t rel = isIf(i->op) ? i->op - X_IF_READS_LL : i->op - X_BR_READS_LL;
+        uint32_t oper = rel >> 2;
+        emitArg(a, i->a, rel & VL);
+        emitArg(b, i->b, rel & LV);
+        const char *cast = oper >= SGE ? "(int32_t)" : "";
+        fprintf(f, "        if (%s(%s%s%s%s %s %s%s)) goto L%u;\n", isIf(i->op) ? "!" : "",
+            oper == READS ? "plrt_read(" : "", cast, a, oper == READS ? ")" : "", compare[oper], cast, b,
+            i->target);
+        return;
+    }
+    if (isIndexed(i->op)) {
+        // Lengths and element slots are known here; only tables need k[]
+        uint32_t index = i->op == X_LOAD || i->op == X_LOAD_TABLE ? i->b.slot : i->a.slot;
+        fprintf(f, "        if (v[%u] >= %uu) {\n", index, consts[i->target]);
+        fprintf(f, "            plrt_error(\"Index out of range\", %u);\n", i->line);
+        fprintf(f, "            ctx->pc = PLRT_IDLE;\n");
+        fprintf(f, "            return start - budget;\n");
+        fprintf(f, "        }\n");
+        switch (i->op) {
+            case X_LOAD:
+                fprintf(f, "        v[%u] = v[%u + v[%u]];\n", i->a.slot, consts[i->target + 1], index);
+                break;
+            case X_LOAD_TABLE:
+                fprintf(f, "        v[%u] = k[%u + v[%u]];\n", i->a.slot, i->target + 1, index);
+                break;
+            case X_STORE_L:
+            case X_STORE_V:
+                fprintf(f, "        v[%u + v[%u]] = %s;\n", consts[i->target + 1], index,
+                    emitArg(b, i->b, i->op == X_STORE_V));
+                break;
+            case X_PLAY_TABLE:
+                fprintf(f, "        plrt_play(k[%u + v[%u]]);\n", i->target + 1, index);
+                break;
+        }
+        return;
+    }
+    if (isSwitch(i->op)) {
+        // A switch, which the C compiler can make its own jump table of. The
+        // default is the first pc.
+        bool call = i->op == X_ON_CALL || i->op == X_ON_CALL_HASH;
+        bool hash = i->op == X_ON_GOTO_HASH || i->op == X_ON_CALL_HASH;
+        const uint32_t *t = consts + i->target;
+        uint32_t count;
+        uint32_t *pcs = jumpPcs(consts, i, &count);
+        if (call) {
+            fprintf(f, "        {\n");
+            fprintf(f, "        uint32_t to = PLRT_IDLE;\n");
+        }
+        fprintf(f, "        switch (v[%u]) {\n", i->a.slot);
+        for (uint32_t n = 1; n < count; n++) {
+            if (pcs[n] == PC_IDLE || pcs[n] == pcs[0]) {
+                continue;
+            }
+            uint32_t value = hash ? t[n] : t[0] + n - 1;
+            if (call) {
+                fprintf(f, "        case %uu: to = %u; break;\n", value, pcs[n]);
+            } else {
+                fprintf(f, "        case %uu: goto L%u;\n", value, pcs[n]);
+            }
+        }
+        if (pcs[0] != PC_IDLE) {
+            if (call) {
+                fprintf(f, "        default: to = %u;\n", pcs[0]);
+            } else {
+                fprintf(f, "        default: goto L%u;\n", pcs[0]);
+            }
+        }
+        fprintf(f, "        }\n");
+        if (call) {
+            fprintf(f, "        if (to != PLRT_IDLE) {\n");
+            fprintf(f, "            if (ctx->sp == PLRT_STACK_DEPTH) {\n");
+            fprintf(f, "                plrt_error(\"Call stack overflow\", %u);\n", i->line);
+            fprintf(f, "                ctx->pc = PLRT_IDLE;\n");
+            fprintf(f, "                return start - budget;\n");
+            fprintf(f, "            }\n");
+            fprintf(f, "            ctx->stack[ctx->sp++] = %u;\n", pc + 1);
+            fprintf(f, "            ctx->pc = to;\n");
+            fprintf(f, "            goto resume;\n");
+            fprintf(f, "        }\n");
+            fprintf(f, "        }\n");
+        }
+        return;
+    }
+    if (isArith(i->op)) {
+        uint32_t rel = i->op - X_ADD_LL;
+        emitArg(a, i->a, rel & VL);
+        emitArg(b, i->b, rel & LV);
+        const char *oper = arithmetic[rel >> 2];
+        if (oper[0] == 'p') {
+            fprintf(f, "        v[%u] = %s(%s, %s);\n", i->target, oper, a, b);
+        } else {
+            fprintf(f, "        v[%u] = %s %s %s;\n", i->target, a, oper, b);
+        }
+        return;
+    }
+
+    switch (i->op) {
+        case X_HALT:
+            fprintf(f, "        ctx->pc = PLRT_IDLE;\n");
+            fprintf(f, "        return start - budget;\n");
+            break;
+        case X_NOP:
+            break;
+        case X_MODE_L:
+        case X_MODE_V:
+            fprintf(f, "        plrt_pin_mode(%s, %uu);\n", emitArg(a, i->a, i->op == X_MODE_V), i->b.lit);
+            break;
+        case X_CALL:
+            fprintf(f, "        if (ctx->sp == PLRT_STACK_DEPTH) {\n");
+            fprintf(f, "            plrt_error(\"Call stack overflow\", %u);\n", i->line);
+            fprintf(f, "            ctx->pc = PLRT_IDLE;\n");
+            fprintf(f, "            return start - budget;\n");
+            fprintf(f, "        }\n");
+            fprintf(f, "        ctx->stack[ctx->sp++] = %u;\n", pc + 1);
+            fprintf(f, "        goto L%u;\n", i->target);
+            break;
+        case X_GOTO:
+            fprintf(f, "        goto L%u;\n", i->target);
+            break;
+        case X_RETURN:
+            fprintf(f, "        if (ctx->sp == 0) {\n");
+            fprintf(f, "            ctx->pc = PLRT_IDLE;\n");
+            fprintf(f, "            return start - budget;\n");
+            fprintf(f, "        }\n");
+            fprintf(f, "        ctx->pc = ctx->stack[--ctx->sp];\n");
+            fprintf(f, "        goto resume;\n");
+            break;
+        case X_SET_L:
+        case X_SET_V:
+            fprintf(f, "        v[%u] = %s;\n", i->a.slot, emitArg(b, i->b, i->op == X_SET_V));
+            break;
+        case X_DISPLAY_L:
+        case X_DISPLAY_V:
+            fprintf(f, "        plrt_display(%s);\n", emitArg(a, i->a, i->op == X_DISPLAY_V));
+            break;
+        case X_DELAY_L:
+        case X_DELAY_V:
+            fprintf(f, "        ctx->wake = plrt_millis() + %s;\n", emitArg(a, i->a, i->op == X_DELAY_V));
+            fprintf(f, "        ctx->delaying = true;\n");
+            fprintf(f, "        ctx->pc = %u;\n", pc + 1);
+            fprintf(f, "        return start - budget;\n");
+            break;
+        case X_DEC:
+        case X_DEC_DISPLAY:
+        case X_DEC_BR_GT_VL:
+        case X_DEC_DISPLAY_BR_GT_VL:
+            // DEC stops at zero
+            fprintf(f, "        if (v[%u] > 0) v[%u]--;\n", i->a.slot, i->a.slot);
+            if (i->op == X_DEC_DISPLAY || i->op == X_DEC_DISPLAY_BR_GT_VL) {
+                fprintf(f, "        plrt_display(v[%u]);\n", i->a.slot);
+            }
+            if (i->op == X_DEC_BR_GT_VL || i->op == X_DEC_DISPLAY_BR_GT_VL) {
+                fprintf(f, "        if (v[%u] > %uu) goto L%u;\n", i->a.slot, i->b.lit, i->target);
+            }
+            break;
+        case X_INC:
+            fprintf(f, "        v[%u]++;\n", i->a.slot);
+            break;
+        case X_PLAY:
+            fprintf(f, "        plrt_play(%u);\n", i->a.lit);
+            break;
+    }
+}
+
+// Write a loaded program out as C source for plrt.
+bool plang_emit_c(script *s, const char *filename, const char *source) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        printf("Unable to write %s\n", filename);
+        return false;
+    }
+
+    // Labels by pc, for comments, and which pcs need a C label to jump to
+    uint32_t *names = (uint32_t *)malloc(sizeof(uint32_t) * s->codelen);
+    bool *target = (bool *)calloc(s->codelen, sizeof(bool));
+    if (names == NULL || target == NULL) {
+        free(names);
+        free(target);
+        fclose(f);
+        printf("Out of memory\n");
+        return false;
+    }
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        names[pc] = NOSYM;
+        if (hasTarget(s->code[pc].op)) {
+            target[s->code[pc].target] = true;
+        }
+        if (s->code[pc].op == X_ON_GOTO || s->code[pc].op == X_ON_GOTO_HASH) {
+            uint32_t count;
+            uint32_t *pcs = jumpPcs(s->consts, &s->code[pc], &count);
+            for (uint32_t n = 0; n < count; n++) {
+                if (pcs[n] != PC_IDLE) target[pcs[n]] = true;
+            }
+        }
+    }
+    for (uint32_t id = s->labels.count; id-- > 0; ) {
+        if (s->labelPc[id] != PC_IDLE) {
+            names[s->labelPc[id]] = id;
+        }
+    }
+
+    fprintf(f, "// Generated by plang --emit-c from %s. Do not edit.\n\n", source);
+    fprintf(f, "#include \"plrt.h\"\n\n");
+
+    fprintf(f, "const char *const plrt_samples[] = {\n");
+    for (uint32_t id = 0; id < s->samples.count; id++) {
+        fprintf(f, "    ");
+        emitString(f, s->samples.entries[id].name, s->samples.entries[id].len);
+        fprintf(f, ",\n");
+    }
+    fprintf(f, "    0\n};\n\n");
+
+    fprintf(f, "uint32_t plrt_vars[] = {\n");
+    for (uint32_t id = 0; id < s->variables.count; id++) {
+        fprintf(f, "    %uu, // %.*s\n", s->slots[id], s->variables.entries[id].len, s->variables.entries[id].name);
+    }
+    for (uint32_t t = 0; t < s->ntemps; t++) {
+        fprintf(f, "    0u, // temporary %u\n", t);
+    }
+    fprintf(f, "    0\n};\n\n");
+
+    bool tables = false;
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        tables = tables || s->code[pc].op == X_LOAD_TABLE || s->code[pc].op == X_PLAY_TABLE;
+    }
+    if (tables) {
+        fprintf(f, "static const uint32_t k[] = {");
+        for (uint32_t n = 0; n < s->nconsts; n++) {
+            fprintf(f, "%s%uu,", n % 8 ? " " : "\n    ", s->consts[n]);
+        }
+        fprintf(f, "\n};\n\n");
+    }
+
+    uint32_t nlinks = 0;
+    fprintf(f, "const plrt_link plrt_links[] = {\n");
+    for (event *e = s->events; e; e = e->next, nlinks++) {
+        fprintf(f, "    { %u, %u, %u }, // %.*s\n", e->type, e->source, e->pc,
+            s->labels.entries[e->label].len, s->labels.entries[e->label].name);
+    }
+    fprintf(f, "    { 0, 0, 0 }\n};\n\n");
+    fprintf(f, "const uint32_t plrt_nlinks = %u;\n", nlinks);
+    uint32_t init = findLabel(s, "init");
+    if (init == PC_IDLE) {
+        fprintf(f, "const uint32_t plrt_init = PLRT_IDLE;\n\n");
+    } else {
+        fprintf(f, "const uint32_t plrt_init = %u;\n\n", init);
+    }
+
+    fprintf(f, "uint32_t plrt_exec(plrt_context *ctx, uint32_t budget) {\n");
+    fprintf(f, "    uint32_t *v = plrt_vars;\n");
+    fprintf(f, "    uint32_t start = budget;\n\n");
+    fprintf(f, "resume:\n");
+    fprintf(f, "    switch (ctx->pc) {\n");
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        insn *i = &s->code[pc];
+        fprintf(f, "    case %u:", pc);
+        if (target[pc]) {
+            fprintf(f, " L%u:", pc);
+        }
+        if (names[pc] != NOSYM) {
+            fprintf(f, " // %.*s", s->labels.entries[names[pc]].len, s->labels.entries[names[pc]].name);
+        }
+        if (i->line) {
+            fprintf(f, "%s line %u", names[pc] != NOSYM ? "," : " //", i->line);
+        }
+        if (pc > 0 && s->code[pc - 1].prelude) {
+            fprintf(f, "\n        PLRT_HOLD();\n");
+        } else {
+            fprintf(f, "\n        PLRT_STEP(%u);\n", pc);
+        }
+        emitInsn(f, i, pc, s->consts);
+    }
+    fprintf(f, "    }\n");
+    fprintf(f, "    ctx->pc = PLRT_IDLE;\n");
+    fprintf(f, "    return start - budget;\n");
+    fprintf(f, "}\n");
+
+    free(names);
+    free(target);
+    if (fclose(f) != 0) {
+        printf("Unable to write %s\n", filename);
+        return false;
+    }
+    return true;
+}
+
+// Throw away a program and everything that came from it.
+void plang_unload(script *s) {
+    if (s->maplen > 0) {
+        munmap((void *)s->src, s->maplen);
+    }
+    arenaFree(&s->mem);
+    free(s);
+}
+
+static script *newScript() {
+    script *s = (script *)calloc(1, sizeof(script));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->variables.mem = &s->mem;
+    s->labels.mem = &s->mem;
+    s->samples.mem = &s->mem;
+    s->arrays.mem = &s->mem;
+    s->src = "";
+    return s;
+}
+
+// Parse and compile the source, or check the image, that s->src holds.
+// Takes ownership of s.
+static script *buildScript(script *s) {
+    bool ok;
+    if (isImage(s)) {
+        ok = loadImage(s);
+    } else {
+        ok = plang_parse(s) && plang_pass2(s) && plang_compile(s) &&
+            (!optimize || plang_optimize(s)) && plang_link(s);
+    }
+    if (!ok) {
+        plang_unload(s);
+        return NULL;
+    }
+    return s;
+}
+
+// Map a script or compiled image into memory and get it ready to run.
+// Returns NULL, having reported why, if it can't be loaded.
+script *plang_load(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Unable to open %s\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        printf("Unable to open %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    script *s = newScript();
+    if (s == NULL) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size > 0) {
+        void *src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src == MAP_FAILED) {
+            printf("Unable to map %s\n", filename);
+            close(fd);
+            free(s);
+            return NULL;
+        }
+        s->src = (const char *)src;
+        s->srclen = st.st_size;
+        s->maplen = st.st_size;
+    }
+    close(fd);
+    return buildScript(s);
+}
+
+// Load a script or image held in memory. It is copied into the program's
+// arena, which keeps the instructions of an image suitably aligned.
+script *plang_load_buffer(const char *src, size_t len) {
+    script *s = newScript();
+    if (s == NULL) {
+        return NULL;
+    }
+    if (len > 0) {
+        char *copy = (char *)arenaAlloc(&s->mem, len);
+        if (copy == NULL) {
+            syntaxerror("Out of memory", 0);
+            plang_unload(s);
+            return NULL;
+        }
+        memcpy(copy, src, len);
+        s->src = copy;
+        s->srclen = len;
+    }
+    return buildScript(s);
+}
+
+// Edge queues. With them on, an edge for an event whose handler is busy
+// waits for it instead of being missed, so a burst of input runs the
+// handler once per edge. A full queue deals with another edge according
+// to its policy: PLANG_COALESCE drops it, leaving the handler to catch up
+// with the pin's level when it has finished, as it does without queues;
+// PLANG_DROP_OLDEST makes room by forgetting the oldest edge waiting; and
+// PLANG_COUNT just counts it, and runs the handler once for each counted
+// edge when the queue has emptied. Either way the overflow is counted.
+
+static void queuesFree(handler *handlers, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        free(handlers[i].queue.ring);
+        handlers[i].queue.ring = NULL;
+    }
+}
+
+static bool queuesAlloc(handler *handlers, uint32_t n, uint32_t depth) {
+    uint32_t size = 1;
+    while (size < depth) {
+        size *= 2;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        edgequeue *q = &handlers[i].queue;
+        memset(q, 0, sizeof(*q));
+        q->ring = (uint64_t *)malloc(sizeof(uint64_t) * size);
+        if (q->ring == NULL) {
+            queuesFree(handlers, i);
+            return false;
+        }
+        q->mask = size - 1;
+    }
+    return true;
+}
+
+static bool queuesCreate(vm *m, uint32_t depth, uint32_t policy) {
+    if (!queuesAlloc(m->handlers, m->prog->nevents, depth)) {
+        return false;
+    }
+    m->queueDepth = depth;
+    m->queuePolicy = policy;
+    return true;
+}
+
+static inline bool queueEmpty(edgequeue *q) {
+    return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&q->owed, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Producer side
+static void pushEdge(vm *m, edgequeue *q, uint32_t when, uint32_t level) {
+    uint32_t tail = q->tail;
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    __atomic_fetch_add(&q->edges, 1, __ATOMIC_RELAXED);
+    if (tail - head > q->mask) {
+        __atomic_fetch_add(&q->overflows, 1, __ATOMIC_RELAXED);
+        if (m->queuePolicy == PLANG_COALESCE) {
+            return;
+        }
+        if (m->queuePolicy == PLANG_COUNT) {
+            __atomic_fetch_add(&q->owed, 1, __ATOMIC_RELEASE);
+            return;
+        }
+        // If this fails the consumer took the oldest edge first, which
+        // makes room just as well
+        __atomic_compare_exchange_n(&q->head, &head, head + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    __atomic_store_n(&q->ring[tail & q->mask], (uint64_t)when << 32 | level, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    uint32_t depth = tail + 1 - __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    if (depth > __atomic_load_n(&q->deepest, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&q->deepest, depth, __ATOMIC_RELAXED);
+    }
+}
+
+// Consumer side. The entry is read before head is moved past it, and if
+// the producer dropped it in the meantime the compare and swap fails and
+// we go round again.
+static bool popEdge(edgequeue *q, uint32_t *when, uint32_t *level) {
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    while (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        uint64_t e = __atomic_load_n(&q->ring[head & q->mask], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&q->head, &head, head + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *when = e >> 32;
+            *level = (uint32_t)e;
+            return true;
+        }
+    }
+    return false;
+}
+
+void vm_destroy(vm *m);
+
+// Start a new instance of a program, with its variables at their initial
+// values and every handler idle. host may be NULL for an instance that
+// doesn't reach the outside world. Returns NULL if out of memory.
+vm *vm_create(script *s, const plang_host *host, void *ctx) {
+    vm *m = (vm *)calloc(1, sizeof(vm));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->prog = s;
+    if (host) {
+        m->host = *host;
+    }
+    m->hostctx = ctx;
+    m->budget = budget;
+    m->vars = (uint32_t *)malloc(sizeof(uint32_t) * (s->slotcap + 1));
+    m->handlers = (handler *)calloc(s->nevents + 1, sizeof(handler));
+    if (m->vars == NULL || m->handlers == NULL) {
+        free(m->vars);
+        free(m->handlers);
+        free(m);
+        return NULL;
+    }
+    memcpy(m->vars, s->slots, sizeof(uint32_t) * s->slotcap);
+    for (uint32_t i = 0; i < s->nevents; i++) {
+        ctxStart(&m->handlers[i].ctx, PC_IDLE);
+    }
+    // Stub! The first ten pins start high like pulled-up inputs.
+    m->ins[0] = 0x3FF;
+    if (queueDepth > 0 && !queuesCreate(m, queueDepth, queuePolicy)) {
+        vm_destroy(m);
+        return NULL;
+    }
+    return m;
+}
+
+void vm_destroy(vm *m) {
+    queuesFree(m->handlers, m->prog->nevents);
+    free(m->ring);
+    free(m->delays);
+    free(m->handlers);
+    free(m->vars);
+    free(m);
+}
+
+// Profiler. While it is on every instruction dispatched is counted and
+// timed, IFs and branches count how often their condition held, time is
+// also charged to the stack of labels the context is in (callers first)
+// and handlers note how long they took to start after their edge. It
+// costs nothing when off: plang_exec() runs a separate copy of the
+// interpreter with the bookkeeping compiled in.
+
+// A node in the tree of label stacks seen, linked to its first child and
+// next sibling. Node 0 is the root.
+struct profnode {
+    uint32_t label;
+    uint32_t parent;
+    uint32_t child;
+    uint32_t sibling;
+    uint64_t count;
+    uint64_t ticks;
+};
+
+typedef struct profnode profnode;
+
+struct profile {
+    script *prog;
+    // Label each instruction is in, NOSYM before the first
+    uint32_t *labelOf;
+    // Indexed by pc
+    uint64_t *count;
+    uint64_t *ticks;
+    uint64_t *taken;
+
+    profnode *nodes;
+    uint32_t nnodes;
+    uint32_t nodecap;
+    uint32_t cur;
+    // Calls less returns since the last instruction was timed
+    int32_t depth;
+
+    // The instruction being timed and when it was dispatched
+    uint32_t lastPc;
+    uint64_t lastTick;
+
+    // Indexed by event: when its edge was seen, and the latency from
+    // there to the handler's first instruction
+    uint64_t *edgeAt;
+    uint64_t *starts;
+    uint64_t *latency;
+    uint64_t *latencyMax;
+
+    // For converting ticks to nanoseconds
+    uint64_t startNanos;
+    uint64_t startTicks;
+};
+
+typedef struct profile profile;
+
+static inline uint64_t profileClock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return monotonic();
+#endif
+}
+
+// Child of node parent for label, created if need be
+static uint32_t profileChild(profile *p, uint32_t parent, uint32_t label) {
+    uint32_t n = p->nodes[parent].child;
+    while (n != 0) {
+        if (p->nodes[n].label == label) {
+            return n;
+        }
+        n = p->nodes[n].sibling;
+    }
+    if (p->nnodes == p->nodecap) {
+        profnode *grown = (profnode *)realloc(p->nodes, sizeof(profnode) * p->nodecap * 2);
+        if (grown == NULL) {
+            // Lump everything else in with the parent
+            return parent;
+        }
+        p->nodes = grown;
+        p->nodecap *= 2;
+    }
+    n = p->nnodes++;
+    memset(&p->nodes[n], 0, sizeof(profnode));
+    p->nodes[n].label = label;
+    p->nodes[n].parent = parent;
+    p->nodes[n].sibling = p->nodes[parent].child;
+    p->nodes[parent].child = n;
+    return n;
+}
+
+void profile_free(profile *p) {
+    free(p->labelOf);
+    free(p->count);
+    free(p->ticks);
+    free(p->taken);
+    free(p->edgeAt);
+    free(p->starts);
+    free(p->latency);
+    free(p->latencyMax);
+    free(p->nodes);
+    free(p);
+}
+
+profile *profile_create(script *s) {
+    profile *p = (profile *)calloc(1, sizeof(profile));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->prog = s;
+    p->labelOf = (uint32_t *)malloc(sizeof(uint32_t) * (s->codelen + 1));
+    p->count = (uint64_t *)calloc(s->codelen + 1, sizeof(uint64_t));
+    p->ticks = (uint64_t *)calloc(s->codelen + 1, sizeof(uint64_t));
+    p->taken = (uint64_t *)calloc(s->codelen + 1, sizeof(uint64_t));
+    p->edgeAt = (uint64_t *)calloc(s->nevents + 1, sizeof(uint64_t));
+    p->starts = (uint64_t *)calloc(s->nevents + 1, sizeof(uint64_t));
+    p->latency = (uint64_t *)calloc(s->nevents + 1, sizeof(uint64_t));
+    p->latencyMax = (uint64_t *)calloc(s->nevents + 1, sizeof(uint64_t));
+    p->nodecap = 64;
+    p->nodes = (profnode *)calloc(p->nodecap, sizeof(profnode));
+    if (!p->labelOf || !p->count || !p->ticks || !p->taken || !p->edgeAt ||
+        !p->starts || !p->latency || !p->latencyMax || !p->nodes) {
+        profile_free(p);
+        return NULL;
+    }
+    p->nnodes = 1;
+    p->nodes[0].label = NOSYM;
+    p->lastPc = PC_IDLE;
+
+    // Where several labels share an entry point the first defined wins
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        p->labelOf[pc] = NOSYM;
+    }
+    for (uint32_t id = s->labels.count; id-- > 0; ) {
+        if (s->labelPc[id] < s->codelen) {
+            p->labelOf[s->labelPc[id]] = id;
+        }
+    }
+    uint32_t in = NOSYM;
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        if (p->labelOf[pc] != NOSYM) {
+            in = p->labelOf[pc];
+        }
+        p->labelOf[pc] = in;
+    }
+
+    p->startNanos = monotonic();
+    p->startTicks = profileClock();
+    return p;
+}
+
+// Charge the time since the last instruction to it.
+static inline void profileCharge(profile *p, uint64_t now) {
+    if (p->lastPc != PC_IDLE) {
+        p->ticks[p->lastPc] += now - p->lastTick;
+        p->nodes[p->cur].ticks += now - p->lastTick;
+    }
+}
+
+// About to dispatch the instruction at pc
+static inline void profileStep(profile *p, uint32_t pc) {
+    uint64_t now = profileClock();
+    profileCharge(p, now);
+
+    // Follow any CALL or RETURN since last time, then any jump into
+    // another label
+    uint32_t label = p->labelOf[pc];
+    if (p->depth > 0) {
+        p->cur = profileChild(p, p->cur, label);
+    } else if (p->depth < 0 && p->cur != 0) {
+        p->cur = p->nodes[p->cur].parent;
+    }
+    p->depth = 0;
+    if (p->nodes[p->cur].label != label) {
+        p->cur = profileChild(p, p->nodes[p->cur].parent, label);
+    }
+
+    p->count[pc]++;
+    p->nodes[p->cur].count++;
+    p->lastPc = pc;
+    p->lastTick = now;
+}
+
+// Pick up where a context left off: the node for the labels of its
+// callers and of where it is now.
+static void profileEnter(profile *p, context *ctx) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < ctx->sp; i++) {
+        n = profileChild(p, n, p->labelOf[ctx->stack[i] - 1]);
+    }
+    p->cur = profileChild(p, n, p->labelOf[ctx->pc]);
+    p->depth = 0;
+    p->lastPc = PC_IDLE;
+}
+
+static void profileLeave(profile *p) {
+    profileCharge(p, profileClock());
+    p->lastPc = PC_IDLE;
+}
+
+static inline void profileEdge(profile *p, event *e) {
+    p->edgeAt[e->index] = monotonic();
+}
+
+static inline void profileHandlerStart(profile *p, event *e) {
+    uint64_t took = monotonic() - p->edgeAt[e->index];
+    p->starts[e->index]++;
+    p->latency[e->index] += took;
+    if (took > p->latencyMax[e->index]) {
+        p->latencyMax[e->index] = took;
+    }
+}
+
+// Instructions listed in the report
+#ifndef PLANG_PROFILE_TOP
+#define PLANG_PROFILE_TOP 40
+#endif
+
+struct profrow {
+    uint64_t ticks;
+    uint64_t count;
+    uint32_t id;
+};
+
+typedef struct profrow profrow;
+
+static int compareRows(const void *a, const void *b) {
+    const profrow *x = (const profrow *)a;
+    const profrow *y = (const profrow *)b;
+    if (x->ticks != y->ticks) {
+        return x->ticks < y->ticks ? 1 : -1;
+    }
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static void printLabel(FILE *f, script *s, uint32_t label) {
+    if (label == NOSYM) {
+        fprintf(f, "(top)");
+    } else {
+        fprintf(f, "%.*s", s->labels.entries[label].len, s->labels.entries[label].name);
+    }
+}
+
+static bool isConditional(uint32_t xop) {
+    return isIf(xop) || isBranch(xop) || xop == X_DEC_BR_GT_VL || xop == X_DEC_DISPLAY_BR_GT_VL;
+}
+
+// Write the report, sorted by time, to <base>.txt and the label stacks to
+// <base>.folded in the collapsed format flame graph tools read.
+bool profile_write(profile *p, const char *base, const char *name) {
+    script *s = p->prog;
+    uint64_t ticks = profileClock() - p->startTicks;
+    double nsPerTick = ticks ? (double)(monotonic() - p->startNanos) / ticks : 1.0;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.txt", base);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        printf("Unable to write %s\n", path);
+        return false;
+    }
+
+    uint64_t total = 0;
+    uint64_t executed = 0;
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        total += p->ticks[pc];
+        executed += p->count[pc];
+    }
+    double pct = total ? 100.0 / total : 0.0;
+    fprintf(f, "Profile of %s: %llu instructions, %.3f ms in the interpreter\n",
+        name, (unsigned long long)executed, total * nsPerTick / 1e6);
+
+    // Self time of each label, with code ahead of the first label last
+    uint32_t nlabels = s->labels.count + 1;
+    profrow *rows = (profrow *)calloc(nlabels > s->codelen ? nlabels : s->codelen + 1, sizeof(profrow));
+    if (rows == NULL) {
+        fclose(f);
+        return false;
+    }
+    for (uint32_t id = 0; id < nlabels; id++) {
+        rows[id].id = id;
+    }
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        uint32_t id = p->labelOf[pc] == NOSYM ? s->labels.count : p->labelOf[pc];
+        rows[id].ticks += p->ticks[pc];
+        rows[id].count += p->count[pc];
+    }
+    qsort(rows, nlabels, sizeof(profrow), compareRows);
+    fprintf(f, "\nLabels, by time in their own code\n");
+    fprintf(f, "%12s %7s %12s  %s\n", "time_us", "%", "count", "label");
+    for (uint32_t i = 0; i < nlabels && rows[i].count > 0; i++) {
+        fprintf(f, "%12.1f %7.2f %12llu  ", rows[i].ticks * nsPerTick / 1e3, rows[i].ticks * pct,
+            (unsigned long long)rows[i].count);
+        printLabel(f, s, rows[i].id == s->labels.count ? NOSYM : rows[i].id);
+        fputc('\n', f);
+    }
+
+    // Hottest instructions
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        rows[pc].ticks = p->ticks[pc];
+        rows[pc].count = p->count[pc];
+        rows[pc].id = pc;
+    }
+    qsort(rows, s->codelen, sizeof(profrow), compareRows);
+    fprintf(f, "\nInstructions, by time\n");
+    fprintf(f, "%6s %6s  %-22s %12s %12s %7s %7s\n", "line", "pc", "op", "count", "time_us", "%", "true%");
+    for (uint32_t i = 0; i < s->codelen && i < PLANG_PROFILE_TOP && rows[i].count > 0; i++) {
+        uint32_t pc = rows[i].id;
+        insn *in = &s->code[pc];
+        fprintf(f, "%6u %6u  %-22s %12llu %12.1f %7.2f", in->line, pc, xopNames[in->op],
+            (unsigned long long)rows[i].count, rows[i].ticks * nsPerTick / 1e3, rows[i].ticks * pct);
+        if (isConditional(in->op)) {
+            fprintf(f, " %7.2f", 100.0 * p->taken[pc] / rows[i].count);
+        }
+        fputc('\n', f);
+    }
+
+    // Every condition tested, by how often. For an IF the condition
+    // holding means the command after it runs; for a branch it means the
+    // jump is taken.
+    uint32_t nconds = 0;
+    for (uint32_t pc = 0; pc < s->codelen; pc++) {
+        if (isConditional(s->code[pc].op) && p->count[pc] > 0) {
+            rows[nconds].ticks = p->count[pc];
+            rows[nconds].count = p->taken[pc];
+            rows[nconds].id = pc;
+            nconds++;
+        }
+    }
+    qsort(rows, nconds, sizeof(profrow), compareRows);
+    fprintf(f, "\nConditions, by times tested\n");
+    fprintf(f, "%6s %6s  %-22s %12s %12s %7s\n", "line", "pc", "op", "tested", "true", "true%");
+    for (uint32_t i = 0; i < nconds; i++) {
+        insn *in = &s->code[rows[i].id];
+        fprintf(f, "%6u %6u  %-22s %12llu %12llu %7.2f\n", in->line, rows[i].id, xopNames[in->op],
+            (unsigned long long)rows[i].ticks, (unsigned long long)rows[i].count,
+            100.0 * rows[i].count / rows[i].ticks);
+    }
+    free(rows);
+
+    static const char *const edges[] = { "falling", "rising", "change" };
+    fprintf(f, "\nEvents, time from edge to the handler's first instruction\n");
+    fprintf(f, "%6s %5s  %-8s %10s %10s %10s  %s\n", "line", "pin", "edge", "starts", "mean_ns", "max_ns", "handler");
+    for (event *e = s->events; e; e = e->next) {
+        uint32_t i = e->index;
+        fprintf(f, "%6u %5u  %-8s %10llu %10llu %10llu  ", e->line, e->source, edges[e->type],
+            (unsigned long long)p->starts[i],
+            (unsigned long long)(p->starts[i] ? p->latency[i] / p->starts[i] : 0),
+            (unsigned long long)p->latencyMax[i]);
+        printLabel(f, s, e->label);
+        fputc('\n', f);
+    }
+    fclose(f);
+
+    snprintf(path, sizeof(path), "%s.folded", base);
+    f = fopen(path, "w");
+    if (f == NULL) {
+        printf("Unable to write %s\n", path);
+        return false;
+    }
+    for (uint32_t n = 1; n < p->nnodes; n++) {
+        uint64_t ns = p->nodes[n].ticks * nsPerTick;
+        if (ns == 0) {
+            continue;
+        }
+        uint32_t stack[PLANG_STACK_DEPTH + 2];
+        uint32_t depth = 0;
+        for (uint32_t at = n; at != 0 && depth < PLANG_STACK_DEPTH + 2; at = p->nodes[at].parent) {
+            stack[depth++] = p->nodes[at].label;
+        }
+        while (depth-- > 0) {
+            printLabel(f, s, stack[depth]);
+            fputc(depth ? ';' : ' ', f);
+        }
+        fprintf(f, "%llu\n", (unsigned long long)ns);
+    }
+    fclose(f);
+    return true;
+}
+
+// Flight recorder. Each instance run from the command line keeps a ring of
+// the last PLANG_TRACE_RING things it did: handler slices starting and
+// stopping, input changes, edges, variable writes, DISPLAYs, PLAYs and
+// errors. Writing a record is a few stores, so it is always on. The ring
+// can be dumped at any moment, from a signal handler if need be, and
+// plang --decode prints a dump against the script's line numbers.
+
+#ifndef PLANG_TRACE_RING
+#define PLANG_TRACE_RING 8192
+#endif
+
+// Where the command line dumps the ring unless told otherwise
+#ifndef PLANG_TRACE_FILE
+#define PLANG_TRACE_FILE "plang.trace"
+#endif
+
+enum {
+    T_SLICE,    // id: event index, or T_NOEVENT; pc: where it resumes
+    T_YIELD,    // pc: where it stopped, or PC_IDLE; value: instructions run
+    T_PINS,     // id: word; pc and value: low and high halves of the levels
+    T_EDGE,     // id: event index; value: level
+    T_WRITE,    // id: slot; value: new value
+    T_DISPLAY,  // id: display; value: value shown
+    T_PLAY,     // id: sample
+    T_ERROR,    // id: E_ kind; pc: where; value: the bad index for E_RANGE
+    T_RELOAD,   // the program was replaced; earlier pcs are in the old one
+    T_COUNT
+};
+
+#define T_NOEVENT 0xFFFFFF
+
+// Runtime errors
+enum {
+    E_STACK,    // CALL with the stack full
+    E_RANGE     // array or table index past the end
+};
+
+// 16 bytes: the time in milliseconds, the type in the top byte of what
+// and a 24-bit ID under it, and two words whose meaning depends on the type
+struct ringrec {
+    uint32_t time;
+    uint32_t what;
+    uint32_t pc;
+    uint32_t value;
+};
+
+typedef struct ringrec ringrec;
+
+struct tracering {
+    // Records ever written; the newest is at (head - 1) % PLANG_TRACE_RING
+    uint64_t head;
+    // Identify the program the pcs belong to
+    uint32_t codelen;
+    uint32_t codehash;
+    // Where dumps go
+    char path[PATH_MAX];
+    ringrec recs[PLANG_TRACE_RING];
+};
+
+typedef struct tracering tracering;
+
+// Header of a dump, followed by count records, oldest first
+struct traceheader {
+    char magic[4];
+    uint32_t version;
+    uint32_t recsize;
+    uint32_t count;
+    uint32_t codelen;
+    uint32_t codehash;
+    uint64_t written;
+};
+
+typedef struct traceheader traceheader;
+
+static const char traceMagic[4] = { 'P', 'L', 'T', 0x1A };
+#define TRACE_VERSION 1
+
+// FNV-1a over the instructions, so a dump isn't decoded against the wrong
+// program
+static uint32_t codeHash(script *s) {
+    uint32_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)s->code;
+    for (size_t i = 0; i < sizeof(insn) * s->codelen; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+tracering *trace_create(script *s, const char *path) {
+    tracering *t = (tracering *)calloc(1, sizeof(tracering));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->codelen = s->codelen;
+    t->codehash = codeHash(s);
+    snprintf(t->path, sizeof(t->path), "%s", path);
+    return t;
+}
+
+static inline void traceRecord(tracering *t, uint32_t time, uint32_t type, uint32_t id, uint32_t pc, uint32_t value) {
+    ringrec *r = &t->recs[t->head & (PLANG_TRACE_RING - 1)];
+    r->time = time;
+    r->what = type << 24 | (id & 0xFFFFFF);
+    r->pc = pc;
+    r->value = value;
+    // A signal handler dumping the ring on this thread must see the
+    // record complete before it sees it counted
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    t->head++;
+}
+
+// Write the ring to its file. Only uses calls that are safe in a signal
+// handler.
+bool trace_dump(tracering *t) {
+    int fd = open(t->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    uint64_t head = t->head;
+    __atomic_signal_fence(__ATOMIC_ACQUIRE);
+    uint32_t count = head < PLANG_TRACE_RING ? head : PLANG_TRACE_RING;
+    uint32_t first = (head - count) & (PLANG_TRACE_RING - 1);
+
+    traceheader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, traceMagic, sizeof(traceMagic));
+    h.version = TRACE_VERSION;
+    h.recsize = sizeof(ringrec);
+    h.count = count;
+    h.codelen = t->codelen;
+    h.codehash = t->codehash;
+    h.written = head;
+
+    // The oldest records run to the end of the array and wrap round
+    uint32_t tail = first + count > PLANG_TRACE_RING ? PLANG_TRACE_RING - first : count;
+    bool ok = write(fd, &h, sizeof(h)) == sizeof(h) &&
+        write(fd, &t->recs[first], tail * sizeof(ringrec)) == (ssize_t)(tail * sizeof(ringrec)) &&
+        write(fd, &t->recs[0], (count - tail) * sizeof(ringrec)) == (ssize_t)((count - tail) * sizeof(ringrec));
+    close(fd);
+    return ok;
+}
+
+// Run a context until it yields (DELAY, RETURN to the top level or falling
+// off the end of the program) or it has executed budget instructions.
+// Returns the number of instructions executed.
+template <bool profiling, bool tracing>
+static uint32_t execute(vm *m, context *ctx, uint32_t budget) {
+#define PLANG_XOP_LABEL(name) &&x_##name,
+    static const void *const dispatch[X_COUNT] = {
+        PLANG_XOPS(PLANG_XOP_LABEL)
+    };
+#undef PLANG_XOP_LABEL
+
+#define DISPATCH() do { \
+        if (budget-- == 0) { goto yield; } \
+        if (profiling) { profileStep(prof, ip - code); } \
+        goto *dispatch[ip->op]; \
+    } while (0)
+#define NEXT() do { ip++; DISPATCH(); } while (0)
+#define JUMP(t) do { ip = code + (t); DISPATCH(); } while (0)
+#define TAKEN() do { if (profiling) prof->taken[ip - code]++; } while (0)
+#define TRACE(type, id, value) do { if (tracing) traceRecord(ring, m->now, type, id, ip - code, value); } while (0)
+#define WROTE() TRACE(T_WRITE, ip->a.slot, vars[ip->a.slot])
+#define WROTE_TARGET() TRACE(T_WRITE, ip->target, vars[ip->target])
+
+#define IF_HANDLERS(OPER, cond) \
+    x_IF_##OPER##_LL: { uint32_t left = ip->a.lit; uint32_t right = ip->b.lit; \
+        if (cond) { TAKEN(); NEXT(); } JUMP(ip->target); } \
+    x_IF_##OPER##_LV: { uint32_t left = ip->a.lit; uint32_t right = vars[ip->b.slot]; \
+        if (cond) { TAKEN(); NEXT(); } JUMP(ip->target); } \
+    x_IF_##OPER##_VL: { uint32_t left = vars[ip->a.slot]; uint32_t right = ip->b.lit; \
+        if (cond) { TAKEN(); NEXT(); } JUMP(ip->target); } \
+    x_IF_##OPER##_VV: { uint32_t left = vars[ip->a.slot]; uint32_t right = vars[ip->b.slot]; \
+        if (cond) { TAKEN(); NEXT(); } JUMP(ip->target); }
+
+#define BR_HANDLERS(OPER, cond) \
+    x_BR_##OPER##_LL: { uint32_t left = ip->a.lit; uint32_t right = ip->b.lit; \
+        if (cond) { TAKEN(); JUMP(ip->target); } NEXT(); } \
+    x_BR_##OPER##_LV: { uint32_t left = ip->a.lit; uint32_t right = vars[ip->b.slot]; \
+        if (cond) { TAKEN(); JUMP(ip->target); } NEXT(); } \
+    x_BR_##OPER##_VL: { uint32_t left = vars[ip->a.slot]; uint32_t right = ip->b.lit; \
+        if (cond) { TAKEN(); JUMP(ip->target); } NEXT(); } \
+    x_BR_##OPER##_VV: { uint32_t left = vars[ip->a.slot]; uint32_t right = vars[ip->b.slot]; \
+        if (cond) { TAKEN(); JUMP(ip->target); } NEXT(); }
+
+#define SWITCH_HANDLERS(KIND, lookup) \
+    x_ON_GOTO##KIND: { uint32_t t = lookup(consts + ip->target, vars[ip->a.slot]); \
+        if (t == PC_IDLE) { NEXT(); } JUMP(t); } \
+    x_ON_CALL##KIND: { uint32_t t = lookup(consts + ip->target, vars[ip->a.slot]); \
+        if (t == PC_IDLE) { NEXT(); } \
+        if (ctx->sp == PLANG_STACK_DEPTH) { goto overflow; } \
+        ctx->stack[ctx->sp++] = ip - code + 1; if (profiling) prof->depth++; JUMP(t); }
+
+#define ARITH_HANDLERS(OPER, result) \
+    x_##OPER##_LL: { uint32_t left = ip->a.lit; uint32_t right = ip->b.lit; \
+        vars[ip->target] = (result); WROTE_TARGET(); NEXT(); } \
+    x_##OPER##_LV: { uint32_t left = ip->a.lit; uint32_t right = vars[ip->b.slot]; \
+        vars[ip->target] = (result); WROTE_TARGET(); NEXT(); } \
+    x_##OPER##_VL: { uint32_t left = vars[ip->a.slot]; uint32_t right = ip->b.lit; \
+        vars[ip->target] = (result); WROTE_TARGET(); NEXT(); } \
+    x_##OPER##_VV: { uint32_t left = vars[ip->a.slot]; uint32_t right = vars[ip->b.slot]; \
+        vars[ip->target] = (result); WROTE_TARGET(); NEXT(); }
+
+    insn *code = m->prog->code;
+    const uint32_t *consts = m->prog->consts;
+    uint32_t *vars = m->vars;
+    profile *prof = m->prof;
+    tracering *ring = m->ring;
+    uint32_t start = budget;
+    insn *ip;
+
+    // Contexts waiting on a DELAY are held back by the scheduler, so by the
+    // time we get here the delay has always run out.
+    ip = code + ctx->pc;
+    DISPATCH();
+
+x_HALT:
+    ctx->pc = PC_IDLE;
+    return start - budget;
+x_NOP:
+    NEXT();
+x_MODE_L:
+    vmMode(m, ip->a.lit, ip->b.lit);
+    NEXT();
+x_MODE_V:
+    vmMode(m, vars[ip->a.slot], ip->b.lit);
+    NEXT();
+x_CALL:
+    if (ctx->sp == PLANG_STACK_DEPTH) goto overflow;
+    ctx->stack[ctx->sp++] = ip - code + 1;
+    if (profiling) prof->depth++;
+    JUMP(ip->target);
+x_GOTO:
+    JUMP(ip->target);
+x_RETURN:
+    if (ctx->sp == 0) {
+        ctx->pc = PC_IDLE;
+        return start - budget;
+    }
+    if (profiling) prof->depth--;
+    JUMP(ctx->stack[--ctx->sp]);
+x_SET_L:
+    vars[ip->a.slot] = ip->b.lit;
+    WROTE();
+    NEXT();
+x_SET_V:
+    vars[ip->a.slot] = vars[ip->b.slot];
+    WROTE();
+    NEXT();
+x_DISPLAY_L:
+    vmDisplay(m, ip->a.lit);
+    TRACE(T_DISPLAY, 0, ip->a.lit);
+    NEXT();
+x_DISPLAY_V:
+    vmDisplay(m, vars[ip->a.slot]);
+    TRACE(T_DISPLAY, 0, vars[ip->a.slot]);
+    NEXT();
+x_DELAY_L:
+    ctx->wake = millis(m) + ip->a.lit;
+    ctx->delaying = true;
+    ctx->pc = ip - code + 1;
+    return start - budget;
+x_DELAY_V:
+    ctx->wake = millis(m) + vars[ip->a.slot];
+    ctx->delaying = true;
+    ctx->pc = ip - code + 1;
+    return start - budget;
+x_DEC:
+    if (vars[ip->a.slot] > 0) {
+        vars[ip->a.slot]--;
+    }
+    WROTE();
+    NEXT();
+x_INC:
+    vars[ip->a.slot]++;
+    WROTE();
+    NEXT();
+x_PLAY:
+    vmPlay(m, ip->a.lit);
+    TRACE(T_PLAY, ip->a.lit, 0);
+    NEXT();
+
+    IF_HANDLERS(READS, digitalRead(m, left) == right)
+    IF_HANDLERS(EQ, left == right)
+    IF_HANDLERS(GE, left >= right)
+    IF_HANDLERS(GT, left > right)
+    IF_HANDLERS(LE, left <= right)
+    IF_HANDLERS(LT, left < right)
+    IF_HANDLERS(SGE, (int32_t)left >= (int32_t)right)
+    IF_HANDLERS(SGT, (int32_t)left > (int32_t)right)
+    IF_HANDLERS(SLE, (int32_t)left <= (int32_t)right)
+    IF_HANDLERS(SLT, (int32_t)left < (int32_t)right)
+
+    BR_HANDLERS(READS, digitalRead(m, left) == right)
+    BR_HANDLERS(EQ, left == right)
+    BR_HANDLERS(GE, left >= right)
+    BR_HANDLERS(GT, left > right)
+    BR_HANDLERS(LE, left <= right)
+    BR_HANDLERS(LT, left < right)
+    BR_HANDLERS(SGE, (int32_t)left >= (int32_t)right)
+    BR_HANDLERS(SGT, (int32_t)left > (int32_t)right)
+    BR_HANDLERS(SLE, (int32_t)left <= (int32_t)right)
+    BR_HANDLERS(SLT, (int32_t)left < (int32_t)right)
+
+    ARITH_HANDLERS(ADD, left + right)
+    ARITH_HANDLERS(SUB, left - right)
+    ARITH_HANDLERS(MUL, left * right)
+    ARITH_HANDLERS(DIV, divide(left, right))
+    ARITH_HANDLERS(MOD, modulo(left, right))
+    ARITH_HANDLERS(AND, left & right)
+    ARITH_HANDLERS(OR, left | right)
+    ARITH_HANDLERS(SDIV, sdivide(left, right))
+    ARITH_HANDLERS(SMOD, smodulo(left, right))
+
+    // Indexed operands: target is the array's descriptor in the constant
+    // pool, its length and then the slot of its first element or, for a
+    // table, the values themselves.
+x_LOAD: {
+    uint32_t index = vars[ip->b.slot];
+    if (index >= consts[ip->target]) goto range;
+    vars[ip->a.slot] = vars[consts[ip->target + 1] + index];
+    WROTE();
+    NEXT();
+}
+x_LOAD_TABLE: {
+    uint32_t index = vars[ip->b.slot];
+    if (index >= consts[ip->target]) goto range;
+    vars[ip->a.slot] = consts[ip->target + 1 + index];
+    WROTE();
+    NEXT();
+}
+x_STORE_L: {
+    uint32_t index = vars[ip->a.slot];
+    if (index >= consts[ip->target]) goto range;
+    uint32_t slot = consts[ip->target + 1] + index;
+    vars[slot] = ip->b.lit;
+    TRACE(T_WRITE, slot, vars[slot]);
+    NEXT();
+}
+x_STORE_V: {
+    uint32_t index = vars[ip->a.slot];
+    if (index >= consts[ip->target]) goto range;
+    uint32_t slot = consts[ip->target + 1] + index;
+    vars[slot] = vars[ip->b.slot];
+    TRACE(T_WRITE, slot, vars[slot]);
+    NEXT();
+}
+x_PLAY_TABLE: {
+    uint32_t index = vars[ip->a.slot];
+    if (index >= consts[ip->target]) goto range;
+    uint32_t id = consts[ip->target + 1 + index];
+    vmPlay(m, id);
+    TRACE(T_PLAY, id, 0);
+    NEXT();
+}
+
+    SWITCH_HANDLERS(, jumpDense)
+    SWITCH_HANDLERS(_HASH, jumpHash)
+
+x_DEC_DISPLAY:
+    if (vars[ip->a.slot] > 0) {
+        vars[ip->a.slot]--;
+    }
+    WROTE();
+    vmDisplay(m, vars[ip->a.slot]);
+    TRACE(T_DISPLAY, 0, vars[ip->a.slot]);
+    NEXT();
+x_DEC_BR_GT_VL:
+    if (vars[ip->a.slot] > 0) {
+        vars[ip->a.slot]--;
+    }
+    WROTE();
+    if (vars[ip->a.slot] > ip->b.lit) { TAKEN(); JUMP(ip->target); }
+    NEXT();
+x_DEC_DISPLAY_BR_GT_VL:
+    if (vars[ip->a.slot] > 0) {
+        vars[ip->a.slot]--;
+    }
+    WROTE();
+    vmDisplay(m, vars[ip->a.slot]);
+    TRACE(T_DISPLAY, 0, vars[ip->a.slot]);
+    if (vars[ip->a.slot] > ip->b.lit) { TAKEN(); JUMP(ip->target); }
+    NEXT();
+
+yield:
+    // Not between a statement and its prelude: carry on, and yield after
+    if (ip > code && ip[-1].prelude) {
+        budget = 0;
+        if (profiling) { profileStep(prof, ip - code); }
+        goto *dispatch[ip->op];
+    }
+    ctx->pc = ip - code;
+    return start;
+
+overflow:
+    syntaxerror("Call stack overflow", ip->line);
+    TRACE(T_ERROR, E_STACK, 0);
+    if (tracing) trace_dump(ring);
+    ctx->pc = PC_IDLE;
+    return start - budget;
+
+    // The index is in a for STORE and PLAY, b for LOAD
+range:
+    syntaxerror("Index out of range", ip->line);
+    TRACE(T_ERROR, E_RANGE, ip->op == X_LOAD || ip->op == X_LOAD_TABLE ? vars[ip->b.slot] : vars[ip->a.slot]);
+    if (tracing) trace_dump(ring);
+    ctx->pc = PC_IDLE;
+    return start - budget;
+
+#undef ARITH_HANDLERS
+#undef SWITCH_HANDLERS
+#undef BR_HANDLERS
+#undef IF_HANDLERS
+#undef WROTE_TARGET
+#undef WROTE
+#undef TRACE
+#undef TAKEN
+#undef JUMP
+#undef NEXT
+#undef DISPATCH
+}
+
+uint32_t plang_exec(vm *m, context *ctx, uint32_t budget) {
+    if (m->prof == NULL && m->ring == NULL) {
+        return execute<false, false>(m, ctx, budget);
+    }
+
+    uint32_t ran;
+    if (m->prof == NULL) {
+        ran = execute<false, true>(m, ctx, budget);
+    } else {
+        profileEnter(m->prof, ctx);
+        ran = m->ring ? execute<true, true>(m, ctx, budget) : execute<true, false>(m, ctx, budget);
+        profileLeave(m->prof);
+    }
+    if (m->ring) traceRecord(m->ring, m->now, T_YIELD, 0, ctx->pc, ran);
+    return ran;
+}
+
+static inline bool wakesBefore(context *a, context *b) {
+    return (int32_t)(a->wake - b->wake) < 0;
+}
+
+void delayPush(vm *m, context *ctx) {
+    if (m->ndelays == m->delaycap) {
+        m->delaycap = m->delaycap ? m->delaycap * 2 : 16;
+        m->delays = (context **)realloc(m->delays, sizeof(context *) * m->delaycap);
+    }
+    context **delays = m->delays;
+    uint32_t pos = m->ndelays++;
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+        if (!wakesBefore(ctx, delays[parent])) {
+            break;
+        }
+        delays[pos] = delays[parent];
+        pos = parent;
+    }
+    delays[pos] = ctx;
+}
+
+context *delayPop(vm *m) {
+    context **delays = m->delays;
+    context *top = delays[0];
+    context *last = delays[--m->ndelays];
+    uint32_t n = m->ndelays;
+    uint32_t pos = 0;
+    while (1) {
+        uint32_t child = pos * 2 + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && wakesBefore(delays[child + 1], delays[child])) {
+            child++;
+        }
+        if (!wakesBefore(delays[child], last)) {
+            break;
+        }
+        delays[pos] = delays[child];
+        pos = child;
+    }
+    if (n > 0) {
+        delays[pos] = last;
+    }
+    return top;
+}
+
+static inline void startHandler(vm *m, event *e, handler *h, uint32_t level) {
+    h->last = level;
+    h->fresh = true;
+    ctxStart(&h->ctx, e->pc);
+    if (m->prof) profileEdge(m->prof, e);
+    if (m->ring) traceRecord(m->ring, m->now, T_EDGE, e->index, e->pc, level);
+}
+
+// Start an idle handler on the next edge waiting in its queue, if any.
+// Edges the queue had no room for under PLANG_COUNT come after the rest,
+// each seen as happening now at the pin's present level.
+static bool startQueued(vm *m, event *e, handler *h, uint32_t level) {
+    edgequeue *q = &h->queue;
+    uint32_t when;
+    if (popEdge(q, &when, &level)) {
+        uint32_t waited = m->now - when;
+        q->waited += waited;
+        if (waited > q->waitMax) {
+            q->waitMax = waited;
+        }
+    } else if (__atomic_load_n(&q->owed, __ATOMIC_ACQUIRE) > 0) {
+        __atomic_fetch_sub(&q->owed, 1, __ATOMIC_ACQ_REL);
+    } else {
+        return false;
+    }
+    startHandler(m, e, h, level);
+    return true;
+}
+
+// Start every idle handler linked to this edge of the pin.
+// Handlers that are still busy miss the edge; they pick up the pin's new
+// level when they finish. If the instance queues edges, every linked
+// handler gets it queued instead, and starts on it in its turn.
+static inline void fireEdges(vm *m, pinindex *idx, uint32_t pin, uint32_t level) {
+    for (uint32_t i = idx->start[pin]; i < idx->start[pin + 1]; i++) {
+        event *e = idx->list[i];
+        handler *h = &m->handlers[e->index];
+        if (m->queueDepth > 0) {
+            pushEdge(m, &h->queue, m->now, level);
+        } else if (h->ctx.pc == PC_IDLE) {
+            startHandler(m, e, h, level);
+        }
+    }
+}
+
+// Called just before a handler started by an input edge runs its first
+// instruction.
+void (*onHandlerStart)(event *e) = NULL;
+
+// Run init to completion before anything else gets a look in.
+void runInit(vm *m) {
+    uint32_t init = findLabel(m->prog, "init");
+    if (init == PC_IDLE) {
+        return;
+    }
+    context ctx;
+    ctxStart(&ctx, init);
+    while (ctx.pc != PC_IDLE) {
+        if (ctx.delaying) {
+            if (m->virtualTime) {
+                m->vclock = ctx.wake;
+            } else {
+                struct timespec ts;
+                uint64_t due = bootTime + (uint64_t)ctx.wake * 1000000ULL;
+                ts.tv_sec = due / 1000000000ULL;
+                ts.tv_nsec = due % 1000000000ULL;
+#ifndef PLANG_LIBRARY
+                uint32_t frame;
+                if (m->devices) display_update(millis(m), &frame);
+#endif
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+            ctx.delaying = false;
+        }
+        m->now = millis(m);
+        if (m->ring) traceRecord(m->ring, m->now, T_SLICE, T_NOEVENT, ctx.pc, 0);
+        m->ops += plang_exec(m, &ctx, m->budget);
+    }
+}
+
+// One trip round the scheduler: wake expired delays, start handlers for
+// any input edges and give every runnable handler a turn. Returns true if
+// some handler still has work to do without waiting.
+bool schedulePass(vm *m) {
+    uint64_t cur[PLANG_PIN_WORDS];
+    script *s = m->prog;
+
+    // Release any contexts whose delay has run out
+    uint32_t now = millis(m);
+    m->now = now;
+    while (m->ndelays > 0 && (int32_t)(now - m->delays[0]->wake) >= 0) {
+        delayPop(m)->delaying = false;
+    }
+
+    // Work out which watched pins changed since last time, a word at
+    // a time, and only touch the handlers linked to those pins. When
+    // plang_post() is feeding the input it has queued the edges already.
+    sampleInputs(m, cur);
+    bool posted = __atomic_load_n(&m->posting, __ATOMIC_ACQUIRE);
+    for (uint32_t w = 0; w < PLANG_PIN_WORDS; w++) {
+        if (cur[w] != m->prevPins[w]) {
+            if (m->recording) recordPins(m, w, cur[w] ^ m->prevPins[w], cur[w], now);
+            if (m->ring) traceRecord(m->ring, now, T_PINS, w, (uint32_t)cur[w], cur[w] >> 32);
+        }
+        uint64_t diff = posted ? 0 : (cur[w] ^ m->prevPins[w]) & s->watched[w];
+        uint64_t up = diff & cur[w];
+        uint64_t down = diff & ~cur[w];
+        while (up) {
+            fireEdges(m, &s->rising, w * 64 + __builtin_ctzll(up), 1);
+            up &= up - 1;
+        }
+        while (down) {
+            fireEdges(m, &s->falling, w * 64 + __builtin_ctzll(down), 0);
+            down &= down - 1;
+        }
+        m->prevPins[w] = cur[w];
+    }
+
+    bool busy = false;
+    event *scan = s->events;
+    while (scan) {
+        handler *h = &m->handlers[scan->index];
+        if (m->queueDepth > 0 && h->ctx.pc == PC_IDLE) {
+            startQueued(m, scan, h, (cur[scan->source >> 6] >> (scan->source & 63)) & 1);
+        }
+        // Run the handler until it yields or uses up its budget.
+        if (h->ctx.pc != PC_IDLE && !h->ctx.delaying) {
+            if (h->fresh) {
+                h->fresh = false;
+                if (m->prof) profileHandlerStart(m->prof, scan);
+                if (onHandlerStart) onHandlerStart(scan);
+            }
+            if (m->ring) traceRecord(m->ring, now, T_SLICE, scan->index, h->ctx.pc, 0);
+            m->ops += plang_exec(m, &h->ctx, m->budget);
+            if (h->ctx.delaying) {
+                delayPush(m, &h->ctx);
+            } else if (h->ctx.pc != PC_IDLE) {
+                busy = true;
+            } else {
+                // Finished. If the pin moved while we were busy, treat
+                // that as an edge now, as it would have been seen had
+                // the handler been idle. Queued edges come first, and
+                // with them the level is only caught up with once the
+                // queue has run dry.
+                uint32_t n = (cur[scan->source >> 6] >> (scan->source & 63)) & 1;
+                if (m->queueDepth > 0 && startQueued(m, scan, h, n)) {
+                    busy = true;
+                } else if (n != h->last) {
+                    h->last = n;
+                    if (eventWants(scan, n ? RISING : FALLING)) {
+                        startHandler(m, scan, h, n);
+                        busy = true;
+                    }
+                }
+            }
+        }
+        scan = scan->next;
+    }
+    return busy;
+}
+
+static void startRun(vm *m) {
+    sampleInputs(m, m->prevPins);
+    for (event *scan = m->prog->events; scan; scan = scan->next) {
+        m->handlers[scan->index].last = digitalRead(m, scan->source);
+    }
+}
+
+// The embedding interface in plang.h, for hosts that drive instances from
+// their own loop on their own clock.
+
+vm *plang_vm_create(script *s, const plang_host *host, void *ctx) {
+    return vm_create(s, host, ctx);
+}
+
+void plang_vm_destroy(vm *m) {
+    vm_destroy(m);
+}
+
+void plang_set_budget(vm *m, uint32_t budget) {
+    m->budget = budget > 0 ? budget : 1;
+}
+
+uint32_t plang_slot(script *s, const char *name) {
+    uint32_t len = strlen(name);
+    uint32_t slot = symLookup(&s->variables, name, len, false);
+    if (slot == NOSYM && len < 64) {
+        // An array, by its first element
+        char first[72];
+        snprintf(first, sizeof(first), "%s[0]", name);
+        slot = symLookup(&s->variables, first, len + 3, false);
+    }
+    return slot;
+}
+
+void plang_start(vm *m, uint32_t now) {
+    m->virtualTime = true;
+    m->vclock = now;
+    startRun(m);
+    runInit(m);
+}
+
+void plang_inject(vm *m, const plang_input *changes, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t pin = changes[i].pin;
+        if (pin >= PLANG_MAX_PINS) {
+            continue;
+        }
+        if (changes[i].level) {
+            m->ins[pin >> 6] |= 1ULL << (pin & 63);
+        } else {
+            m->ins[pin >> 6] &= ~(1ULL << (pin & 63));
+        }
+    }
+}
+
+int plang_queue_edges(vm *m, uint32_t depth, uint32_t policy) {
+    if (policy > PLANG_COUNT || m->queueDepth > 0) {
+        return 0;
+    }
+    return depth == 0 || queuesCreate(m, depth, policy);
+}
+
+// The producer side of the edge queues, for a thread of the host's own.
+// It keeps its own copy of the levels to find edges against, so it never
+// reads anything the scheduler writes, and publishes each level after
+// queueing the edges it made.
+void plang_post(vm *m, const plang_input *changes, uint32_t count, uint32_t now) {
+    script *s = m->prog;
+    if (!m->posting) {
+        for (uint32_t w = 0; w < PLANG_PIN_WORDS; w++) {
+            m->posted[w] = __atomic_load_n(&m->ins[w], __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&m->posting, true, __ATOMIC_RELEASE);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t pin = changes[i].pin;
+        if (pin >= PLANG_MAX_PINS) {
+            continue;
+        }
+        uint64_t bit = 1ULL << (pin & 63);
+        uint64_t was = m->posted[pin >> 6];
+        uint64_t is = changes[i].level ? was | bit : was & ~bit;
+        if (is == was) {
+            continue;
+        }
+        m->posted[pin >> 6] = is;
+        if (m->queueDepth > 0 && (s->watched[pin >> 6] & bit)) {
+            pinindex *idx = changes[i].level ? &s->rising : &s->falling;
+            for (uint32_t j = idx->start[pin]; j < idx->start[pin + 1]; j++) {
+                pushEdge(m, &m->handlers[idx->list[j]->index].queue, now, changes[i].level ? 1 : 0);
+            }
+        }
+        __atomic_store_n(&m->ins[pin >> 6], is, __ATOMIC_RELEASE);
+    }
+}
+
+int plang_queue_stats(vm *m, uint32_t event, plang_queue_info *stats) {
+    if (m->queueDepth == 0 || event >= m->prog->nevents) {
+        return 0;
+    }
+    edgequeue *q = &m->handlers[event].queue;
+    stats->edges = __atomic_load_n(&q->edges, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&q->overflows, __ATOMIC_RELAXED);
+    stats->deepest = __atomic_load_n(&q->deepest, __ATOMIC_RELAXED);
+    stats->wait_max = q->waitMax;
+    stats->wait_total = q->waited;
+    return 1;
+}
+
+int plang_step(vm *m, uint32_t now) {
+    m->vclock = now;
+    return schedulePass(m);
+}
+
+int plang_run_slice(vm *m, uint32_t now, uint64_t nanos, uint32_t *wake) {
+    uint64_t end = monotonic() + nanos;
+    m->vclock = now;
+    bool busy;
+    while ((busy = schedulePass(m)) && monotonic() < end);
+    if (wake) {
+        *wake = m->ndelays > 0 ? m->delays[0]->wake : PLANG_NOWAKE;
+    }
+    return busy;
+}
+
+uint32_t plang_get(vm *m, uint32_t slot) {
+    return slot < m->prog->variables.count ? m->vars[slot] : 0;
+}
+
+void plang_set(vm *m, uint32_t slot, uint32_t value) {
+    if (slot < m->prog->variables.count) {
+        m->vars[slot] = value;
+    }
+}
+
+// Everything from here on is the command line front end, which the
+// library leaves out along with the display and audio engine.
+#ifndef PLANG_LIBRARY
+
+// The program loaded from the command line
+script *prog = NULL;
+
+// The instance run from the command line
+vm *running = NULL;
+
+// Where --profile writes its results, and the script it names in them
+const char *profileBase = NULL;
+const char *profileName = NULL;
+
+void finishProfile() {
+    if (running && running->prof) {
+        profile_write(running->prof, profileBase, profileName);
+        profile_free(running->prof);
+        running->prof = NULL;
+    }
+}
+
+// Ring of the instance run from the command line, for the signal handlers
+tracering *dumpRing = NULL;
+
+// SIGUSR1 dumps the ring and carries on; a crash dumps it on the way down.
+static void dumpOnSignal(int sig) {
+    if (dumpRing) trace_dump(dumpRing);
+    if (sig != SIGUSR1) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+void catchSignals() {
+    static const int fatal[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dumpOnSignal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) {
+        sigaction(fatal[i], &sa, NULL);
+    }
+}
+
+static void printEvent(script *s, uint32_t index) {
+    for (event *e = s->events; e; e = e->next) {
+        if (e->index == index) {
+            symbol *l = &s->labels.entries[e->label];
+            printf("event %u (%.*s, pin %u)", index, l->len, l->name, e->source);
+            return;
+        }
+    }
+    printf("event %u", index);
+}
+
+// Print a dump of the flight recorder, oldest first, with each pc shown
+// as the script line it came from.
+bool decodeTrace(script *s, const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("Unable to open %s\n", filename);
+        return false;
+    }
+    traceheader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, traceMagic, sizeof(traceMagic)) ||
+        h.version != TRACE_VERSION || h.recsize != sizeof(ringrec)) {
+        printf("%s is not a trace dump this version of plang can read\n", filename);
+        fclose(f);
+        return false;
+    }
+    ringrec *recs = (ringrec *)malloc(sizeof(ringrec) * (h.count + 1));
+    if (recs == NULL || fread(recs, sizeof(ringrec), h.count, f) != h.count) {
+        printf("%s is truncated\n", filename);
+        free(recs);
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+
+    bool match = h.codelen == s->codelen && h.codehash == codeHash(s);
+    if (!match) {
+        printf("Warning: the dump is of a different build of the program; lines may be wrong\n");
+    }
+    // Records from before the last reload are of a program we don't have
+    uint32_t current = 0;
+    for (uint32_t i = 0; i < h.count; i++) {
+        if (recs[i].what >> 24 == T_RELOAD) {
+            current = i + 1;
+        }
+    }
+
+    printf("%llu records written, the last %u kept\n", (unsigned long long)h.written, h.count);
+    for (uint32_t i = 0; i < h.count; i++) {
+        ringrec *r = &recs[i];
+        uint32_t type = r->what >> 24;
+        uint32_t id = r->what & 0xFFFFFF;
+        printf("%10u  ", r->time);
+        if (type != T_PINS && type != T_RELOAD) {
+            if (r->pc == PC_IDLE) {
+                printf("%-12s", "idle");
+            } else if (i >= current && r->pc < s->codelen) {
+                printf("line %-7u", s->code[r->pc].line);
+            } else {
+                printf("pc %-9u", r->pc);
+            }
+        } else {
+            printf("%-12s", "");
+        }
+        switch (type) {
+            case T_SLICE:
+                printf("run ");
+                if (id == T_NOEVENT) printf("init"); else printEvent(s, id);
+                break;
+            case T_YIELD:
+                printf("yield after %u instructions", r->value);
+                break;
+            case T_PINS:
+                printf("pins %u-%u: %08x%08x", id * 64, id * 64 + 63, r->value, r->pc);
+                break;
+            case T_EDGE:
+                printf("%s edge starts ", r->value ? "rising" : "falling");
+                printEvent(s, id);
+                break;
+            case T_WRITE:
+                if (i >= current && id < s->variables.count) {
+                    printf("%.*s = %u", s->variables.entries[id].len, s->variables.entries[id].name, r->value);
+                } else {
+                    printf("slot %u = %u", id, r->value);
+                }
+                break;
+            case T_DISPLAY:
+                printf("display %u", r->value);
+                break;
+            case T_PLAY:
+                if (i >= current && id < s->samples.count) {
+                    printf("play %.*s", s->samples.entries[id].len, s->samples.entries[id].name);
+                } else {
+                    printf("play sample %u", id);
+                }
+                break;
+            case T_ERROR:
+                if (id == E_RANGE) {
+                    printf("error: index %u out of range", r->value);
+                } else {
+                    printf("error: call stack overflow");
+                }
+                break;
+            case T_RELOAD:
+                printf("reload");
+                break;
+            default:
+                printf("unknown record %u", type);
+        }
+        printf("\n");
+    }
+    free(recs);
+    return true;
+}
+
+// How the command line's instances reach the display and audio engine
+static void cliDisplay(void *ctx, uint32_t id, uint32_t value) {
+    display_set(id, value);
+}
+
+static void cliPlay(void *ctx, uint32_t sample, const char *name, uint32_t len) {
+    vm *m = (vm *)ctx;
+    audio_play(m->prog->audioIds[sample]);
+}
+
+static const plang_host cliHost = { NULL, NULL, cliDisplay, cliPlay };
+
+void updateIO(vm *m) {
+    if (m->devices) display_inputs(m->ins[0] & ((1 << PLANG_SHOWN_PINS) - 1));
+}
+
+// Hand every sample named by a PLAY to the audio engine, noting the ID the
+// engine gives it. Samples already loaded by an earlier program are shared.
+bool plang_load_samples(script *s) {
+    for (uint32_t id = 0; id < s->samples.count; id++) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%.*s", s->samples.entries[id].len, s->samples.entries[id].name);
+        s->audioIds[id] = audio_load(name);
+    }
+    return true;
+}
+
+// Hot reload. watchfd reports changes to the script's directory (editors
+// often save by renaming a new file over the old one, so watching the file
+// itself isn't enough) and reloadfd is signalled when a background compile
+// finishes.
+int watchfd = -1;
+int reloadfd = -1;
+
+// Block until the next delay or display frame is due, or there is keyboard
+// or other input or a reload to deal with, whichever comes first.
+void waitForWork(vm *m) {
+    struct pollfd pfd[4];
+    pfd[0].fd = display_keyfd();
+    pfd[1].fd = watchfd;
+    pfd[2].fd = reloadfd;
+    pfd[3].fd = input_fd();
+    for (int i = 0; i < 4; i++) {
+        pfd[i].events = POLLIN;
+    }
+
+    uint32_t frame;
+    bool frameDue = !display_update(millis(m), &frame);
+
+    if (m->ndelays == 0 && !frameDue) {
+        ppoll(pfd, 4, NULL, NULL);
+        return;
+    }
+
+    uint32_t wake = frame;
+    if (m->ndelays > 0 && (!frameDue || (int32_t)(m->delays[0]->wake - frame) < 0)) {
+        wake = m->delays[0]->wake;
+    }
+
+    uint64_t due = bootTime + (uint64_t)wake * 1000000ULL;
+    uint64_t now = monotonic();
+    if (due <= now) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = (due - now) / 1000000000ULL;
+    ts.tv_nsec = (due - now) % 1000000000ULL;
+    ppoll(pfd, 4, &ts, NULL);
+}
+
+// Path of the running script, and its directory and file name for
+// matching change notifications
+const char *scriptPath = NULL;
+char *scriptDir = NULL;
+char *scriptFile = NULL;
+
+// A background compile is running, and whether the script changed again
+// since it started
+bool compiling = false;
+bool reloadWanted = false;
+pthread_t compiler;
+
+// Result of the last background compile, NULL if it failed
+script *compiled = NULL;
+
+// Compiled program waiting for a safe point to be swapped in
+script *pending = NULL;
+
+void watchScript(const char *path) {
+    scriptPath = path;
+    scriptDir = dirname(strdup(path));
+    scriptFile = basename(strdup(path));
+
+    watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    reloadfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (watchfd < 0 || reloadfd < 0 ||
+        inotify_add_watch(watchfd, scriptDir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        if (watchfd >= 0) close(watchfd);
+        if (reloadfd >= 0) close(reloadfd);
+        watchfd = -1;
+        reloadfd = -1;
+    }
+}
+
+static void *compileThread(void *arg) {
+    compiled = plang_load(scriptPath);
+    if (compiled != NULL) {
+        plang_load_samples(compiled);
+    }
+    uint64_t one = 1;
+    if (write(reloadfd, &one, sizeof(one)) < 0) {
+        // Nothing else to wake the main loop with; it'll find out on its
+        // next pass anyway.
+    }
+    return NULL;
+}
+
+// Swap in a new program. Variables it shares with the old one by name keep
+// their values; new ones get their defaults. Must only be called when no
+// handler is running or delaying, so nothing points into the old program.
+// The old program is left loaded for the caller to deal with.
+bool plang_swap(vm *m, script *next) {
+    script *old = m->prog;
+    uint32_t *vars = (uint32_t *)malloc(sizeof(uint32_t) * (next->slotcap + 1));
+    handler *handlers = (handler *)calloc(next->nevents + 1, sizeof(handler));
+    if (vars == NULL || handlers == NULL || (m->queueDepth > 0 && !queuesAlloc(handlers, next->nevents, m->queueDepth))) {
+        free(vars);
+        free(handlers);
+        return false;
+    }
+    memcpy(vars, next->slots, sizeof(uint32_t) * next->slotcap);
+    for (uint32_t id = 0; id < next->variables.count; id++) {
+        symbol *sym = &next->variables.entries[id];
+        uint32_t was = symLookup(&old->variables, sym->name, sym->len, false);
+        if (was != NOSYM) {
+            vars[id] = m->vars[was];
+        }
+    }
+    // Handlers see the pins as they are now, so a level that didn't change
+    // isn't taken as an edge
+    for (event *e = next->events; e; e = e->next) {
+        handler *h = &handlers[e->index];
+        ctxStart(&h->ctx, PC_IDLE);
+        h->last = (m->prevPins[e->source >> 6] >> (e->source & 63)) & 1;
+    }
+    free(m->vars);
+    queuesFree(m->handlers, old->nevents);
+    free(m->handlers);
+    m->vars = vars;
+    m->handlers = handlers;
+    m->prog = next;
+    if (m->ring) {
+        traceRecord(m->ring, m->now, T_RELOAD, 0, 0, 0);
+        m->ring->codelen = next->codelen;
+        m->ring->codehash = codeHash(next);
+    }
+    if (m->actionLog) fprintf(m->actionLog, "%u reload %s\n", millis(m), scriptPath);
+    return true;
+}
+
+static bool allIdle(vm *m) {
+    if (m->ndelays > 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < m->prog->nevents; i++) {
+        if (m->handlers[i].ctx.pc != PC_IDLE) {
+            return false;
+        }
+        if (m->queueDepth > 0 && !queueEmpty(&m->handlers[i].queue)) {
+            return false;
+        }
     }
+    return true;
+}
 
-    if (!strcasecmp(code, "DISPLAY")) {
-        newop->opcode = DISPLAY;
-        if (params == NULL) {
-            syntaxerror("Syntax error", line);
-            freeop(newop);
-            return NULL;
-        }
-        if (isNumber(params)) {
-            newop->ival1 = atoi(params);
-            newop->opcode |= L;
-        } else {
-            newop->vval1 = findVariable(params);
-            newop->opcode |= V;
-            if(newop->vval1 == NULL) {
-                syntaxerror("Unknown variable", line);
-                freeop(newop);
-                return NULL;
+// Deal with script changes: start a compile when the file is saved, pick
+// up its result when it finishes and swap it in once every handler is idle.
+// If the new script doesn't compile the old one just keeps running.
+void checkReload(vm *m) {
+    if (watchfd < 0) {
+        return;
+    }
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(watchfd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len > 0 && !strcmp(ev->name, scriptFile)) {
+                reloadWanted = true;
             }
+            p += sizeof(struct inotify_event) + ev->len;
         }
-        return newop;
     }
 
-    if (!strcasecmp(code, "DELAY")) {
-        newop->opcode = DELAY;
-        if (params == NULL) {
-            syntaxerror("Syntax error", line);
-            freeop(newop);
-            return NULL;
-        }
-        if (isNumber(params)) {
-            newop->ival1 = atoi(params);
-            newop->opcode |= L;
-        } else {
-            newop->vval1 = findVariable(params);
-            newop->opcode |= V;
-            if(newop->vval1 == NULL) {
-                syntaxerror("Unknown variable", line);
-                freeop(newop);
-                return NULL;
+    uint64_t done;
+    if (compiling && read(reloadfd, &done, sizeof(done)) == sizeof(done)) {
+        pthread_join(compiler, NULL);
+        compiling = false;
+        if (compiled != NULL) {
+            if (pending != NULL) {
+                plang_unload(pending);
             }
+            pending = compiled;
+            compiled = NULL;
         }
-        return newop;
     }
 
-    if (!strcasecmp(code, "DEC")) {
-        if (params == NULL) {
-            syntaxerror("Syntax error", line);
-            freeop(newop);
-            return NULL;
+    if (reloadWanted && !compiling) {
+        reloadWanted = false;
+        compiling = pthread_create(&compiler, NULL, compileThread, NULL) == 0;
+    }
+
+    if (pending != NULL && allIdle(m) && plang_swap(m, pending)) {
+        // A profile is of one program, so it ends with it
+        finishProfile();
+        plang_unload(prog);
+        prog = pending;
+        pending = NULL;
+    }
+}
+
+// Apply a batch of input changes as they arrive. With edge queues they
+// go through plang_post(), which queues every edge. Without, a pin that
+// changes twice in the batch would look as if it hadn't moved, so the
+// scheduler gets a pass in between, as a replay does.
+void feedInputs(vm *m, const plang_input *changes, uint32_t count) {
+    if (m->queueDepth > 0) {
+        plang_post(m, changes, count, millis(m));
+        return;
+    }
+    uint64_t touched[PLANG_PIN_WORDS];
+    memset(touched, 0, sizeof(touched));
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t pin = changes[i].pin;
+        if (pin >= PLANG_MAX_PINS) {
+            continue;
         }
-        newop->vval1 = findVariable(params);
-        newop->opcode = DEC;
-        if(newop->vval1 == NULL) {
-            syntaxerror("Unknown variable", line);
-            freeop(newop);
-            return NULL;
+        uint64_t bit = 1ULL << (pin & 63);
+        if (touched[pin >> 6] & bit) {
+            schedulePass(m);
+            memset(touched, 0, sizeof(touched));
         }
-        return newop;
+        touched[pin >> 6] |= bit;
+        plang_inject(m, &changes[i], 1);
     }
+}
 
-    if (!strcasecmp(code, "INC")) {
-        if (params == NULL) {
-            syntaxerror("Syntax error", line);
-            freeop(newop);
-            return NULL;
+void plang_run(vm *m) {
+    startRun(m);
+    runInit(m);
+
+    updateIO(m);
+    while (1) {
+        checkReload(m);
+
+        int c;
+        bool changed = false;
+        while ((c = display_key()) != -1) {
+            if (c >= '0' && c <= '9') {
+                plang_input key = { (uint32_t)(c - '0'), (uint32_t)!digitalRead(m, c - '0') };
+                feedInputs(m, &key, 1);
+                changed = true;
+            } else if (c == 'q') {
+                return;
+            }
         }
-        newop->vval1 = findVariable(params);
-        newop->opcode = INC;
-        if(newop->vval1 == NULL) {
-            syntaxerror("Unknown variable", line);
-            freeop(newop);
-            return NULL;
+        const plang_input *changes;
+        uint32_t count = input_read(&changes);
+        if (count > 0) {
+            feedInputs(m, changes, count);
+            changed = true;
+        }
+        if (changed) {
+            updateIO(m);
         }
-        return newop;
-    }
 
-    if (!strcasecmp(code, "RETURN")) {
-        newop->opcode = RETURN;
-        return newop;
+        // Nothing runnable: sleep until there is something to do
+        if (!schedulePass(m)) {
+            waitForWork(m);
+        }
     }
+}
 
-    syntaxerror("Unknown command", line);
+// One input change from a trace
+struct tracerec {
+    uint32_t when;
+    uint32_t pin;
+    uint32_t level;
+};
 
-    return NULL;
+typedef struct tracerec tracerec;
+
+// Read the next record from an input trace. Returns false at the end of
+// the trace or on a bad line.
+static bool readTrace(FILE *f, uint32_t *lineno, tracerec *rec) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        (*lineno)++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) {
+            continue;
+        }
+        if (sscanf(p, "%u %u %u", &rec->when, &rec->pin, &rec->level) != 3 ||
+            rec->pin >= PLANG_MAX_PINS || rec->level > 1) {
+            syntaxerror("Bad trace record", *lineno);
+            return false;
+        }
+        return true;
+    }
+    return false;
 }
 
-op *findLabel(const char *label) {
-    op *scan = program;
-    while (scan) {
-        if (scan->label != NULL) {
-            if (!strcasecmp(scan->label, label)) {
-                return scan;
+// Read a whole input trace, up to the end or the first bad record, so that
+// any number of instances can replay it. Returns NULL if out of memory.
+tracerec *loadTrace(FILE *f, uint32_t *count) {
+    uint32_t cap = 1024;
+    uint32_t n = 0;
+    uint32_t lineno = 0;
+    tracerec *trace = (tracerec *)malloc(sizeof(tracerec) * cap);
+    while (trace != NULL && readTrace(f, &lineno, &trace[n])) {
+        if (++n == cap) {
+            cap *= 2;
+            tracerec *grown = (tracerec *)realloc(trace, sizeof(tracerec) * cap);
+            if (grown == NULL) {
+                free(trace);
+                return NULL;
             }
+            trace = grown;
         }
-        scan = scan->next;
     }
-    return NULL;
+    *count = n;
+    return trace;
 }
 
-// Scan through looking for labels. Update the alternate pointer to the
-// destination of the label.
-bool plang_pass2() {
-    op *scan = program;
-    while (scan) {
-        op *what = scan;
-        while ((what->opcode & 0xFFF0) == IF) {
-            what = what->alternate;
+// Run against a recorded input trace on the virtual clock. Time only moves
+// when nothing is runnable, and then jumps straight to the next input
+// change or delay deadline, so a replay is as fast as the CPU allows and
+// always produces the same output for the same trace. Stops when the trace
+// is used up and nothing is pending, or at until if that is non-zero.
+void plang_replay(vm *m, const tracerec *trace, uint32_t count, uint32_t until) {
+    uint32_t next = 0;
+    uint32_t spins = 0;
+
+    m->virtualTime = true;
+    m->vclock = 0;
+
+    startRun(m);
+    runInit(m);
+
+    while (1) {
+        // Apply every input change that is due. Changes to the same pin at
+        // the same time get a pass each so that short pulses aren't lost.
+        uint64_t touched[PLANG_PIN_WORDS];
+        memset(touched, 0, sizeof(touched));
+        while (next < count && (int32_t)(m->vclock - trace[next].when) >= 0) {
+            uint32_t pin = trace[next].pin;
+            uint64_t bit = 1ULL << (pin & 63);
+            if (touched[pin >> 6] & bit) {
+                break;
+            }
+            touched[pin >> 6] |= bit;
+            if (trace[next].level) {
+                m->ins[pin >> 6] |= bit;
+            } else {
+                m->ins[pin >> 6] &= ~bit;
+            }
+            next++;
         }
-        if ((what->opcode & 0xFFF0) == GOTO) {
-            op *lab = findLabel(what->cval1);
-            if (lab == NULL) {
-                syntaxerror("Unknown label", what->line);
-                return false;
+        updateIO(m);
+
+        if (schedulePass(m)) {
+            // Something is spinning. Let it run for a while at the same
+            // instant, but if it doesn't settle it must be waiting on the
+            // clock, so let time creep forward as it would for real.
+            if (++spins >= PLANG_SPIN_PASSES) {
+                m->vclock++;
             }
-            what->alternate = lab;
-            free(what->cval1);
-        } else if ((what->opcode & 0xFFF0) == CALL) {
-            op *lab = findLabel(what->cval1);
-            if (lab == NULL) {
-                syntaxerror("Unknown label", what->line);
-                return false;
+        } else {
+            spins = 0;
+            bool pending = false;
+            uint32_t wake = 0;
+            if (next < count) {
+                wake = trace[next].when;
+                pending = true;
             }
-            what->alternate = lab;
-            free(what->cval1);
-        } 
-        scan = scan->next;
-    }
+            if (m->ndelays > 0 && (!pending || (int32_t)(m->delays[0]->wake - wake) < 0)) {
+                wake = m->delays[0]->wake;
+                pending = true;
+            }
+            if (!pending) {
+                break;
+            }
+            if ((int32_t)(wake - m->vclock) > 0) {
+                m->vclock = wake;
+            }
+        }
 
-    event *escan = events;
-    while (escan) {
-        escan->entry = findLabel(escan->label);
-        if (escan->entry == NULL) {
-            syntaxerror("Unknown label", escan->line);
-            return false;
+        uint32_t frame;
+        if (m->devices) display_update(m->vclock, &frame);
+
+        if (until > 0 && (int32_t)(m->vclock - until) >= 0) {
+            break;
         }
-        //free(escan->label);
-        escan = escan->next;
     }
-    return true;
+
+    uint32_t frame;
+    if (m->devices) display_update(m->vclock, &frame);
 }
 
-bool plang_parse(char *line, uint32_t lineno) {
-    char *label = NULL;
-    char *opcode = NULL;
+// Number of input edges the benchmark times handler start latency over
+#ifndef PLANG_BENCH_EDGES
+#define PLANG_BENCH_EDGES 10000
+#endif
 
-    while (strlen(line) > 0 && line[strlen(line)-1] < ' ') {
-        line[strlen(line)-1] = 0;
-    }
-    if (strlen(line) == 0) {
-        return true;
+static uint64_t benchStarted;
+
+static void benchHandlerStart(event *e) {
+    if (benchStarted == 0) {
+        benchStarted = monotonic();
     }
+}
 
-    opcode = strtok(line, " \t");
-    if (opcode == NULL) {
-        return true;
+static void setPin(vm *m, uint32_t pin, uint32_t level) {
+    if (level) {
+        m->ins[pin >> 6] |= 1ULL << (pin & 63);
+    } else {
+        m->ins[pin >> 6] &= ~(1ULL << (pin & 63));
     }
-    if (opcode[0] == '#') {
-        return true;
+}
+
+// Run until nothing is left to do, skipping the virtual clock over delays.
+static void settle(vm *m) {
+    while (1) {
+        while (schedulePass(m));
+        if (m->ndelays == 0) {
+            return;
+        }
+        m->vclock = m->delays[0]->wake;
     }
-    if (opcode[strlen(opcode)-1] == ':') {
-        opcode[strlen(opcode)-1] = 0;
-        label = opcode;
-        opcode = strtok(NULL, " \t");
+}
+
+static int compareNanos(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *sorted, uint32_t n, uint32_t pct) {
+    if (n == 0) {
+        return 0;
     }
+    return sorted[(uint64_t)(n - 1) * pct / 100];
+}
 
-    // First the def directive. This isn't really a program instruction
-    // so we don't want to create an opcode for it.
+// Measure a loaded program and print the results as one line of JSON:
+// parse and link rate, interpreter speed running the "bench" label (null
+// if there isn't one), and the time from an input edge to the first instruction
+// of its handler. Runs on the virtual clock so delays cost nothing.
+void plang_bench(vm *m, const char *name, uint64_t parseNanos) {
+    script *prog = m->prog;
+    m->virtualTime = true;
+    m->vclock = 0;
 
-    if (!strcasecmp(opcode, "DEF")) {
-        variable *var = (variable *)malloc(sizeof(variable));
-        char *vname = strtok(NULL, " \t");
-        if (vname == NULL) {
-            syntaxerror("Syntax error", lineno);
-            return false;
+    startRun(m);
+    runInit(m);
+    settle(m);
+
+    uint64_t ops = 0;
+    uint64_t runNanos = 0;
+    uint32_t bench = findLabel(prog, "bench");
+    if (bench != PC_IDLE) {
+        context ctx;
+        ctxStart(&ctx, bench);
+        uint64_t t0 = monotonic();
+        while (ctx.pc != PC_IDLE) {
+            if (ctx.delaying) {
+                m->vclock = ctx.wake;
+                ctx.delaying = false;
+            }
+            ops += plang_exec(m, &ctx, m->budget);
         }
-        char *defval = strtok(NULL, " \t");
-        int dv;
-        if (defval != NULL) {
-            dv = atoi(defval);
-        } else {
-            dv = 0;
-        }
-    
-        var->name = strdup(vname);
-        var->value = dv;
-        var->next = NULL;
-        if (variables == NULL) {
-            variables = var;
-        } else {
-            variable *scan = variables;
-            while (scan->next) {
-                scan = scan->next;
+        runNanos = monotonic() - t0;
+    }
+
+    uint64_t *latency = (uint64_t *)malloc(sizeof(uint64_t) * PLANG_BENCH_EDGES);
+    uint32_t edges = 0;
+    if (prog->events && latency) {
+        onHandlerStart = benchHandlerStart;
+        event *e = prog->events;
+        for (uint32_t i = 0; i < PLANG_BENCH_EDGES; i++) {
+            // Park the pin on the far side of the edge the handler wants
+            uint32_t level = e->type == RISING ? 1 : e->type == FALLING ? 0 : !digitalRead(m, e->source);
+            setPin(m, e->source, !level);
+            settle(m);
+
+            benchStarted = 0;
+            setPin(m, e->source, level);
+            uint64_t t0 = monotonic();
+            schedulePass(m);
+            if (benchStarted) {
+                latency[edges++] = benchStarted - t0;
             }
-            scan->next = var;
+            settle(m);
+            e = e->next ? e->next : prog->events;
         }
-        return true;        
+        onHandlerStart = NULL;
+        qsort(latency, edges, sizeof(uint64_t), compareNanos);
     }
 
-    // Also the LINK command isn't a real command but an instruction
-    // to the language to link a specific function to an event.
+    uint32_t lines = prog->lines;
+    printf("{\"script\":\"%s\",\"lines\":%u,\"labels\":%u,\"variables\":%u,\"events\":%u,"
+        "\"parse_ns\":%llu,\"lines_per_sec\":%.0f,\"arena_bytes\":%zu,",
+        name, lines, prog->labels.count, prog->variables.count,
+        prog->rising.start[PLANG_MAX_PINS] + prog->falling.start[PLANG_MAX_PINS],
+        (unsigned long long)parseNanos, parseNanos ? lines * 1e9 / parseNanos : 0.0, prog->mem.reserved);
+    // Without a bench label there is no loop to measure, which isn't the
+    // same as a loop that did nothing
+    if (bench != PC_IDLE) {
+        printf("\"ops\":%llu,\"run_ns\":%llu,\"ops_per_sec\":%.0f,",
+            (unsigned long long)ops, (unsigned long long)runNanos, runNanos ? ops * 1e9 / runNanos : 0.0);
+    } else {
+        printf("\"ops\":null,\"run_ns\":null,\"ops_per_sec\":null,");
+    }
+    printf("\"edges\":%u,\"latency_ns\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}}\n",
+        edges, (unsigned long long)percentile(latency, edges, 50), (unsigned long long)percentile(latency, edges, 90),
+        (unsigned long long)percentile(latency, edges, 99), (unsigned long long)(edges ? latency[edges - 1] : 0));
+    free(latency);
+}
 
-    if (!strcasecmp(opcode, "LINK")) {
-        char *pin = strtok(NULL, " \t");
-        char *type = strtok(NULL, " \t");
-        char *label = strtok(NULL, " \t");
-        uint32_t ntype = 0;
-        uint32_t npin = 0;
+// Batch runs: many independent instances of one program, each replaying
+// the same trace on its own virtual clock, spread over a pool of threads.
+// Every worker starts with an even share of the instances in a deque. It
+// runs them from the back and, once its own are gone, steals from the
+// front of another worker's, so a few slow instances don't leave the
+// other cores idle.
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    uint32_t *queue;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t id;
+    struct batch *batch;
+    uint64_t ops;
+};
 
-        if (!strcasecmp(type, "RISING")) {
-            ntype = RISING;
-        } else if (!strcasecmp(type, "FALLING")) {
-            ntype = FALLING;
-        } else if (!strcasecmp(type, "CHANGE")) {
-            ntype = CHANGE;
-        } else {
-            syntaxerror("Bad event type", lineno);
-            return false;
-        }
+typedef struct worker worker;
 
-        if (isNumber(pin)) {
-            npin = atoi(pin);
-        } else {
-            variable *v = findVariable(pin);
-            if (v == NULL) {
-                syntaxerror("Unknown variable", lineno);
-                return false;
-            }
-            npin = v->value;
-        }
+struct batch {
+    vm **instances;
+    worker *workers;
+    uint32_t nworkers;
+    const tracerec *trace;
+    uint32_t count;
+    uint32_t until;
+};
 
-        addEvent(ntype, npin, label, lineno);
-        return true;
+typedef struct batch batch;
+
+// Find the next instance for w to run. Returns false when there are none
+// left anywhere.
+static bool takeWork(worker *w, uint32_t *inst) {
+    bool found = false;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail) {
+        *inst = w->queue[--w->tail];
+        found = true;
     }
+    pthread_mutex_unlock(&w->lock);
 
-    op *newop = createOpcode(label, opcode, strtok(NULL, "\0"), lineno);
-    if (newop == NULL) {
-        return false;
+    batch *b = w->batch;
+    for (uint32_t i = 1; !found && i < b->nworkers; i++) {
+        worker *victim = &b->workers[(w->id + i) % b->nworkers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            *inst = victim->queue[victim->head++];
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
     }
-    addOpcode(newop);
-    return true;
+    return found;
 }
 
-void plang_exec(op **where) {
-    char temp[1000];
-    int vars = (*where)->opcode & 0x000F;
-    uint32_t left;
-    uint32_t right;
-    int mode = 0;
+static void *batchWorker(void *arg) {
+    worker *w = (worker *)arg;
+    batch *b = w->batch;
+    uint32_t inst;
+    while (takeWork(w, &inst)) {
+        vm *m = b->instances[inst];
+        plang_replay(m, b->trace, b->count, b->until);
+        w->ops += m->ops;
+    }
+    return NULL;
+}
 
-    // Are we in a delay loop at the moment?
-    if (((*where)->opcode & 0xFFF0) == DELAY) {
-        if ((*where)->ival2 > 0) { // This is a delay we have started
-            uint32_t dellen = vars & V ? (*where)->vval1->value : (*where)->ival1;
-            // Still delaying?
-            if ((millis() - (*where)->ival2) < dellen) {
-                return;
-            } else {
-                // Delay finished - move on to the next op-code.
-                (*where)->ival2 = 0; // Cancel the delay
-                *where = (*where)->next;
-                return;
-            }
+// Run instances copies of s against the trace with threads workers.
+// Returns the instructions executed in total, and how long it took in
+// *nanos, or 0 if it couldn't be started.
+static uint64_t batchRun(script *s, uint32_t instances, uint32_t threads,
+    const tracerec *trace, uint32_t count, uint32_t until, uint64_t *nanos) {
+    batch b;
+    b.instances = (vm **)calloc(instances, sizeof(vm *));
+    b.workers = (worker *)calloc(threads, sizeof(worker));
+    b.nworkers = threads;
+    b.trace = trace;
+    b.count = count;
+    b.until = until;
+
+    uint64_t ops = 0;
+    bool ok = b.instances != NULL && b.workers != NULL;
+    for (uint32_t i = 0; ok && i < instances; i++) {
+        b.instances[i] = vm_create(s, NULL, NULL);
+        ok = b.instances[i] != NULL;
+    }
+
+    uint32_t share = (instances + threads - 1) / threads;
+    for (uint32_t t = 0; ok && t < threads; t++) {
+        worker *w = &b.workers[t];
+        w->id = t;
+        w->batch = &b;
+        w->queue = (uint32_t *)malloc(sizeof(uint32_t) * (share + 1));
+        pthread_mutex_init(&w->lock, NULL);
+        ok = w->queue != NULL;
+        for (uint32_t i = t * share; ok && i < instances && i < (t + 1) * share; i++) {
+            w->queue[w->tail++] = i;
         }
     }
 
-    bool result = false;
-    switch ((*where)->opcode & 0xFFF0) {
-        case NOP:
-            break;
-        case PLAY:
-            sprintf(temp, "aplay -q %s &", (*where)->cval1);
-            system(temp);
-            break;
-        case RETURN:
-            *where = pop();
-            return;
-        case MODE:
-            mode = (*where)->ival2;
-            if (mode == 1 && (*where)->ival3 == 1) {
-                mode = 2; // INPUT_PULLUP
-            }
-            pinMode(vars & V ? (*where)->vval1->value : (*where)->ival1, mode);
-            break;
-        case DISPLAY:
-            mvprintw(0, 0, "Display: %04d\n",
-                vars == L ? (*where)->ival1 : (*where)->vval1->value);
-            break;
-        case IF:
-            // Select the operator
-            left = vars & VL ? (*where)->vval1->value : (*where)->ival1;
-            right = vars & LV ? (*where)->vval3->value : (*where)->ival3;
-            switch ((*where)->ival2) {
-                case EQ: result = (left == right); break;
-                case GE: result = (left >= right); break;
-                case GT: result = (left > right); break;
-                case LE: result = (left <= right); break;
-                case LT: result = (left < right); break;
-                case READS: result = (digitalRead(left) == right); break;
-                default:
-                    syntaxerror("Bad operator", (*where)->line);
-                    break;
-            }
-            if (result) {
-                *where = (*where)->alternate;
-                return;
-            }
-            break;
-        case SET:
-            (*where)->vval1->value = (vars & V) ? (*where)->vval2->value : (*where)->ival2;
-            break;
-        case CALL:
-            push((*where)->next);
-            *where = (*where)->alternate;
-            return;
-        case GOTO:
-            *where = (*where)->alternate;
+    if (ok) {
+        uint32_t started = 0;
+        uint64_t t0 = monotonic();
+        while (started < threads &&
+            pthread_create(&b.workers[started].thread, NULL, batchWorker, &b.workers[started]) == 0) {
+            started++;
+        }
+        // Instances queued for a thread that couldn't be started get
+        // stolen by the others, or run here if none could.
+        if (started == 0) {
+            batchWorker(&b.workers[0]);
+        }
+        for (uint32_t t = 0; t < started; t++) {
+            pthread_join(b.workers[t].thread, NULL);
+        }
+        *nanos = monotonic() - t0;
+        for (uint32_t t = 0; t < threads; t++) {
+            ops += b.workers[t].ops;
+        }
+    }
+
+    for (uint32_t t = 0; b.workers != NULL && t < threads; t++) {
+        if (b.workers[t].queue != NULL) {
+            pthread_mutex_destroy(&b.workers[t].lock);
+            free(b.workers[t].queue);
+        }
+    }
+    for (uint32_t i = 0; b.instances != NULL && i < instances; i++) {
+        if (b.instances[i] != NULL) vm_destroy(b.instances[i]);
+    }
+    free(b.workers);
+    free(b.instances);
+    return ops;
+}
+
+// Run a batch of instances with 1, 2, 4 ... threads up to maxThreads and
+// print one line of JSON for each: total throughput, and the scaling
+// efficiency against a single thread (1.0 is perfectly linear).
+void plang_batch(script *s, const char *name, uint32_t instances, uint32_t maxThreads,
+    const tracerec *trace, uint32_t count, uint32_t until) {
+    double base = 0;
+    uint32_t threads = 1;
+    while (1) {
+        uint64_t nanos = 0;
+        uint64_t ops = batchRun(s, instances, threads, trace, count, until, &nanos);
+        if (ops == 0 && nanos == 0) {
+            printf("Unable to start a batch of %u instances\n", instances);
             return;
-        case DEC:
-            if ((*where)->vval1->value > 0) {
-                (*where)->vval1->value--;
-            }
-            break;
-        case INC:
-            (*where)->vval1->value++;
+        }
+        double rate = nanos ? ops * 1e9 / nanos : 0.0;
+        if (threads == 1) {
+            base = rate;
+        }
+        printf("{\"script\":\"%s\",\"instances\":%u,\"threads\":%u,\"ops\":%llu,\"run_ns\":%llu,"
+            "\"ops_per_sec\":%.0f,\"efficiency\":%.3f}\n",
+            name, instances, threads, (unsigned long long)ops, (unsigned long long)nanos,
+            rate, base > 0 ? rate / (base * threads) : 0.0);
+        fflush(stdout);
+        if (threads >= maxThreads) {
             break;
-        case DELAY:
-            (*where)->ival2 = millis();
-            return;
-        default: break;
+        }
+        threads = threads * 2 < maxThreads ? threads * 2 : maxThreads;
     }
-    *where = (*where)->next;
 }
 
-void updateIO() {
-    mvprintw(1, 0, "Inputs: ");
-    for (int i = 0; i < 10; i++) {
-        mvprintw(1, 10 + i, "%d", ins[i]);
+
+// A whole number from the command line, from lo to hi. Unlike atoi() this
+// turns down a sign, anything after the digits and values out of range.
+static bool parseCount(const char *arg, uint32_t lo, uint32_t hi, uint32_t *n) {
+    if (!isdigit((unsigned char)*arg)) {
+        return false;
     }
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (*end != 0 || errno == ERANGE || v < lo || v > hi) {
+        return false;
+    }
+    *n = v;
+    return true;
 }
 
-void plang_run() {
-    op *init = findLabel("init");
-    while (init) {
-        plang_exec(&init);
-    }
-    while (1) {
-        int c = getch();
-        switch (c) {
-            case '0': ins[0] = 1 - ins[0]; break;
-            case '1': ins[1] = 1 - ins[1]; break;
-            case '2': ins[2] = 1 - ins[2]; break;
-            case '3': ins[3] = 1 - ins[3]; break;
-            case '4': ins[4] = 1 - ins[4]; break;
-            case '5': ins[5] = 1 - ins[5]; break;
-            case '6': ins[6] = 1 - ins[6]; break;
-            case '7': ins[7] = 1 - ins[7]; break;
-            case '8': ins[8] = 1 - ins[8]; break;
-            case '9': ins[9] = 1 - ins[9]; break;
-            case 'q': return;
-        }
-        updateIO();
-        event *scan = events;
-        while (scan) {
-            if (scan->current != NULL) {
-                plang_exec(&(scan->current));
-            } else {
-                uint32_t n = digitalRead(scan->source);
-                if (n != scan->last) {
-                    scan->last = n;
-                    if (n == 0 && ((scan->type == FALLING) || (scan->type == CHANGE))) {
-                        scan->current = scan->entry;
-                    } else if (n == 1 && ((scan->type == RISING) || (scan->type == CHANGE))) {
-                        scan->current = scan->entry;
-                    }
-                }
+void usage() {
+    printf("Usage: plang [options] <script or image>\n");
+    printf("  -a, --audio <sink> Audio output: null, wav:<file>, aplay[:<device>]%s (default %s)\n",
+#ifdef PLANG_ALSA
+        ", alsa[:<device>]", "alsa"
+#else
+        "", "aplay"
+#endif
+    );
+    printf("  -b, --budget <n>   Instructions a handler may run before yielding (default %d)\n", PLANG_BUDGET);
+    printf("  -c, --compile <f>  Write the compiled program to an image that can be run in its place\n");
+    printf("  -e, --emit-c <f>   Translate the program to C, to be built with plrt.c\n");
+    printf("  -d, --display <d>  Display output: curses, null, log:<file> (default curses)\n");
+    printf("  -f, --fps <n>      Maximum display updates per second (default %d)\n", PLANG_FPS);
+    printf("  -i, --input <src>  Also take pin changes from fifo:<path>, unix:<path>, fd:<n> or evdev:<path>\n");
+    printf("  -l, --log <file>   Write a timestamped log of every DISPLAY and PLAY\n");
+    printf("  -p, --profile <f>  Count and time what runs; write <f>.txt and <f>.folded at exit\n");
+    printf("  -R, --record <f>   Record input changes to a trace file\n");
+    printf("  -r, --replay <f>   Run against an input trace on a virtual clock\n");
+    printf("  -u, --until <ms>   Stop a replay at this virtual time\n");
+    printf("  -Q, --queue <n>[:<policy>]\n");
+    printf("                     Queue up to n edges per event while its handler is busy; when full,\n");
+    printf("                     coalesce (default), drop-oldest or count\n");
+    printf("  -n, --batch <n>    Replay n instances at once on every core and report the scaling\n");
+    printf("  -j, --threads <n>  Most threads a batch may use (default one per core)\n");
+    printf("  -T, --dump <f>     Where the flight recorder is dumped on SIGUSR1 or a crash (default %s)\n", PLANG_TRACE_FILE);
+    printf("      --no-trace     Turn the flight recorder off\n");
+    printf("      --decode <f>   Print a flight recorder dump against the script\n");
+    printf("      --bench        Print load and run performance of the script as JSON\n");
+    printf("      --no-optimize  Run the code exactly as written\n");
+    printf("      --opt-report   Print what the optimizer changed\n");
+}
+
+// How the edge queues did, if there were any and they saw an edge
+void reportQueues(vm *m) {
+    script *s = m->prog;
+    plang_queue_info q;
+    bool any = false;
+    for (event *e = s->events; e; e = e->next) {
+        if (plang_queue_stats(m, e->index, &q) && q.edges > 0) {
+            if (!any) {
+                fprintf(stderr, "%6s %5s %10s %10s %7s %10s %8s  %s\n", "line", "pin", "edges", "overflows",
+                    "deepest", "mean_wait", "max_wait", "handler");
+                any = true;
             }
-            scan = scan->next;
+            // Edges that overflowed never waited in the queue, whatever
+            // the policy did with them
+            uint64_t queued = q.edges - q.overflows;
+            fprintf(stderr, "%6u %5u %10llu %10llu %7u %10.2f %8u  ", e->line, e->source,
+                (unsigned long long)q.edges, (unsigned long long)q.overflows, q.deepest,
+                queued ? (double)q.wait_total / queued : 0.0, q.wait_max);
+            printLabel(stderr, s, e->label);
+            fputc('\n', stderr);
         }
     }
 }
 
 void cleanexit() {
-    endwin();
+    audio_close();
+    display_close();
+    input_close();
+    finishProfile();
+    dumpRing = NULL;
+    if (running) {
+        reportQueues(running);
+        if (running->actionLog) fclose(running->actionLog);
+        if (running->recording) fclose(running->recording);
+        vm_destroy(running);
+    }
+    if (pending) plang_unload(pending);
+    if (prog) plang_unload(prog);
     return;
 }
 
@@ -857,47 +5935,287 @@ int main(int argc, char **argv) {
 
     atexit(cleanexit);
 
-    gettimeofday(&bootTime, NULL);
+    bootTime = monotonic();
+
 
+#ifdef PLANG_ALSA
+    const char *audio = "alsa";
+#else
+    const char *audio = "aplay";
+#endif
+    bool audioChosen = false;
 
-    FILE *f;
-    char temp[1024];
-    uint32_t lineno = 1;
+    const char *display = NULL;
+    uint32_t fps = PLANG_FPS;
+    const char *replay = NULL;
+    const char *logfile = NULL;
+    const char *recordfile = NULL;
+    uint32_t until = 0;
+    int bench = 0;
+    const char *compileTo = NULL;
+    const char *emitTo = NULL;
+    int noOptimize = 0;
+    int report = 0;
+    uint32_t instances = 0;
+    int noTrace = 0;
+    const char *traceFile = PLANG_TRACE_FILE;
+    const char *decode = NULL;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = cores > 0 ? cores : 1;
+
+    const struct option longopts[] = {
+        { "audio", required_argument, NULL, 'a' },
+        { "display", required_argument, NULL, 'd' },
+        { "fps", required_argument, NULL, 'f' },
+        { "budget", required_argument, NULL, 'b' },
+        { "compile", required_argument, NULL, 'c' },
+        { "emit-c", required_argument, NULL, 'e' },
+        { "input", required_argument, NULL, 'i' },
+        { "log", required_argument, NULL, 'l' },
+        { "profile", required_argument, NULL, 'p' },
+        { "record", required_argument, NULL, 'R' },
+        { "replay", required_argument, NULL, 'r' },
+        { "until", required_argument, NULL, 'u' },
+        { "queue", required_argument, NULL, 'Q' },
+        { "batch", required_argument, NULL, 'n' },
+        { "threads", required_argument, NULL, 'j' },
+        { "dump", required_argument, NULL, 'T' },
+        { "no-trace", no_argument, &noTrace, 1 },
+        { "decode", required_argument, NULL, 'D' },
+        { "bench", no_argument, &bench, 1 },
+        { "no-optimize", no_argument, &noOptimize, 1 },
+        { "opt-report", no_argument, &report, 1 },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:b:c:d:e:f:hi:j:l:n:p:Q:R:r:T:u:", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                audio = optarg;
+                audioChosen = true;
+                break;
+            case 'c':
+                compileTo = optarg;
+                break;
+            case 'e':
+                emitTo = optarg;
+                break;
+            case 'd':
+                display = optarg;
+                break;
+            case 'f':
+                fps = atoi(optarg);
+                break;
+            case 'i':
+                if (!input_open(optarg)) {
+                    printf("Unable to open input %s\n", optarg);
+                    return 10;
+                }
+                break;
+            case 'l':
+                logfile = optarg;
+                break;
+            case 'p':
+                profileBase = optarg;
+                break;
+            case 'T':
+                traceFile = optarg;
+                break;
+            case 'D':
+                decode = optarg;
+                break;
+            case 'R':
+                recordfile = optarg;
+                break;
+            case 'r':
+                replay = optarg;
+                break;
+            case 'u':
+                until = atoi(optarg);
+                break;
+            case 'Q': {
+                char *end;
+                queueDepth = strtoul(optarg, &end, 10);
+                if (*end == 0 || !strcmp(end, ":coalesce")) {
+                    queuePolicy = PLANG_COALESCE;
+                } else if (!strcmp(end, ":drop-oldest")) {
+                    queuePolicy = PLANG_DROP_OLDEST;
+                } else if (!strcmp(end, ":count")) {
+                    queuePolicy = PLANG_COUNT;
+                } else {
+                    printf("Unknown queue policy %s\n", end);
+                    return 10;
+                }
+                if (queueDepth < 1 || queueDepth > 1 << 20) {
+                    printf("Queue depth must be from 1 to %u\n", 1 << 20);
+                    return 10;
+                }
+                break;
+            }
+            case 'n':
+                if (!parseCount(optarg, 1, PLANG_MAX_INSTANCES, &instances)) {
+                    printf("Instances must be from 1 to %u\n", PLANG_MAX_INSTANCES);
+                    return 10;
+                }
+                break;
+            case 'j':
+                if (!parseCount(optarg, 1, PLANG_MAX_THREADS, &threads)) {
+                    printf("Threads must be from 1 to %u\n", PLANG_MAX_THREADS);
+                    return 10;
+                }
+                break;
+            case 'b':
+                if (!parseCount(optarg, 1, PLANG_MAX_BUDGET, &budget)) {
+                    printf("Budget must be from 1 to %u\n", PLANG_MAX_BUDGET);
+                    return 10;
+                }
+                break;
+            case 0:
+                break;
+            default:
+                usage();
+                return 10;
+        }
+    }
 
-    
-    if (argc != 2) {
-        printf("Usage: plang <script>\n");
+    if (optind != argc - 1) {
+        usage();
         return 10;
     }
 
-    f = fopen(argv[1], "r");
-    if (!f) {
-        printf("Unable to open %s\n", argv[1]);
+    optimize = !noOptimize;
+    optReport = report;
+
+    uint64_t loadStart = monotonic();
+
+    prog = plang_load(argv[optind]);
+    if (prog == NULL) {
         return 10;
     }
+    uint64_t loadNanos = monotonic() - loadStart;
+
+    if (decode != NULL) {
+        return decodeTrace(prog, decode) ? 0 : 10;
+    }
+
+    if (compileTo != NULL || emitTo != NULL) {
+        if (compileTo != NULL && !plang_write_image(prog, compileTo)) return 10;
+        if (emitTo != NULL && !plang_emit_c(prog, emitTo, argv[optind])) return 10;
+        return 0;
+    }
 
-    while (fgets(temp, 1023, f) > 0) {
-        if (!plang_parse(temp, lineno)) {
-            fclose(f);
+    FILE *trace = NULL;
+    if (replay != NULL) {
+        trace = fopen(replay, "r");
+        if (!trace) {
+            printf("Unable to open %s\n", replay);
             return 10;
         }
-        lineno++;
     }
 
-    fclose(f);
+    if (instances > 0) {
+        uint32_t count = 0;
+        tracerec *recs = trace ? loadTrace(trace, &count) : NULL;
+        if (trace) fclose(trace);
+        plang_batch(prog, argv[optind], instances, threads, recs, count, until);
+        free(recs);
+        return 0;
+    }
+
+    running = vm_create(prog, &cliHost, NULL);
+    if (running == NULL) {
+        printf("Out of memory\n");
+        return 10;
+    }
+    running->hostctx = running;
+    running->devices = true;
+    if (!noTrace) {
+        running->ring = trace_create(prog, traceFile);
+        dumpRing = running->ring;
+        catchSignals();
+    }
+    if (profileBase != NULL) {
+        profileName = argv[optind];
+        running->prof = profile_create(prog);
+        if (running->prof == NULL) {
+            printf("Out of memory\n");
+            return 10;
+        }
+    }
+
+    if (bench) {
+        plang_bench(running, argv[optind], loadNanos);
+        return 0;
+    }
+
+    fprintf(stderr, "%s: %u lines, %u instructions, %u variables, %u labels; %zu bytes in use, %zu reserved\n",
+        argv[optind], prog->lines, prog->codelen, prog->variables.count, prog->labels.count,
+        prog->mem.used, prog->mem.reserved);
+
+    if (logfile != NULL) {
+        running->actionLog = fopen(logfile, "w");
+        if (!running->actionLog) {
+            printf("Unable to open %s\n", logfile);
+            return 10;
+        }
+    }
+
+    if (trace != NULL) {
+        // A replay runs faster than real time, so there's nothing to hear
+        // and, unless asked for, nothing to see.
+        if (!display_open(display ? display : "null", 0)) {
+            printf("Unable to open display %s\n", display);
+            return 10;
+        }
+        uint32_t count = 0;
+        tracerec *recs = loadTrace(trace, &count);
+        fclose(trace);
+        if (recs == NULL) {
+            printf("Out of memory\n");
+            return 10;
+        }
+        plang_replay(running, recs, count, until);
+        free(recs);
+        return 0;
+    }
+
+    if (recordfile != NULL) {
+        running->recording = fopen(recordfile, "w");
+        if (!running->recording) {
+            printf("Unable to open %s\n", recordfile);
+            return 10;
+        }
+        fprintf(running->recording, "# plang input trace: <ms> <pin> <level>\n");
+    }
 
-    if (!plang_pass2()) { return 10; }
+    if (!audio_open(audio)) {
+        if (audioChosen || !audio_open("null")) {
+            printf("Unable to open audio output %s\n", audio);
+            return 10;
+        }
+        // Keep going without sound rather than not at all, but say so
+        fprintf(stderr, "Unable to open audio output %s; PLAY will be silent\n", audio);
+    }
+    if (!plang_load_samples(prog)) { return 10; }
+    if (!audio_start()) {
+        printf("Unable to start audio\n");
+        return 10;
+    }
 
-    initscr();
-    raw();
-    cbreak();
-    noecho();
-    timeout(0);
+    if (display == NULL) {
+        display = "curses";
+    }
+    if (!display_open(display, fps)) {
+        printf("Unable to open display %s\n", display);
+        return 10;
+    }
 
-    plang_run();
-    endwin();
+    watchScript(argv[optind]);
+    plang_run(running);
 
     return 0;
 }
 
-
+#endif
@@ -0,0 +1,139 @@
+#ifndef _PLANG_H
+#define _PLANG_H
+
+// Interface for running scripts inside another program, as built into
+// libplang.a. The host loads a script once, creates as many instances of
+// it as it likes and drives each one from its own loop: it injects input
+// changes, tells the instance what time it is and lets it run. Pins,
+// audio and display all go back to the host through the callbacks in
+// plang_host, so nothing here touches the terminal or the sound card.
+//
+// Time is whatever the host says it is, in milliseconds. DELAY and the
+// delay deadlines plang_run_slice() hands back are on the same clock.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct script plang_script;
+typedef struct vm plang_vm;
+
+// Pin modes passed to pin_mode(), as MODE sets them
+#define PLANG_OUTPUT 0
+#define PLANG_INPUT 1
+#define PLANG_INPUT_PULLUP 2
+
+// Slot of a variable that doesn't exist, and the wake time when nothing
+// is waiting on a DELAY
+#define PLANG_NOSLOT 0xFFFFFFFF
+#define PLANG_NOWAKE 0xFFFFFFFF
+
+// Callbacks into the host. Any of them may be NULL. ctx is whatever was
+// passed to plang_vm_create().
+struct plang_host {
+    void (*pin_mode)(void *ctx, uint32_t pin, uint32_t mode);
+    // Fill levels with the current inputs, one bit per pin, before each
+    // scheduling pass. If NULL, inputs only change through plang_inject().
+    void (*read_pins)(void *ctx, uint64_t *levels, uint32_t words);
+    void (*display)(void *ctx, uint32_t id, uint32_t value);
+    // sample is the script's own numbering, in order of first use; name
+    // is not NUL terminated.
+    void (*play)(void *ctx, uint32_t sample, const char *name, uint32_t len);
+};
+
+typedef struct plang_host plang_host;
+
+// One input change
+struct plang_input {
+    uint32_t pin;
+    uint32_t level;
+};
+
+typedef struct plang_input plang_input;
+
+// Load a script or compiled image from a file, or from memory (which is
+// copied, so it needn't outlive the call). Return NULL, having reported
+// why, if it can't be loaded.
+plang_script *plang_load(const char *filename);
+plang_script *plang_load_buffer(const char *src, size_t len);
+
+// Only once every instance of it has been destroyed
+void plang_unload(plang_script *s);
+
+// Slot of a variable by name, or PLANG_NOSLOT. For an array it is the slot
+// of the first element; the rest follow it.
+uint32_t plang_slot(plang_script *s, const char *name);
+
+// Start a new instance with its variables at their initial values. host
+// is copied. Returns NULL if out of memory.
+plang_vm *plang_vm_create(plang_script *s, const plang_host *host, void *ctx);
+void plang_vm_destroy(plang_vm *m);
+
+// Instructions a handler may run before it has to yield
+void plang_set_budget(plang_vm *m, uint32_t budget);
+
+// What a full edge queue does with another edge: drop it, leaving the
+// handler to catch up with the pin's level once the queue has emptied;
+// drop the oldest edge waiting to make room for it; or count it, and run
+// the handler once more for each edge counted after the queue has emptied.
+#define PLANG_COALESCE 0
+#define PLANG_DROP_OLDEST 1
+#define PLANG_COUNT 2
+
+// Give every event a queue of up to depth input edges, rounded up to a
+// power of two, so a burst of edges while its handler is busy runs the
+// handler once for each instead of being missed. Call before plang_start().
+// Returns 0 if out of memory, the policy is unknown or it already has them.
+int plang_queue_edges(plang_vm *m, uint32_t depth, uint32_t policy);
+
+// Feed input changes from a thread other than the one running the
+// instance, in order, each stamped with the time it happened. Edges go
+// straight onto the queues, so none are lost between passes however fast
+// they come. Only one thread may post to an instance, and once it has
+// plang_inject() and read_pins are no longer used.
+void plang_post(plang_vm *m, const plang_input *changes, uint32_t count, uint32_t now);
+
+// How an event's queue has done. The waits are from the edge to its
+// handler starting, in milliseconds.
+struct plang_queue_info {
+    uint64_t edges;
+    uint64_t overflows;
+    uint32_t deepest;
+    uint32_t wait_max;
+    uint64_t wait_total;
+};
+
+typedef struct plang_queue_info plang_queue_info;
+
+// event is numbered by LINK, from 0. Returns 0 if it has no queue.
+int plang_queue_stats(plang_vm *m, uint32_t event, plang_queue_info *stats);
+
+// Take the current input levels as the starting point and run init to
+// completion. Delays in init don't wait; they move the instance's clock on.
+void plang_start(plang_vm *m, uint32_t now);
+
+// Apply a batch of input changes. They are seen together on the next
+// pass, so a pin that goes and comes back within one batch has no edge.
+void plang_inject(plang_vm *m, const plang_input *changes, uint32_t count);
+
+// One scheduling pass at time now: start handlers for input edges and
+// give every runnable handler one budget. Returns 1 if some handler could
+// run again straight away.
+int plang_step(plang_vm *m, uint32_t now);
+
+// Run passes at time now until nothing is runnable or nanos have gone by.
+// Returns 1 if it stopped with work left to do, and sets *wake, if not
+// NULL, to when the next delay runs out or PLANG_NOWAKE.
+int plang_run_slice(plang_vm *m, uint32_t now, uint64_t nanos, uint32_t *wake);
+
+uint32_t plang_get(plang_vm *m, uint32_t slot);
+void plang_set(plang_vm *m, uint32_t slot, uint32_t value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
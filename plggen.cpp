@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+// Generates synthetic .plg scripts for benchmarking. The script has:
+//
+//  - a "bench" label running a countdown style DEC / IF ... GOTO loop,
+//  - one falling edge handler per event, spread over the input pins,
+//  - filler blocks of mixed instructions, jumping and calling between
+//    labels, until the requested number of lines is reached.
+//
+// With -x the handlers also do some arithmetic, signed and unsigned, using
+// infix expressions and the ADD to OR commands, index into an array and
+// tables, dispatch through ON ... CALL and ON ... GOTO, and nest an IF on
+// constants inside another.
+//
+// With -t it writes an input trace for such a script instead, in the format
+// plang --replay reads, toggling the pins the handlers are linked to.
+//
+// Output is fully determined by the options, so the same command line
+// always produces the same script or trace.
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(uint32_t range) {
+    // xorshift32
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed % range;
+}
+
+void usage() {
+    printf("Usage: plggen [options]\n");
+    printf("  -l, --lines <n>      Approximate number of lines (default 1000)\n");
+    printf("  -v, --variables <n>  Number of variables (default 100)\n");
+    printf("  -e, --events <n>     Number of linked events (default 10)\n");
+    printf("  -p, --pins <n>       Number of input pins to link events to (default 64)\n");
+    printf("  -n, --loop <n>       Iterations of the bench loop (default 1000000)\n");
+    printf("  -s, --seed <n>       Random seed (default 1)\n");
+    printf("  -t, --trace <n>      Write a trace of n input changes instead of a script\n");
+    printf("  -x, --expressions    Give the handlers arithmetic to do\n");
+}
+
+int main(int argc, char **argv) {
+    uint32_t lines = 1000;
+    uint32_t nvars = 100;
+    uint32_t nevents = 10;
+    uint32_t pins = 64;
+    uint32_t loop = 1000000;
+    uint32_t trace = 0;
+    bool exprs = false;
+
+    const struct option longopts[] = {
+        { "lines", required_argument, NULL, 'l' },
+        { "variables", required_argument, NULL, 'v' },
+        { "events", required_argument, NULL, 'e' },
+        { "pins", required_argument, NULL, 'p' },
+        { "loop", required_argument, NULL, 'n' },
+        { "seed", required_argument, NULL, 's' },
+        { "trace", required_argument, NULL, 't' },
+        { "expressions", no_argument, NULL, 'x' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:v:e:p:n:s:t:xh", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'l': lines = atoi(optarg); break;
+            case 'v': nvars = atoi(optarg); break;
+            case 'e': nevents = atoi(optarg); break;
+            case 'p': pins = atoi(optarg); break;
+            case 'n': loop = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            case 't': trace = atoi(optarg); break;
+            case 'x': exprs = true; break;
+            default:
+                usage();
+                return 10;
+        }
+    }
+
+    if (nvars < 1) nvars = 1;
+    if (pins < 1) pins = 1;
+    if (seed == 0) seed = 1;
+
+    if (trace > 0) {
+        // Inputs start high, as pulled-up pins do
+        uint32_t linked = nevents < pins ? nevents : pins;
+        if (linked < 1) linked = 1;
+        uint8_t *level = (uint8_t *)malloc(linked);
+        memset(level, 1, linked);
+        uint32_t when = 0;
+        static const uint32_t gaps[] = { 0, 1, 5, 20, 70, 300 };
+        printf("# Generated by plggen -t %u -e %u -p %u -s %u\n", trace, nevents, pins, seed);
+        for (uint32_t i = 0; i < trace; i++) {
+            when += gaps[rnd(sizeof(gaps) / sizeof(gaps[0]))];
+            uint32_t pin = rnd(linked);
+            level[pin] ^= 1;
+            printf("%u %u %u\n", when, pin, level[pin]);
+        }
+        free(level);
+        return 0;
+    }
+
+    uint32_t out = 0;
+
+    printf("# Generated by plggen -l %u -v %u -e %u -p %u -n %u%s\n", lines, nvars, nevents, pins, loop,
+        exprs ? " -x" : "");
+    out++;
+
+    for (uint32_t i = 0; i < nvars; i++) {
+        printf("def v%u %u\n", i, rnd(100));
+        out++;
+    }
+    printf("def n 0\n");
+    out++;
+    if (exprs) {
+        printf("def signed acc -%u\n", rnd(1000));
+        printf("def hist[8]\n");
+        printf("table wt %u %u %u %u %u %u %u %u\n", rnd(10), rnd(10), rnd(10), rnd(10), rnd(10), rnd(10),
+            rnd(10), rnd(10));
+        printf("table snd s0.wav s1.wav s2.wav\n");
+        out += 4;
+    }
+
+    for (uint32_t i = 0; i < nevents; i++) {
+        printf("link %u falling h%u\n", i % pins, i);
+        out++;
+    }
+
+    printf("init:       set n 0\n");
+    printf("            return\n");
+    out += 2;
+
+    printf("bench:      set n %u\n", loop);
+    printf("benchloop:  dec n\n");
+    printf("            if n gt 0 goto benchloop\n");
+    printf("            return\n");
+    out += 4;
+
+    if (exprs) {
+        for (uint32_t i = 0; i < 4; i++) {
+            printf("m%u: set acc acc + %u\n", i, 1 + rnd(9));
+            printf("    return\n");
+            out += 2;
+        }
+    }
+
+    for (uint32_t i = 0; i < nevents; i++) {
+        uint32_t v = rnd(nvars);
+        printf("h%u: inc v%u\n", i, v);
+        if (exprs) {
+            uint32_t w = rnd(nvars);
+            static const char *const cmds[] = { "add", "sub", "mul", "div", "mod", "and", "or" };
+            printf("    set acc (acc - v%u * %u) / %u + v%u %% 7\n", w, rnd(50), 1 + rnd(4), rnd(nvars));
+            printf("    if acc lt -%u set acc acc / -3 + v%u\n", rnd(500), v);
+            printf("    display acc\n");
+            printf("    %s v%u v%u %u\n", cmds[rnd(7)], w, rnd(nvars), rnd(20));
+            printf("    set v%u v%u %% 97 | v%u & 15\n", w, w, v);
+            printf("    inc hist[v%u %% 8]\n", v);
+            printf("    set hist[v%u & 7] hist[v%u %% 8] + wt[acc & 7]\n", w, v);
+            printf("    display hist[v%u & 7]\n", w);
+            printf("    play snd[v%u %% 3]\n", w);
+            // An IF whose own command is an IF on constants, which the
+            // optimizer folds away
+            printf("    if v%u lt 50 if %u gt %u goto h%uy\n", w, rnd(10), rnd(10), i);
+            printf("    on v%u %% 6 call m0, m1, , m2 else m3\n", v);
+            printf("    on v%u goto %u:h%uy, 40:h%uy, 1000:h%uy\n", w, rnd(30), i, i, i);
+            printf("h%uy: display acc\n", i);
+            out += 13;
+        }
+        printf("    display v%u\n", v);
+        printf("    if v%u gt 50 goto h%ux\n", v, i);
+        printf("    return\n");
+        printf("h%ux: set v%u 0\n", i, v);
+        printf("    play s%u.wav\n", i);
+        printf("    delay %u\n", rnd(100));
+        printf("    if %u reads 0 goto h%u\n", i % pins, i);
+        printf("    return\n");
+        out += 9;
+    }
+
+    // Filler: blocks of eight lines, each block a label, so the number of
+    // labels grows with the size of the script.
+    uint32_t blocks = out < lines ? (lines - out + 7) / 8 : 0;
+    for (uint32_t b = 0; b < blocks; b++) {
+        printf("f%u:  set v%u v%u\n", b, rnd(nvars), rnd(nvars));
+        printf("    inc v%u\n", rnd(nvars));
+        printf("    dec v%u\n", rnd(nvars));
+        printf("    if v%u lt %u goto f%u\n", rnd(nvars), rnd(100), rnd(blocks));
+        printf("    if v%u eq v%u call f%u\n", rnd(nvars), rnd(nvars), rnd(blocks));
+        printf("    display v%u\n", rnd(nvars));
+        printf("    set v%u %u\n", rnd(nvars), rnd(1000));
+        printf("    goto f%u\n", rnd(blocks));
+    }
+
+    return 0;
+}
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+
+#include "plrt.h"
+
+// Scheduling passes a replay lets a busy handler spin for before it starts
+// moving the virtual clock on. Must match the interpreter's
+// PLANG_SPIN_PASSES.
+#ifndef PLRT_SPIN_PASSES
+#define PLRT_SPIN_PASSES 1000
+#endif
+
+#ifndef PLRT_BUDGET
+#define PLRT_BUDGET 1000
+#endif
+
+// Most that --budget takes, as in the interpreter
+#define PLRT_MAX_BUDGET 1000000000
+
+struct handler {
+    plrt_context ctx;
+    uint32_t last;
+};
+
+typedef struct handler handler;
+
+static handler *handlers;
+static uint32_t budget = PLRT_BUDGET;
+
+// One bit per pin. The first ten start high like pulled-up inputs.
+static uint64_t ins[PLRT_PIN_WORDS] = { 0x3FF };
+static uint64_t prevPins[PLRT_PIN_WORDS];
+static uint64_t watched[PLRT_PIN_WORDS];
+
+static uint64_t bootTime;
+static bool virtualTime = false;
+static uint32_t vclock = 0;
+
+static FILE *actionLog = NULL;
+static uint32_t shown = PLRT_IDLE;
+
+static uint64_t monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t plrt_millis() {
+    if (virtualTime) {
+        return vclock;
+    }
+    return (monotonic() - bootTime) / 1000000ULL;
+}
+
+int plrt_read(uint32_t pin) {
+    if (pin < PLRT_MAX_PINS) {
+        return (ins[pin >> 6] >> (pin & 63)) & 1;
+    }
+    return 0;
+}
+
+__attribute__((weak)) void plrt_pin_mode(uint32_t pin, uint32_t mode) {
+}
+
+__attribute__((weak)) void plrt_show(uint32_t value) {
+    if (!virtualTime) {
+        printf("Display: %04u\n", value);
+    }
+}
+
+__attribute__((weak)) void plrt_play_sample(uint32_t id, const char *name) {
+}
+
+void plrt_display(uint32_t value) {
+    if (value != shown) {
+        shown = value;
+        plrt_show(value);
+    }
+    if (actionLog) fprintf(actionLog, "%u display %u %u\n", plrt_millis(), 0, value);
+}
+
+void plrt_play(uint32_t id) {
+    plrt_play_sample(id, plrt_samples[id]);
+    if (actionLog) fprintf(actionLog, "%u play %s\n", plrt_millis(), plrt_samples[id]);
+}
+
+void plrt_error(const char *msg, uint32_t line) {
+    printf("%s at line %d\n", msg, line);
+}
+
+static inline void ctxStart(plrt_context *ctx, uint32_t pc) {
+    ctx->pc = pc;
+    ctx->delaying = false;
+    ctx->sp = 0;
+}
+
+static inline bool wants(const plrt_link *l, uint32_t type) {
+    return l->type == type || l->type == PLRT_CHANGE;
+}
+
+// Earliest wake time of any delaying handler. Returns false if none are.
+static bool nextWake(uint32_t *wake) {
+    bool any = false;
+    for (uint32_t i = 0; i < plrt_nlinks; i++) {
+        plrt_context *ctx = &handlers[i].ctx;
+        if (ctx->pc != PLRT_IDLE && ctx->delaying && (!any || (int32_t)(ctx->wake - *wake) < 0)) {
+            *wake = ctx->wake;
+            any = true;
+        }
+    }
+    return any;
+}
+
+static void runInit() {
+    if (plrt_init == PLRT_IDLE) {
+        return;
+    }
+    plrt_context ctx;
+    ctxStart(&ctx, plrt_init);
+    while (ctx.pc != PLRT_IDLE) {
+        if (ctx.delaying) {
+            if (virtualTime) {
+                vclock = ctx.wake;
+            } else {
+                struct timespec ts;
+                uint64_t due = bootTime + (uint64_t)ctx.wake * 1000000ULL;
+                ts.tv_sec = due / 1000000000ULL;
+                ts.tv_nsec = due % 1000000000ULL;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+            ctx.delaying = false;
+        }
+        plrt_exec(&ctx, budget);
+    }
+}
+
+static void fireEdges(uint32_t pin, uint32_t level) {
+    uint32_t type = level ? PLRT_RISING : PLRT_FALLING;
+    for (uint32_t i = 0; i < plrt_nlinks; i++) {
+        handler *h = &handlers[i];
+        if (plrt_links[i].source == pin && wants(&plrt_links[i], type) && h->ctx.pc == PLRT_IDLE) {
+            h->last = level;
+            ctxStart(&h->ctx, plrt_links[i].pc);
+        }
+    }
+}
+
+// One trip round the scheduler, as schedulePass() in the interpreter.
+// Returns true if some handler still has work to do without waiting.
+static bool schedulePass() {
+    uint64_t cur[PLRT_PIN_WORDS];
+
+    uint32_t now = plrt_millis();
+    for (uint32_t i = 0; i < plrt_nlinks; i++) {
+        plrt_context *ctx = &handlers[i].ctx;
+        if (ctx->pc != PLRT_IDLE && ctx->delaying && (int32_t)(now - ctx->wake) >= 0) {
+            ctx->delaying = false;
+        }
+    }
+
+    memcpy(cur, ins, sizeof(ins));
+    for (uint32_t w = 0; w < PLRT_PIN_WORDS; w++) {
+        uint64_t diff = (cur[w] ^ prevPins[w]) & watched[w];
+        uint64_t up = diff & cur[w];
+        uint64_t down = diff & ~cur[w];
+        while (up) {
+            fireEdges(w * 64 + __builtin_ctzll(up), 1);
+            up &= up - 1;
+        }
+        while (down) {
+            fireEdges(w * 64 + __builtin_ctzll(down), 0);
+            down &= down - 1;
+        }
+        prevPins[w] = cur[w];
+    }
+
+    bool busy = false;
+    for (uint32_t i = 0; i < plrt_nlinks; i++) {
+        handler *h = &handlers[i];
+        if (h->ctx.pc == PLRT_IDLE || h->ctx.delaying) {
+            continue;
+        }
+        plrt_exec(&h->ctx, budget);
+        if (h->ctx.delaying) {
+            continue;
+        }
+        if (h->ctx.pc != PLRT_IDLE) {
+            busy = true;
+        } else {
+            // Finished: a level change while busy counts as an edge now
+            uint32_t source = plrt_links[i].source;
+            uint32_t n = (cur[source >> 6] >> (source & 63)) & 1;
+            if (n != h->last) {
+                h->last = n;
+                if (wants(&plrt_links[i], n ? PLRT_RISING : PLRT_FALLING)) {
+                    ctxStart(&h->ctx, plrt_links[i].pc);
+                    busy = true;
+                }
+            }
+        }
+    }
+    return busy;
+}
+
+static void startRun() {
+    handlers = (handler *)calloc(plrt_nlinks + 1, sizeof(handler));
+    memcpy(prevPins, ins, sizeof(ins));
+    for (uint32_t i = 0; i < plrt_nlinks; i++) {
+        ctxStart(&handlers[i].ctx, PLRT_IDLE);
+        handlers[i].last = plrt_read(plrt_links[i].source);
+        watched[plrt_links[i].source >> 6] |= 1ULL << (plrt_links[i].source & 63);
+    }
+}
+
+static bool readTrace(FILE *f, uint32_t *lineno, uint32_t *when, uint32_t *pin, uint32_t *level) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        (*lineno)++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) {
+            continue;
+        }
+        if (sscanf(p, "%u %u %u", when, pin, level) != 3 || *pin >= PLRT_MAX_PINS || *level > 1) {
+            printf("Bad trace record at line %d\n", *lineno);
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Run against a recorded input trace on the virtual clock, exactly as
+// plang_replay() does.
+static void replay(FILE *trace, uint32_t until) {
+    uint32_t lineno = 0;
+    uint32_t when, pin, level;
+    bool have = readTrace(trace, &lineno, &when, &pin, &level);
+    uint32_t spins = 0;
+
+    virtualTime = true;
+    vclock = 0;
+
+    startRun();
+    runInit();
+
+    while (1) {
+        uint64_t touched[PLRT_PIN_WORDS];
+        memset(touched, 0, sizeof(touched));
+        while (have && (int32_t)(vclock - when) >= 0) {
+            uint64_t bit = 1ULL << (pin & 63);
+            if (touched[pin >> 6] & bit) {
+                break;
+            }
+            touched[pin >> 6] |= bit;
+            if (level) {
+                ins[pin >> 6] |= bit;
+            } else {
+                ins[pin >> 6] &= ~bit;
+            }
+            have = readTrace(trace, &lineno, &when, &pin, &level);
+        }
+
+        if (schedulePass()) {
+            if (++spins >= PLRT_SPIN_PASSES) {
+                vclock++;
+            }
+        } else {
+            spins = 0;
+            bool pending = false;
+            uint32_t next = 0;
+            uint32_t wake;
+            if (have) {
+                next = when;
+                pending = true;
+            }
+            if (nextWake(&wake) && (!pending || (int32_t)(wake - next) < 0)) {
+                next = wake;
+                pending = true;
+            }
+            if (!pending) {
+                break;
+            }
+            if ((int32_t)(next - vclock) > 0) {
+                vclock = next;
+            }
+        }
+
+        if (until > 0 && (int32_t)(vclock - until) >= 0) {
+            break;
+        }
+    }
+}
+
+// Run in real time with keys 0-9 on stdin toggling the first ten pins, and
+// q to quit.
+static void run() {
+    startRun();
+    runInit();
+
+    bool open = true;
+    while (1) {
+        while (schedulePass());
+
+        struct pollfd pfd;
+        pfd.fd = open ? STDIN_FILENO : -1;
+        pfd.events = POLLIN;
+        uint32_t wake;
+        int timeout = -1;
+        if (nextWake(&wake)) {
+            int32_t left = wake - plrt_millis();
+            timeout = left > 0 ? left : 0;
+        }
+        if (poll(&pfd, 1, timeout) > 0) {
+            unsigned char c;
+            if (read(STDIN_FILENO, &c, 1) != 1) {
+                open = false;
+            } else if (c >= '0' && c <= '9') {
+                ins[0] ^= 1ULL << (c - '0');
+            } else if (c == 'q') {
+                return;
+            }
+        }
+    }
+}
+
+// A whole number from the command line, from lo to hi, with no sign or
+// anything after the digits
+static bool parseCount(const char *arg, uint32_t lo, uint32_t hi, uint32_t *n) {
+    if (*arg < '0' || *arg > '9') {
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (*end != 0 || errno == ERANGE || v < lo || v > hi) {
+        return false;
+    }
+    *n = v;
+    return true;
+}
+
+static void usage() {
+    printf("Usage: <program> [options]\n");
+    printf("  -b, --budget <n>   Instructions a handler may run before yielding (default %d)\n", PLRT_BUDGET);
+    printf("  -l, --log <file>   Write a timestamped log of every DISPLAY and PLAY\n");
+    printf("  -r, --replay <f>   Run against an input trace on a virtual clock\n");
+    printf("  -u, --until <ms>   Stop a replay at this virtual time\n");
+}
+
+int main(int argc, char **argv) {
+    const char *replayfile = NULL;
+    const char *logfile = NULL;
+    uint32_t until = 0;
+
+    bootTime = monotonic();
+
+    const struct option longopts[] = {
+        { "budget", required_argument, NULL, 'b' },
+        { "log", required_argument, NULL, 'l' },
+        { "replay", required_argument, NULL, 'r' },
+        { "until", required_argument, NULL, 'u' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:hl:r:u:", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                if (!parseCount(optarg, 1, PLRT_MAX_BUDGET, &budget)) {
+                    printf("Budget must be from 1 to %u\n", PLRT_MAX_BUDGET);
+                    return 10;
+                }
+                break;
+            case 'l':
+                logfile = optarg;
+                break;
+            case 'r':
+                replayfile = optarg;
+                break;
+            case 'u':
+                until = atoi(optarg);
+                break;
+            default:
+                usage();
+                return 10;
+        }
+    }
+
+    if (logfile != NULL) {
+        actionLog = fopen(logfile, "w");
+        if (!actionLog) {
+            printf("Unable to open %s\n", logfile);
+            return 10;
+        }
+    }
+
+    if (replayfile != NULL) {
+        FILE *trace = fopen(replayfile, "r");
+        if (!trace) {
+            printf("Unable to open %s\n", replayfile);
+            return 10;
+        }
+        replay(trace, until);
+        fclose(trace);
+    } else {
+        run();
+    }
+
+    if (actionLog) fclose(actionLog);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef _PLRT_H
+#define _PLRT_H
+
+// Runtime for scripts translated to C by plang --emit-c. The generated code
+// supplies the program, as the tables and plrt_exec() declared below; this
+// runtime supplies the scheduler, which behaves exactly like the one in the
+// interpreter, and the pins, audio and display.
+//
+// Pins, audio and display go through plrt_pin_mode(), plrt_read(),
+// plrt_show() and plrt_play_sample(). The versions here are weak, so a
+// device build can supply its own without touching anything else.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Must match the interpreter's PLANG_STACK_DEPTH
+#ifndef PLRT_STACK_DEPTH
+#define PLRT_STACK_DEPTH 16
+#endif
+
+#ifndef PLRT_MAX_PINS
+#define PLRT_MAX_PINS 256
+#endif
+#define PLRT_PIN_WORDS ((PLRT_MAX_PINS + 63) / 64)
+
+#define PLRT_IDLE 0xFFFFFFFF
+
+#define PLRT_FALLING 0
+#define PLRT_RISING 1
+#define PLRT_CHANGE 2
+
+struct plrt_context {
+    uint32_t pc;
+    uint32_t wake;
+    bool delaying;
+    uint32_t sp;
+    uint32_t stack[PLRT_STACK_DEPTH];
+};
+
+typedef struct plrt_context plrt_context;
+
+// A LINK, as compiled: which edge of which pin starts the handler at pc
+struct plrt_link {
+    uint32_t type;
+    uint32_t source;
+    uint32_t pc;
+};
+
+typedef struct plrt_link plrt_link;
+
+// Provided by the generated code
+extern uint32_t plrt_vars[];
+extern const char *const plrt_samples[];
+extern const plrt_link plrt_links[];
+extern const uint32_t plrt_nlinks;
+extern const uint32_t plrt_init;
+uint32_t plrt_exec(plrt_context *ctx, uint32_t budget);
+
+// Provided by the runtime, for the generated code
+uint32_t plrt_millis();
+int plrt_read(uint32_t pin);
+void plrt_pin_mode(uint32_t pin, uint32_t mode);
+void plrt_display(uint32_t value);
+void plrt_play(uint32_t id);
+void plrt_error(const char *msg, uint32_t line);
+
+// Device hooks
+void plrt_show(uint32_t value);
+void plrt_play_sample(uint32_t id, const char *name);
+
+// Division as the interpreter does it: by zero gives zero, and signed
+// overflow wraps round.
+static inline uint32_t plrt_div(uint32_t a, uint32_t b) {
+    return b ? a / b : 0;
+}
+
+static inline uint32_t plrt_mod(uint32_t a, uint32_t b) {
+    return b ? a % b : 0;
+}
+
+static inline uint32_t plrt_sdiv(uint32_t a, uint32_t b) {
+    if (b == 0) return 0;
+    if (b == 0xFFFFFFFF) return -a;
+    return (uint32_t)((int32_t)a / (int32_t)b);
+}
+
+static inline uint32_t plrt_smod(uint32_t a, uint32_t b) {
+    if (b == 0 || b == 0xFFFFFFFF) return 0;
+    return (uint32_t)((int32_t)a % (int32_t)b);
+}
+
+// Count an instruction against the budget, yielding at pc if it has run out.
+// The interpreter does the same before every instruction it dispatches.
+#define PLRT_STEP(n) do { if (budget-- == 0) { ctx->pc = (n); return start; } } while (0)
+
+// The same for the instruction after a statement's prelude, which runs in
+// the same turn however little budget is left, as in the interpreter.
+#define PLRT_HOLD() do { if (budget > 0) budget--; } while (0)
+
+#endif